@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "common.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+// Chunk payload starts right after its (aligned) header
+#define CHUNK_HDR_SIZE ALIGN_UP(sizeof(arena_chunk), ARENA_ALIGN)
+
+static void *pb_arena_alloc(void *allocator_data, size_t size) {
+	return arena_alloc(allocator_data, size);
+}
+
+static void pb_arena_free(void *allocator_data, void *ptr) {
+	// memory is reclaimed by reset_arena()
+}
+
+static void add_arena_chunk(msg_arena *arena, size_t size) {
+	arena_chunk *chunk;
+
+	gdprintf("Adding arena chunk of %zu bytes\n", size);
+	chunk = malloc_safe(CHUNK_HDR_SIZE + size);
+	chunk->size = size;
+	chunk->next = arena->head;
+	arena->head = chunk;
+	arena->used = 0;
+}
+
+void init_arena(msg_arena *arena) {
+	arena->head = NULL;
+	arena->used = 0;
+	arena->total = 0;
+	arena->allocator.alloc = pb_arena_alloc;
+	arena->allocator.free = pb_arena_free;
+	arena->allocator.allocator_data = arena;
+}
+
+void *arena_alloc(msg_arena *arena, size_t size) {
+	void *ptr;
+
+	size = ALIGN_UP(size, ARENA_ALIGN);
+	if (arena->head == NULL || arena->used + size > arena->head->size)
+		add_arena_chunk(arena, (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE);
+
+	ptr = (char *) arena->head + CHUNK_HDR_SIZE + arena->used;
+	arena->used += size;
+	arena->total += size;
+
+	return ptr;
+}
+
+void reset_arena(msg_arena *arena) {
+	size_t total = arena->total;
+
+	// If the last request did not fit in one chunk, replace the chunks
+	// with a single one big enough for it, so that steady-state requests
+	// keep bumping through the same memory. A chunk above ARENA_KEEP_MAX
+	// is not kept: the arena goes back to a default sized one.
+	if (total > ARENA_KEEP_MAX)
+		total = ARENA_CHUNK_SIZE;
+	if (arena->head != NULL && (arena->head->next != NULL || arena->head->size > ARENA_KEEP_MAX)) {
+		free_arena(arena);
+		add_arena_chunk(arena, (total > ARENA_CHUNK_SIZE) ? total : ARENA_CHUNK_SIZE);
+	}
+
+	arena->used = 0;
+	arena->total = 0;
+}
+
+void free_arena(msg_arena *arena) {
+	arena_chunk *chunk, *next;
+
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->head = NULL;
+	arena->used = 0;
+	arena->total = 0;
+}
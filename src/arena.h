@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "common.pb-c.h"
+
+/*
+ * Bump allocator for everything that lives only as long as one request:
+ * unpacked protobuf messages and fast path frame views. Allocation is a
+ * pointer bump, free is a no-op and the whole arena is reset once the
+ * request has been handled.
+ */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+// Chunks above this size are released on reset instead of being kept
+#define ARENA_KEEP_MAX (1024 * 1024)
+
+typedef struct arena_chunk_s {
+	struct arena_chunk_s *next;
+	size_t size;
+} arena_chunk;
+
+typedef struct msg_arena_s {
+	arena_chunk *head;	// current chunk, older ones follow
+	size_t used;		// bytes used in the current chunk
+	size_t total;		// bytes requested since the last reset
+	ProtobufCAllocator allocator;
+} msg_arena;
+
+void init_arena(msg_arena *arena);
+
+void *arena_alloc(msg_arena *arena, size_t size);
+
+void reset_arena(msg_arena *arena);
+
+void free_arena(msg_arena *arena);
+
+#endif /* ARENA_H */
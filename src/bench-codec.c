@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "utils.h"
+#include "common.pb-c.h"
+#include "protocol.h"
+#include "arena.h"
+
+/*
+ * Codec microbenchmark: the time and the heap allocations it takes to
+ * encode and decode the commands the wrapper sends, without any I/O.
+ *
+ *   bench-codec [-t min_seconds] [-s max_bytes] [-f filter] [-o results.json]
+ *
+ * Every command shape the wrapper produces is measured: small int/uint
+ * commands, a string, module images, memcpy payloads from 1 KB to
+ * max_bytes (1 GB by default, K, M or G suffixes) and kernel launches with
+ * parameter buffers. For each one it runs
+ *   pack         pack_cuda_cmd()
+ *   encode       pack_cuda_cmd() and encode_message(), as the client does
+ *   decode       decode_message() of that message into an arena, as the
+ *                server does, and the arena reset
+ * and for the fast path commands encode_fast_frame() and the decode of
+ * the frame as encode_fast and decode_fast; large fast path payloads are
+ * not part of the frame (see BULK_THRESHOLD), so they are not copied.
+ *
+ * As with Google Benchmark, every benchmark is repeated until it has run
+ * for min_seconds (0.5 by default), growing the iterations, and the
+ * output and the JSON (-o) have the same layout, so that its tools can
+ * compare two runs. Allocations are counted by wrapping malloc() and
+ * friends, which takes glibc; elsewhere they are reported as -1.
+ */
+
+#define DEFAULT_MIN_SECONDS 0.5
+#define DEFAULT_MAX_BYTES (1ULL << 30)
+#define MIN_PAYLOAD 1024
+#define MAX_ITERATIONS 1000000000L
+#define MAX_CASES 64
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+
+void *malloc(size_t size) {
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+#else
+#define COUNT_ALLOCS 0
+
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+#endif
+
+// A command as the wrapper hands it to the client
+typedef struct codec_case_s {
+	char name[64];
+	int type;
+	var vars[3];
+	var *args[3];
+	size_t arg_count;
+	uint64_t payload;	// bytes of BYTES argument
+	// encoded once, for the decode benchmarks
+	void *message;
+	size_t message_size;
+	void *frame;
+	size_t frame_size;
+} codec_case;
+
+typedef void (*bench_fn)(codec_case *c, msg_arena *arena);
+
+static codec_case cases[MAX_CASES];
+static int n_cases = 0;
+
+// Backing store of the arguments
+static int64_t int_arg = 0;
+static uint64_t uint_args[9] = { 0x7f0000001000, 4096, 1, 1, 256, 1, 1, 0x7f0000002000, 0 };
+static const char *func_name = "matSum";
+static uint8_t *payload_data;
+
+static void format_bytes(char *buf, size_t size, uint64_t bytes) {
+	if (bytes >= (1 << 30) && bytes % (1 << 30) == 0)
+		snprintf(buf, size, "%" PRIu64 "G", bytes >> 30);
+	else if (bytes >= (1 << 20) && bytes % (1 << 20) == 0)
+		snprintf(buf, size, "%" PRIu64 "M", bytes >> 20);
+	else if (bytes >= (1 << 10) && bytes % (1 << 10) == 0)
+		snprintf(buf, size, "%" PRIu64 "K", bytes >> 10);
+	else
+		snprintf(buf, size, "%" PRIu64, bytes);
+}
+
+static var *add_arg(codec_case *c, var_type type, uint32_t elements, uint64_t length, void *data) {
+	var *v = &c->vars[c->arg_count];
+
+	v->type = type;
+	v->elements = elements;
+	v->length = length;
+	v->data = data;
+	c->args[c->arg_count++] = v;
+
+	return v;
+}
+
+static codec_case *add_case(const char *name, int type) {
+	codec_case *c = &cases[n_cases++];
+
+	memset(c, 0, sizeof(*c));
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	c->type = type;
+
+	return c;
+}
+
+// The argument layouts of libcudawrapper.c
+static void add_cases(uint64_t max_bytes) {
+	codec_case *c;
+	uint64_t size;
+	char name[64], size_name[32];
+
+	c = add_case("DEVICE_GET_COUNT", DEVICE_GET_COUNT);
+	c = add_case("DEVICE_GET", DEVICE_GET);
+	add_arg(c, INT, 1, sizeof(int64_t), &int_arg);
+	c = add_case("DEVICE_GET_NAME", DEVICE_GET_NAME);
+	add_arg(c, INT, 1, sizeof(int64_t), &int_arg);
+	add_arg(c, UINT, 1, sizeof(uint64_t), uint_args);
+	c = add_case("CONTEXT_CREATE", CONTEXT_CREATE);
+	add_arg(c, UINT, 2, 2 * sizeof(uint64_t), uint_args);
+	c = add_case("MODULE_GET_FUNCTION", MODULE_GET_FUNCTION);
+	add_arg(c, UINT, 1, sizeof(uint64_t), uint_args);
+	add_arg(c, STRING, 1, sizeof(char *), &func_name);
+	c = add_case("MEMORY_ALLOCATE", MEMORY_ALLOCATE);
+	add_arg(c, UINT, 1, sizeof(uint64_t), uint_args + 1);
+	c = add_case("MEMORY_FREE", MEMORY_FREE);
+	add_arg(c, UINT, 1, sizeof(uint64_t), uint_args);
+	c = add_case("MEMCPY_DEV_TO_HOST", MEMCPY_DEV_TO_HOST);
+	add_arg(c, UINT, 2, 2 * sizeof(uint64_t), uint_args);
+
+	// A small PTX module and a large fat binary
+	for (size = 16 * 1024; size <= 4 * 1024 * 1024; size *= 256) {
+		format_bytes(size_name, sizeof(size_name), size);
+		snprintf(name, sizeof(name), "MODULE_LOAD/%s", size_name);
+		c = add_case(name, MODULE_LOAD);
+		add_arg(c, BYTES, 1, size, payload_data);
+		c->payload = size;
+	}
+
+	for (size = MIN_PAYLOAD; size <= max_bytes && n_cases < MAX_CASES - 2; size *= 4) {
+		format_bytes(size_name, sizeof(size_name), size);
+		snprintf(name, sizeof(name), "MEMCPY_HOST_TO_DEV/%s", size_name);
+		c = add_case(name, MEMCPY_HOST_TO_DEV);
+		add_arg(c, UINT, 1, sizeof(uint64_t), uint_args);
+		add_arg(c, BYTES, 1, size, payload_data);
+		c->payload = size;
+	}
+
+	// matSum's three pointers, and a kernel with many parameters
+	for (size = 24; size <= 384; size *= 16) {
+		snprintf(name, sizeof(name), "LAUNCH_KERNEL/%" PRIu64, size);
+		c = add_case(name, LAUNCH_KERNEL);
+		add_arg(c, UINT, 9, 9 * sizeof(uint64_t), uint_args);
+		add_arg(c, BYTES, 1, size, payload_data);
+		c->payload = size;
+	}
+}
+
+static void free_packed(void *payload) {
+	CudaCmd *cmd = payload;
+
+	free(cmd->extra_args);
+	free(cmd);
+}
+
+static void bench_pack(codec_case *c, msg_arena *arena) {
+	void *payload = NULL;
+
+	pack_cuda_cmd(&payload, c->args, c->arg_count, c->type);
+	free_packed(payload);
+}
+
+static void bench_encode(codec_case *c, msg_arena *arena) {
+	void *payload = NULL, *buffer = NULL;
+
+	pack_cuda_cmd(&payload, c->args, c->arg_count, c->type);
+	encode_message(&buffer, CUDA_CMD, 1, payload);
+	free_packed(payload);
+	free(buffer);
+}
+
+static void bench_decode(codec_case *c, msg_arena *arena) {
+	void *dec_msg = NULL, *payload = NULL;
+
+	// Past the length prefix, as the reader hands it out
+	if (decode_message(&dec_msg, &payload, c->message + sizeof(uint32_t),
+				c->message_size - sizeof(uint32_t), arena) != CUDA_CMD) {
+		fprintf(stderr, "Cannot decode %s\n", c->name);
+		exit(EXIT_FAILURE);
+	}
+	free_decoded_message(dec_msg, arena);
+	reset_arena(arena);
+}
+
+static void bench_encode_fast(codec_case *c, msg_arena *arena) {
+	void *buffer = NULL;
+
+	encode_fast_frame(&buffer, CUDA_CMD, c->type, 1, c->args, c->arg_count);
+	free(buffer);
+}
+
+static void bench_decode_fast(codec_case *c, msg_arena *arena) {
+	void *dec_msg = NULL, *payload = NULL;
+
+	if (decode_message(&dec_msg, &payload, c->frame + sizeof(uint32_t),
+				c->frame_size - sizeof(uint32_t), arena) != CUDA_CMD) {
+		fprintf(stderr, "Cannot decode the frame of %s\n", c->name);
+		exit(EXIT_FAILURE);
+	}
+	free_decoded_message(dec_msg, arena);
+	reset_arena(arena);
+}
+
+static int json_sep = 0;
+
+static void report(FILE *json, const char *name, long iterations, double ns, double allocs,
+		double bytes, uint64_t payload) {
+	double per_s = (ns > 0) ? payload * 1e9 / ns : 0;
+
+	printf("%-40s %12.0f ns %12ld %10.2f %14.0f", name, ns, iterations,
+			COUNT_ALLOCS ? allocs : -1, COUNT_ALLOCS ? bytes : -1);
+	if (payload > 0)
+		printf(" %10.3f GB/s", per_s / 1e9);
+	printf("\n");
+
+	if (json != NULL) {
+		fprintf(json, "%s\n    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n"
+				"      \"run_type\": \"iteration\",\n      \"iterations\": %ld,\n"
+				"      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\",\n"
+				"      \"allocs_per_iter\": %.3f,\n      \"alloc_bytes_per_iter\": %.0f",
+				json_sep++ ? "," : "", name, name, iterations, ns, ns,
+				COUNT_ALLOCS ? allocs : -1, COUNT_ALLOCS ? bytes : -1);
+		if (payload > 0)
+			fprintf(json, ",\n      \"bytes_per_second\": %.3f", per_s);
+		fprintf(json, "\n    }");
+	}
+}
+
+/*
+ * Runs fn for at least min_ns, growing the iterations as Google Benchmark
+ * does. Throughput is reported for the payload bytes fn copies, if any.
+ */
+static void run(FILE *json, const char *kind, codec_case *c, bench_fn fn, msg_arena *arena,
+		double min_ns, uint64_t copied) {
+	unsigned long allocs, bytes;
+	long iterations = 1, i, next;
+	uint64_t start, elapsed;
+	char name[128];
+	double multiplier;
+
+	snprintf(name, sizeof(name), "%s/%s", kind, c->name);
+	// Warm the arena up to the size of the message
+	fn(c, arena);
+
+	for (;;) {
+		allocs = alloc_count;
+		bytes = alloc_bytes;
+		start = now_ns();
+		for (i = 0; i < iterations; i++)
+			fn(c, arena);
+		elapsed = now_ns() - start;
+		allocs = alloc_count - allocs;
+		bytes = alloc_bytes - bytes;
+
+		if (elapsed >= min_ns || iterations >= MAX_ITERATIONS)
+			break;
+
+		// Aim 40% past the minimum, but grow at most tenfold at a time
+		multiplier = (elapsed > 0) ? min_ns * 1.4 / elapsed : 10;
+		if (multiplier > 10)
+			multiplier = 10;
+		next = (long) (iterations * multiplier);
+		iterations = (next > iterations) ? next : iterations + 1;
+	}
+
+	report(json, name, iterations, (double) elapsed / iterations,
+			(double) allocs / iterations, (double) bytes / iterations, copied);
+}
+
+int main(int argc, char *argv[]) {
+	const char *json_path = NULL, *filter = NULL;
+	double min_ns = DEFAULT_MIN_SECONDS * 1e9;
+	uint64_t max_bytes = DEFAULT_MAX_BYTES, max_payload;
+	void *payload = NULL;
+	msg_arena arena;
+	FILE *json = NULL;
+	codec_case *c;
+	time_t now;
+	char date[64];
+	int opt, i, bulk;
+
+	while ((opt = getopt(argc, argv, "t:s:f:o:")) != -1) {
+		switch (opt) {
+			case 't':
+				min_ns = atof(optarg) * 1e9;
+				break;
+			case 's':
+				max_bytes = parse_bytes(optarg, NULL);
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'o':
+				json_path = optarg;
+				break;
+			default:
+				printf("Usage: bench-codec [-t min_seconds] [-s max_bytes] [-f filter] [-o results.json]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	// Messages carry a 32-bit length
+	if (max_bytes < MIN_PAYLOAD || max_bytes > UINT32_MAX - 4096) {
+		fprintf(stderr, "max_bytes must be between %d and 4G\n", MIN_PAYLOAD);
+		exit(EXIT_FAILURE);
+	}
+
+	max_payload = (max_bytes > 4 * 1024 * 1024) ? max_bytes : 4 * 1024 * 1024;
+	payload_data = malloc_safe(max_payload);
+	memset(payload_data, 0xa5, max_payload);
+	add_cases(max_bytes);
+
+	if (json_path != NULL) {
+		json = fopen(json_path, "w");
+		if (json == NULL) {
+			perror("Cannot write the results");
+			exit(EXIT_FAILURE);
+		}
+		now = time(NULL);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+		fprintf(json, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": \"%s\",\n"
+				"    \"num_cpus\": %ld,\n    \"library_build_type\": \"release\"\n  },\n"
+				"  \"benchmarks\": [", date, argv[0], sysconf(_SC_NPROCESSORS_ONLN));
+	}
+
+	printf("%-40s %15s %12s %10s %14s %15s\n", "Benchmark", "Time", "Iterations", "allocs/op",
+			"alloc_bytes/op", "Throughput");
+	init_arena(&arena);
+	for (i = 0; i < n_cases; i++) {
+		c = &cases[i];
+		if (filter != NULL && strstr(c->name, filter) == NULL)
+			continue;
+
+		pack_cuda_cmd(&payload, c->args, c->arg_count, c->type);
+		c->message_size = encode_message(&c->message, CUDA_CMD, 1, payload);
+		free_packed(payload);
+
+		// pack_cuda_cmd() only points at the payload
+		run(json, "pack", c, bench_pack, &arena, min_ns, 0);
+		run(json, "encode", c, bench_encode, &arena, min_ns, c->payload);
+		run(json, "decode", c, bench_decode, &arena, min_ns, c->payload);
+		free(c->message);
+
+		if (!is_fast_cmd(c->type))
+			continue;
+		c->frame_size = encode_fast_frame(&c->frame, CUDA_CMD, c->type, 1, c->args, c->arg_count);
+		bulk = (c->payload >= BULK_THRESHOLD);
+		run(json, "encode_fast", c, bench_encode_fast, &arena, min_ns, bulk ? 0 : c->payload);
+		// Frames are decoded in place
+		run(json, "decode_fast", c, bench_decode_fast, &arena, min_ns, 0);
+		free(c->frame);
+	}
+	free_arena(&arena);
+
+	if (json != NULL) {
+		fprintf(json, "\n  ]\n}\n");
+		fclose(json);
+	}
+	free(payload_data);
+
+	return 0;
+}
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <cuda.h>
+
+#include "common.h"
+#include "utils.h"
+
+/*
+ * Measures the remoted driver API end to end, through the wrapper and a
+ * running server, the way test-cuda uses it:
+ *
+ *   LD_PRELOAD=./libcudawrapper.so ./bench-cuda [-n iterations]
+ *       [-s max_bytes] [-v bytes_per_size] [-k module] [-o results.json]
+ *
+ * First it times iterations round trips of each command type and reports
+ * their p50/p99/p99.9 latency. Then it measures host-to-device and
+ * device-to-host throughput for payloads of 4 bytes to max_bytes (4 GB by
+ * default) in steps of 4x, copying about bytes_per_size (256 MB) of each
+ * size but never fewer than 3 or more than iterations copies. The sweep
+ * stops at the first size that cannot be allocated. Byte counts take a
+ * K, M or G suffix.
+ *
+ * With -o the results are also written as JSON, along with the GPUSOCK_*
+ * variables of the run, so that builds and transport settings can be
+ * compared. LAUNCH_KERNEL runs matSum from the module given with -k
+ * (matSumKernel.ptx by default) and is left out if it cannot be loaded.
+ * Run without the wrapper, it measures the local driver as a baseline.
+ */
+
+#define DEFAULT_ITERATIONS 10000
+#define DEFAULT_MAX_BYTES (4ULL << 30)
+#define DEFAULT_BYTES_PER_SIZE (256ULL << 20)
+#define DEFAULT_MODULE "matSumKernel.ptx"
+#define MIN_BYTES 4
+#define MIN_COPIES 3
+#define SMALL_ALLOC 256
+
+typedef struct latency_stats_s {
+	const char *name;
+	long samples;
+	double min_us;
+	double mean_us;
+	double p50_us;
+	double p99_us;
+	double p999_us;
+	double max_us;
+} latency_stats;
+
+typedef struct throughput_stats_s {
+	const char *direction;
+	uint64_t bytes;
+	long copies;
+	double mb_per_s;
+	double p50_us;
+} throughput_stats;
+
+typedef struct bench_ctx_s {
+	long iterations;
+	uint64_t *samples;	// ns, one per iteration
+	CUdevice device;
+	CUfunction function;
+	int has_function;
+	CUdeviceptr d_a, d_b, d_c;
+	void *launch_args;
+	size_t launch_args_len;
+} bench_ctx;
+
+static void check(CUresult res, const char *call) {
+	if (res != CUDA_SUCCESS) {
+		fprintf(stderr, "%s failed: %d\n", call, res);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void summarize(latency_stats *stats, const char *name, uint64_t *samples, long n) {
+	double sum = 0;
+	long i;
+
+	qsort(samples, n, sizeof(*samples), compare_u64);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	stats->name = name;
+	stats->samples = n;
+	stats->min_us = samples[0] / 1e3;
+	stats->mean_us = sum / n / 1e3;
+	stats->p50_us = percentile_us(samples, n, 0.50);
+	stats->p99_us = percentile_us(samples, n, 0.99);
+	stats->p999_us = percentile_us(samples, n, 0.999);
+	stats->max_us = samples[n - 1] / 1e3;
+}
+
+// Runs one call of a command type, which is timed around it
+static void run_command(bench_ctx *ctx, int cmd_type, long i, CUdeviceptr *ptrs) {
+	CUdevice device;
+	char name[256];
+	int count, value = (int) i;
+	void *extra[] = {
+		CU_LAUNCH_PARAM_BUFFER_POINTER, ctx->launch_args,
+		CU_LAUNCH_PARAM_BUFFER_SIZE, &ctx->launch_args_len,
+		CU_LAUNCH_PARAM_END
+	};
+
+	switch (cmd_type) {
+		case DEVICE_GET_COUNT:
+			check(cuDeviceGetCount(&count), "cuDeviceGetCount");
+			break;
+		case DEVICE_GET:
+			check(cuDeviceGet(&device, 0), "cuDeviceGet");
+			break;
+		case DEVICE_GET_NAME:
+			check(cuDeviceGetName(name, sizeof(name), ctx->device), "cuDeviceGetName");
+			break;
+		case MEMORY_ALLOCATE:
+			check(cuMemAlloc(&ptrs[i], SMALL_ALLOC), "cuMemAlloc");
+			break;
+		case MEMORY_FREE:
+			check(cuMemFree(ptrs[i]), "cuMemFree");
+			break;
+		case MEMCPY_HOST_TO_DEV:
+			check(cuMemcpyHtoD(ctx->d_a, &value, sizeof(value)), "cuMemcpyHtoD");
+			break;
+		case MEMCPY_DEV_TO_HOST:
+			check(cuMemcpyDtoH(&value, ctx->d_a, sizeof(value)), "cuMemcpyDtoH");
+			break;
+		case LAUNCH_KERNEL:
+			check(cuLaunchKernel(ctx->function, 1, 1, 1, 1, 1, 1, 0, 0, NULL, extra), "cuLaunchKernel");
+			break;
+		case CONTEXT_SYNCHRONIZE:
+			check(cuCtxSynchronize(), "cuCtxSynchronize");
+			break;
+	}
+}
+
+static void bench_command(bench_ctx *ctx, latency_stats *stats, int cmd_type, const char *name) {
+	CUdeviceptr *ptrs = NULL;
+	long i, warmup = ctx->iterations / 10 + 1;
+	uint64_t start;
+
+	// Allocations are timed first, and the same buffers are then freed
+	if (cmd_type == MEMORY_ALLOCATE || cmd_type == MEMORY_FREE) {
+		ptrs = malloc_safe(sizeof(*ptrs) * ctx->iterations);
+		for (i = 0; i < ctx->iterations; i++) {
+			start = now_ns();
+			run_command(ctx, MEMORY_ALLOCATE, i, ptrs);
+			ctx->samples[i] = now_ns() - start;
+		}
+		if (cmd_type == MEMORY_FREE) {
+			for (i = 0; i < ctx->iterations; i++) {
+				start = now_ns();
+				run_command(ctx, MEMORY_FREE, i, ptrs);
+				ctx->samples[i] = now_ns() - start;
+			}
+		} else {
+			for (i = 0; i < ctx->iterations; i++)
+				run_command(ctx, MEMORY_FREE, i, ptrs);
+		}
+		free(ptrs);
+	} else {
+		for (i = 0; i < warmup; i++)
+			run_command(ctx, cmd_type, i, NULL);
+		for (i = 0; i < ctx->iterations; i++) {
+			start = now_ns();
+			run_command(ctx, cmd_type, i, NULL);
+			ctx->samples[i] = now_ns() - start;
+		}
+	}
+
+	summarize(stats, name, ctx->samples, ctx->iterations);
+	printf("%-20s %8ld %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, stats->samples,
+			stats->min_us, stats->mean_us, stats->p50_us, stats->p99_us, stats->p999_us, stats->max_us);
+}
+
+static long copies_of(uint64_t bytes, uint64_t bytes_per_size, long iterations) {
+	uint64_t copies = bytes_per_size / bytes;
+
+	if (copies > (uint64_t) iterations)
+		copies = iterations;
+
+	return (copies < MIN_COPIES) ? MIN_COPIES : copies;
+}
+
+static void time_copies(bench_ctx *ctx, throughput_stats *stats, int htod, CUdeviceptr dptr, void *host, uint64_t bytes, long copies) {
+	uint64_t start, total = 0;
+	long i;
+
+	for (i = 0; i < copies; i++) {
+		start = now_ns();
+		if (htod)
+			check(cuMemcpyHtoD(dptr, host, bytes), "cuMemcpyHtoD");
+		else
+			check(cuMemcpyDtoH(host, dptr, bytes), "cuMemcpyDtoH");
+		ctx->samples[i] = now_ns() - start;
+		total += ctx->samples[i];
+	}
+	qsort(ctx->samples, copies, sizeof(*ctx->samples), compare_u64);
+
+	stats->direction = htod ? "htod" : "dtoh";
+	stats->bytes = bytes;
+	stats->copies = copies;
+	stats->mb_per_s = (double) bytes * copies / (total / 1e9) / 1e6;
+	stats->p50_us = percentile_us(ctx->samples, copies, 0.50);
+	printf("%-6s %14" PRIu64 " %8ld %12.2f %12.2f\n", stats->direction, bytes, copies,
+			stats->mb_per_s, stats->p50_us);
+}
+
+// Returns the number of results, two per size that could be measured
+static int bench_throughput(bench_ctx *ctx, throughput_stats *stats, uint64_t max_bytes, uint64_t bytes_per_size) {
+	CUdeviceptr dptr;
+	uint64_t bytes, i;
+	uint8_t *src, *dst;
+	long copies;
+	int n = 0;
+
+	for (bytes = MIN_BYTES; bytes <= max_bytes; bytes *= 4) {
+		src = malloc(bytes);
+		dst = malloc(bytes);
+		if (src == NULL || dst == NULL || cuMemAlloc(&dptr, bytes) != CUDA_SUCCESS) {
+			fprintf(stderr, "Cannot allocate %" PRIu64 " bytes, stopping\n", bytes);
+			free(src);
+			free(dst);
+			break;
+		}
+		for (i = 0; i < bytes; i++)
+			src[i] = i * 7 + 1;
+
+		copies = copies_of(bytes, bytes_per_size, ctx->iterations);
+		time_copies(ctx, &stats[n++], 1, dptr, src, bytes, copies);
+		time_copies(ctx, &stats[n++], 0, dptr, dst, bytes, copies);
+		if (memcmp(src, dst, bytes) != 0) {
+			fprintf(stderr, "Data of %" PRIu64 " bytes came back different\n", bytes);
+			exit(EXIT_FAILURE);
+		}
+
+		check(cuMemFree(dptr), "cuMemFree");
+		free(src);
+		free(dst);
+		if (bytes > max_bytes / 4)
+			break;
+	}
+
+	return n;
+}
+
+static void write_json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void write_json(const char *path, bench_ctx *ctx, latency_stats *lat, int n_lat, throughput_stats *tp, int n_tp) {
+	extern char **environ;
+	char **env, *eq;
+	FILE *f;
+	int i, sep = 0;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror("Cannot write the results");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(f, "{\n  \"iterations\": %ld,\n  \"settings\": {", ctx->iterations);
+	for (env = environ; *env != NULL; env++) {
+		if (strncmp(*env, "GPUSOCK_", 8) != 0 || (eq = strchr(*env, '=')) == NULL)
+			continue;
+		*eq = '\0';
+		fprintf(f, "%s\n    ", sep++ ? "," : "");
+		write_json_string(f, *env);
+		fprintf(f, ": ");
+		write_json_string(f, eq + 1);
+		*eq = '=';
+	}
+	fprintf(f, "\n  },\n  \"latency\": [");
+	for (i = 0; i < n_lat; i++) {
+		fprintf(f, "%s\n    {\"command\": \"%s\", \"samples\": %ld, \"min_us\": %.3f, \"mean_us\": %.3f, "
+				"\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+				i ? "," : "", lat[i].name, lat[i].samples, lat[i].min_us, lat[i].mean_us,
+				lat[i].p50_us, lat[i].p99_us, lat[i].p999_us, lat[i].max_us);
+	}
+	fprintf(f, "\n  ],\n  \"throughput\": [");
+	for (i = 0; i < n_tp; i++) {
+		fprintf(f, "%s\n    {\"direction\": \"%s\", \"bytes\": %" PRIu64 ", \"copies\": %ld, "
+				"\"mb_per_s\": %.3f, \"p50_us\": %.3f}",
+				i ? "," : "", tp[i].direction, tp[i].bytes, tp[i].copies, tp[i].mb_per_s, tp[i].p50_us);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+}
+
+static void load_kernel(bench_ctx *ctx, const char *module_path) {
+	CUmodule module;
+
+	if (access(module_path, R_OK) != 0 || cuModuleLoad(&module, module_path) != CUDA_SUCCESS ||
+			cuModuleGetFunction(&ctx->function, module, "matSum") != CUDA_SUCCESS) {
+		fprintf(stderr, "Cannot load matSum from %s, skipping LAUNCH_KERNEL\n", module_path);
+		return;
+	}
+	ctx->has_function = 1;
+
+	check(cuMemAlloc(&ctx->d_b, sizeof(int)), "cuMemAlloc");
+	check(cuMemAlloc(&ctx->d_c, sizeof(int)), "cuMemAlloc");
+	ctx->launch_args_len = 3 * sizeof(CUdeviceptr);
+	ctx->launch_args = malloc_safe(ctx->launch_args_len);
+	memcpy(ctx->launch_args, &ctx->d_a, sizeof(CUdeviceptr));
+	memcpy(ctx->launch_args + sizeof(CUdeviceptr), &ctx->d_b, sizeof(CUdeviceptr));
+	memcpy(ctx->launch_args + 2 * sizeof(CUdeviceptr), &ctx->d_c, sizeof(CUdeviceptr));
+}
+
+int main(int argc, char *argv[]) {
+	static const struct {
+		int type;
+		const char *name;
+	} commands[] = {
+		{ DEVICE_GET_COUNT, "DEVICE_GET_COUNT" },
+		{ DEVICE_GET, "DEVICE_GET" },
+		{ DEVICE_GET_NAME, "DEVICE_GET_NAME" },
+		{ MEMORY_ALLOCATE, "MEMORY_ALLOCATE" },
+		{ MEMORY_FREE, "MEMORY_FREE" },
+		{ MEMCPY_HOST_TO_DEV, "MEMCPY_HOST_TO_DEV" },
+		{ MEMCPY_DEV_TO_HOST, "MEMCPY_DEV_TO_HOST" },
+		{ LAUNCH_KERNEL, "LAUNCH_KERNEL" },
+		{ CONTEXT_SYNCHRONIZE, "CONTEXT_SYNCHRONIZE" },
+	};
+	const int n_commands = sizeof(commands) / sizeof(commands[0]);
+	latency_stats lat[sizeof(commands) / sizeof(commands[0])];
+	throughput_stats tp[64];
+	uint64_t max_bytes = DEFAULT_MAX_BYTES, bytes_per_size = DEFAULT_BYTES_PER_SIZE;
+	const char *module_path = DEFAULT_MODULE, *json_path = NULL;
+	bench_ctx ctx = { .iterations = DEFAULT_ITERATIONS };
+	CUcontext context;
+	int opt, i, n_lat = 0, n_tp;
+
+	while ((opt = getopt(argc, argv, "n:s:v:k:o:")) != -1) {
+		switch (opt) {
+			case 'n':
+				ctx.iterations = atol(optarg);
+				break;
+			case 's':
+				max_bytes = parse_bytes(optarg, NULL);
+				break;
+			case 'v':
+				bytes_per_size = parse_bytes(optarg, NULL);
+				break;
+			case 'k':
+				module_path = optarg;
+				break;
+			case 'o':
+				json_path = optarg;
+				break;
+			default:
+				printf("Usage: bench-cuda [-n iterations] [-s max_bytes] [-v bytes_per_size] "
+						"[-k module] [-o results.json]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (ctx.iterations <= 0 || max_bytes < MIN_BYTES) {
+		fprintf(stderr, "iterations must be positive and max_bytes at least %d\n", MIN_BYTES);
+		exit(EXIT_FAILURE);
+	}
+	ctx.samples = malloc_safe(sizeof(*ctx.samples) *
+			((ctx.iterations > MIN_COPIES) ? ctx.iterations : MIN_COPIES));
+
+	check(cuInit(0), "cuInit");
+	check(cuDeviceGet(&ctx.device, 0), "cuDeviceGet");
+	check(cuCtxCreate(&context, 0, ctx.device), "cuCtxCreate");
+	check(cuMemAlloc(&ctx.d_a, sizeof(int)), "cuMemAlloc");
+	load_kernel(&ctx, module_path);
+
+	printf("%-20s %8s %10s %10s %10s %10s %10s %10s\n", "command", "samples",
+			"min_us", "mean_us", "p50_us", "p99_us", "p99.9_us", "max_us");
+	for (i = 0; i < n_commands; i++) {
+		if (commands[i].type == LAUNCH_KERNEL && !ctx.has_function)
+			continue;
+		bench_command(&ctx, &lat[n_lat++], commands[i].type, commands[i].name);
+	}
+
+	printf("\n%-6s %14s %8s %12s %12s\n", "dir", "bytes", "copies", "MB/s", "p50_us");
+	n_tp = bench_throughput(&ctx, tp, max_bytes, bytes_per_size);
+
+	if (json_path != NULL)
+		write_json(json_path, &ctx, lat, n_lat, tp, n_tp);
+
+	cuMemFree(ctx.d_a);
+	if (ctx.has_function) {
+		cuMemFree(ctx.d_b);
+		cuMemFree(ctx.d_c);
+		free(ctx.launch_args);
+	}
+	cuCtxDestroy(context);
+	free(ctx.samples);
+
+	return 0;
+}
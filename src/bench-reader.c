@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "common.pb-c.h"
+#include "protocol.h"
+
+/*
+ * Measures receive syscalls per command: a writer process sends MEMORY_FREE
+ * fast path frames in bursts and waits for a 1-byte ack after each burst,
+ * while the reader side consumes them either with receive_message_into()
+ * (length + body reads) or with the buffered conn_reader.
+ *
+ * Usage: bench-reader [commands] [burst]
+ */
+
+#define DEFAULT_COMMANDS 100000
+#define DEFAULT_BURST 16
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void run_writer(int sock_fd, long commands, long burst) {
+	void *frame = NULL, *buffer;
+	size_t frame_size;
+	uint64_t dptr = 0x1000;
+	var arg = { .type = UINT, .length = sizeof(uint64_t), .elements = 1, .data = &dptr },
+		*args[] = { &arg };
+	long i, j, n;
+	char ack;
+
+	frame_size = encode_fast_frame(&frame, CUDA_CMD, MEMORY_FREE, 0, args, 1);
+	buffer = malloc_safe(frame_size * burst);
+	for (j = 0; j < burst; j++)
+		memcpy(buffer + j * frame_size, frame, frame_size);
+
+	for (i = 0; i < commands; i += n) {
+		n = (commands - i < burst) ? commands - i : burst;
+		write_socket(sock_fd, buffer, frame_size * n);
+		read_socket(sock_fd, &ack, 1);
+	}
+
+	free(frame);
+	free(buffer);
+}
+
+static void run_bench(const char *name, int buffered, long commands, long burst) {
+	int sv[2];
+	pid_t pid;
+	long i;
+	char ack = 0;
+	void *msg;
+	uint32_t msg_length;
+	uint64_t rx_start;
+	conn_reader reader;
+	msg_buffer rx;
+	struct timespec start, end;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair failed");
+		exit(EXIT_FAILURE);
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork failed");
+		exit(EXIT_FAILURE);
+	} else if (pid == 0) {
+		close(sv[1]);
+		run_writer(sv[0], commands, burst);
+		exit(EXIT_SUCCESS);
+	}
+	close(sv[0]);
+
+	init_reader(&reader, sv[1]);
+	init_msg_buffer(&rx);
+	rx_start = gs_io_stats.rx_syscalls;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < commands; i++) {
+		if (buffered)
+			reader_next_message(&reader, &msg, &msg_length, 0);
+		else
+			receive_message_into(&rx, sv[1]);
+
+		if ((i + 1) % burst == 0 || i + 1 == commands)
+			write_socket(sv[1], &ack, 1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	waitpid(pid, NULL, 0);
+
+	printf("%-10s %10ld %8ld %12" PRIu64 " %14.3f %10.1f\n", name, commands, burst,
+			gs_io_stats.rx_syscalls - rx_start,
+			(double) (gs_io_stats.rx_syscalls - rx_start) / commands,
+			elapsed_ns(&start, &end) / commands);
+
+	free_reader(&reader);
+	free_msg_buffer(&rx);
+	close(sv[1]);
+}
+
+int main(int argc, char *argv[]) {
+	long commands = DEFAULT_COMMANDS, burst = DEFAULT_BURST;
+
+	if (argc > 3) {
+		printf("Usage: bench-reader [commands] [burst]\n");
+		exit(EXIT_FAILURE);
+	}
+	if (argc > 1)
+		commands = atol(argv[1]);
+	if (argc > 2)
+		burst = atol(argv[2]);
+	if (commands <= 0 || burst <= 0) {
+		fprintf(stderr, "commands and burst must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-10s %10s %8s %12s %14s %10s\n", "reader", "commands", "burst",
+			"rx_syscalls", "syscalls/cmd", "ns/cmd");
+	run_bench("plain", 0, commands, burst);
+	run_bench("buffered", 1, commands, burst);
+
+	return 0;
+}
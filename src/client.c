@@ -8,39 +8,145 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "client.h"
 #include "common.h"
 #include "common.pb-c.h"
 #include "protocol.h"
 #include "process.h"
+#include "record.h"
+#include "shm.h"
+#include "stripe.h"
+#include "transport.h"
 
-int init_client(const char *s_ip, const char *s_port, struct addrinfo *s_addr) {
-	int socket_fd, ret;
-	struct addrinfo hints;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;	// Allow IPv4
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;	// For wildcard IP address
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-
-	ret = getaddrinfo(s_ip, s_port, &hints, &s_addr);
-	if (ret) {
-		fprintf(stderr, "getaddrinfo failed: [%d] %s\n", ret, gai_strerror(ret));
-		exit(EXIT_FAILURE);
+// An asynchronous command whose result is still to be read, and the end of
+// the shared memory it uses, if any
+typedef struct pending_cmd_s {
+	uint32_t req_id;
+	uint64_t shm_end;
+} pending_cmd;
+
+/*
+ * Per connection state, looked up by socket fd. Besides the receive state
+ * it tracks the commands sent in asynchronous mode: their results are
+ * read, in order, before the result of the next synchronous command, and
+ * the first error among them is kept for the next synchronizing call.
+ * The lock is held by every client call and by the batch flusher thread,
+ * which only drops it to send a batch; writers wait until it is out.
+ * Connections over a Unix domain socket may share a memory region with
+ * the server, offered along with INIT; TCP connections may have data
+ * connections to stripe large payloads over.
+ */
+typedef struct client_conn_s {
+	int sock_fd;
+	pthread_mutex_t lock;
+	conn_reader reader;
+	msg_arena arena;
+	uint32_t next_req_id;
+	uint32_t last_req_id;	// id of the last command sent
+	int last_batched;	// ...and whether it went into the batch
+	pending_cmd pending[ASYNC_MAX_PENDING];
+	unsigned int pending_head;
+	unsigned int pending_count;
+	int64_t deferred_error;
+	// commands queued for the next CUDA_CMD_BATCH
+	msg_buffer batch;
+	size_t batch_used;
+	unsigned int batch_cmds;
+	unsigned long batch_seq;
+	struct timespec batch_deadline;
+	pthread_cond_t batch_cond;
+	pthread_t flusher;
+	int flusher_started;
+	int flusher_stop;
+	// a batch the flusher is sending
+	msg_buffer flushing;
+	int flushing_busy;
+	pthread_cond_t flush_done;
+	// shared memory transport
+	int local;
+	shm_region shm;
+	uint32_t shm_offered;	// id of the INIT that offered the region
+	int shm_ready;
+	// data connections
+	stripe_set stripes;
+} client_conn;
+
+static client_conn **conns = NULL;
+static int conns_size = 0;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_local_socket(int sock_fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(sock_fd, (struct sockaddr *) &addr, &len) < 0)
+		return 0;
+
+	return addr.ss_family == AF_UNIX;
+}
+
+static client_conn *get_client_conn(int sock_fd) {
+	client_conn *conn;
+	int i, new_size;
+
+	pthread_mutex_lock(&conns_lock);
+	if (sock_fd >= conns_size) {
+		new_size = (sock_fd + 1 > 2 * conns_size) ? sock_fd + 1 : 2 * conns_size;
+		conns = realloc_safe(conns, sizeof(*conns) * new_size);
+		for (i = conns_size; i < new_size; i++)
+			conns[i] = NULL;
+		conns_size = new_size;
 	}
-	socket_fd = socket(s_addr->ai_family, s_addr->ai_socktype, s_addr->ai_protocol);
-	if (socket_fd < 0) {
-		perror("socket creation failed");
-		exit(EXIT_FAILURE);
+	if (conns[sock_fd] == NULL) {
+		conn = malloc_safe(sizeof(*conn));
+		conn->sock_fd = sock_fd;
+		pthread_mutex_init(&conn->lock, NULL);
+		init_reader(&conn->reader, sock_fd);
+		init_arena(&conn->arena);
+		conn->next_req_id = 1;
+		conn->last_req_id = 0;
+		conn->last_batched = 0;
+		conn->pending_head = 0;
+		conn->pending_count = 0;
+		conn->deferred_error = CUDA_SUCCESS;
+		init_msg_buffer(&conn->batch);
+		conn->batch_used = 0;
+		conn->batch_cmds = 0;
+		conn->batch_seq = 0;
+		conn->flusher_started = 0;
+		conn->flusher_stop = 0;
+		init_msg_buffer(&conn->flushing);
+		conn->flushing_busy = 0;
+		conn->local = is_local_socket(sock_fd);
+		init_shm_region(&conn->shm);
+		conn->shm_offered = 0;
+		conn->shm_ready = 0;
+		init_stripe_set(&conn->stripes);
+		conns[sock_fd] = conn;
 	}
+	conn = conns[sock_fd];
+	pthread_mutex_unlock(&conns_lock);
+
+	return conn;
+}
 
-	if (connect(socket_fd, (struct sockaddr*)s_addr->ai_addr, s_addr->ai_addrlen) < 0) {
-		perror("connect failed");
+// Connects to a TCP server; kept for the test client
+int init_client(const char *s_ip, const char *s_port, struct addrinfo *s_addr) {
+	transport_addr addr;
+	int socket_fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.kind = TRANSPORT_TCP;
+	snprintf(addr.host, sizeof(addr.host), "%s", s_ip);
+	snprintf(addr.port, sizeof(addr.port), "%s", s_port);
+
+	socket_fd = transport_connect(&addr);
+	if (socket_fd < 0) {
+		fprintf(stderr, "Could not connect to %s:%s\n", s_ip, s_port);
 		exit(EXIT_FAILURE);
 	}
 
@@ -80,30 +186,77 @@ int remove_param_from_list(param_node *list, uint32_t param_id) {
 	return 0;
 }
 
+// Connects to the first of the GPUSOCK_SERVER addresses that accepts
 void get_server_connection(params *p) {
-	char s_ip[16], s_port[6];
+	transport_addr addrs[TRANSPORT_MAX_ADDRS];
+	char name[NI_MAXHOST + NI_MAXSERV + 16];
+	int i, n_addrs;
 
-	if (p->id < 0) {
-		if (get_server_ip(s_ip, s_port) != 0) {
-			sprintf(s_ip, DEFAULT_SERVER_IP);
-			sprintf(s_port, DEFAULT_SERVER_PORT);
-			gdprintf("Could not get env vars, using defaults: %s:%s\n", s_ip, s_port);
+	if (p->id >= 0)
+		return;
+
+	n_addrs = get_server_addrs(addrs, TRANSPORT_MAX_ADDRS, 0);
+	for (i = 0; i < n_addrs; i++) {
+		format_transport_addr(&addrs[i], name, sizeof(name));
+		p->sock_fd = transport_connect(&addrs[i]);
+		if (p->sock_fd >= 0) {
+			gdprintf("Connected to server at %s...\n", name);
+			return;
 		}
-		p->sock_fd = init_client(s_ip, s_port, &(p->addr));
-		gdprintf("Connected to server %s on port %s...\n", s_ip, s_port);
+		fprintf(stderr, "Could not connect to server at %s\n", name);
 	}
+
+	fprintf(stderr, "No server to connect to!\n");
+	exit(EXIT_FAILURE);
 }
 
-int64_t get_cuda_cmd_result(void **result, int sock_fd) {
+/*
+ * The server acknowledges the region offered with INIT by returning its
+ * size after the client id. Otherwise, e.g. if it could not map it, the
+ * region is dropped and payloads go through the socket.
+ */
+static void accept_shm_region(client_conn *conn, int64_t res_code, CudaCmd *cmd) {
+	conn->shm_ready = (res_code == CUDA_SUCCESS && cmd->n_uint_args > 1 &&
+			cmd->uint_args[1] == conn->shm.size);
+	conn->shm_offered = 0;
+
+	// The server holds its own mapping now
+	close(conn->shm.fd);
+	conn->shm.fd = -1;
+	if (!conn->shm_ready)
+		unmap_shm_region(&conn->shm);
+	gdprintf("Shared memory transport %s\n", conn->shm_ready ? "enabled" : "refused");
+}
+
+// Reads a result payload the server striped over the data connections
+static void receive_stripes(client_conn *conn, void *dst, uint64_t length, uint32_t req_id) {
+	stripe_transfer xfer;
+
+	init_stripe_transfer(&xfer);
+	start_stripe_transfer(&conn->stripes, &xfer, 0, req_id, dst, length, NULL);
+	if (wait_stripe_transfer(&xfer) < 0) {
+		fprintf(stderr, "Problem receiving striped result!\n");
+		exit(EXIT_FAILURE);
+	}
+	free_stripe_transfer(&xfer);
+}
+
+/*
+ * Reads the next result off the connection. The result data is returned
+ * in a new buffer, or dropped if result is NULL. With dst given instead,
+ * a result of dst_length bytes is stored there: an out-of-band payload is
+ * received from the socket straight into it.
+ */
+static int64_t read_cuda_cmd_result(void **result, void *dst, size_t dst_length, uint32_t *req_id, client_conn *conn) {
 	CudaCmd *cmd;
-	size_t msg_length;
-	void *buffer=NULL, *payload=NULL, *dec_msg=NULL;
+	uint32_t msg_length;
+	uint64_t bulk_length;
+	void *buffer=NULL, *payload=NULL, *dec_msg=NULL, *data=NULL;
 	int res_code;
 
 	gdprintf("Waiting for response:\n");
-	msg_length = receive_message(&buffer, sock_fd);
-	if (msg_length > 0) {
-		decode_message(&dec_msg, &payload, buffer, msg_length);
+	if (reader_next_message(&conn->reader, &buffer, &msg_length, 0) > 0) {
+		decode_message(&dec_msg, &payload, buffer, msg_length, &conn->arena);
 	} else {
 		fprintf(stderr, "Problem receiving response!\n");
 		exit(EXIT_FAILURE);
@@ -112,43 +265,579 @@ int64_t get_cuda_cmd_result(void **result, int sock_fd) {
 	if (payload == NULL) {
 		fprintf(stderr, "Problem decoding response!\n");
 		exit(EXIT_FAILURE);
+	} else if ((bulk_length = get_bulk_length(buffer, msg_length)) > 0) {
+		cmd = payload;
+		res_code = cmd->int_args[0];
+		gdprintf("Got response:\n| result code: %d\n| result: (%" PRIu64 " bulk bytes)\n", res_code, bulk_length);
+		// dst is left alone if the command failed
+		if (res_code != CUDA_SUCCESS)
+			dst = NULL;
+		if (dst != NULL && bulk_length != dst_length) {
+			fprintf(stderr, "Unexpected result of %" PRIu64 " bytes, expected %zu\n", bulk_length, dst_length);
+			exit(EXIT_FAILURE);
+		}
+		if (dst == NULL)
+			data = malloc_safe(bulk_length);
+		reader_read_bulk(&conn->reader, (dst != NULL) ? dst : data, bulk_length, 0);
+	} else if ((bulk_length = get_stripe_length(buffer, msg_length)) > 0) {
+		cmd = payload;
+		res_code = cmd->int_args[0];
+		gdprintf("Got response:\n| result code: %d\n| result: (%" PRIu64 " striped bytes)\n", res_code, bulk_length);
+		// Only asked for by striped_memcpy_dtoh(), and only sent on success
+		if (dst == NULL || bulk_length != dst_length) {
+			fprintf(stderr, "Unexpected striped result of %" PRIu64 " bytes\n", bulk_length);
+			exit(EXIT_FAILURE);
+		}
+		receive_stripes(conn, dst, bulk_length, get_req_id(dec_msg));
 	} else {
 		cmd = payload;
 		res_code = cmd->int_args[0];
 		gdprintf("Got response:\n| result code: %d\n", res_code);
 		if (cmd->n_uint_args > 0) {
-			*result = malloc_safe(sizeof(uint64_t));
-			memcpy(*result, &cmd->uint_args[0], sizeof(uint64_t));
-			gdprintf("| result: 0x%" PRIx64 "\n", *(uint64_t *) *result);
+			data = malloc_safe(sizeof(uint64_t));
+			memcpy(data, &cmd->uint_args[0], sizeof(uint64_t));
+			gdprintf("| result: 0x%" PRIx64 "\n", *(uint64_t *) data);
+		} else if (cmd->n_extra_args > 0 && dst != NULL && res_code == CUDA_SUCCESS) {
+			memcpy(dst, cmd->extra_args[0].data,
+					(cmd->extra_args[0].len < dst_length) ? cmd->extra_args[0].len : dst_length);
+			gdprintf("| result: (bytes)\n");
 		} else if (cmd->n_extra_args > 0) {
-			*result = malloc_safe(cmd->extra_args[0].len);
-			memcpy(*result, cmd->extra_args[0].data, cmd->extra_args[0].len);
+			data = malloc_safe(cmd->extra_args[0].len);
+			memcpy(data, cmd->extra_args[0].data, cmd->extra_args[0].len);
 			gdprintf("| result: (bytes)\n");
 		}
-		free_decoded_message(dec_msg);
 	}
+	*req_id = get_req_id(dec_msg);
+	if (conn->shm_offered != 0 && *req_id == conn->shm_offered)
+		accept_shm_region(conn, res_code, cmd);
+	free_decoded_message(dec_msg, &conn->arena);
+	reset_arena(&conn->arena);
 
-	if (buffer != NULL)
-		free(buffer);
+	if (result != NULL)
+		*result = data;
+	else if (data != NULL)
+		free(data);
+
+	return res_code;
+}
+
+static void check_req_id(uint32_t req_id, uint32_t expected) {
+	// Servers that predate request ids send none
+	if (req_id != 0 && req_id != expected) {
+		fprintf(stderr, "Out of order response: got request %u, expected %u\n", req_id, expected);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Reads the results of the oldest asynchronous command
+static void complete_async_cmd(client_conn *conn) {
+	uint32_t req_id;
+	int64_t res_code;
+
+	pending_cmd *cmd = &conn->pending[conn->pending_head];
+
+	res_code = read_cuda_cmd_result(NULL, NULL, 0, &req_id, conn);
+	check_req_id(req_id, cmd->req_id);
+	if (res_code != CUDA_SUCCESS && conn->deferred_error == CUDA_SUCCESS)
+		conn->deferred_error = res_code;
+	if (cmd->shm_end > 0)
+		shm_release(&conn->shm, cmd->shm_end);
+
+	conn->pending_head = (conn->pending_head + 1) % ASYNC_MAX_PENDING;
+	conn->pending_count--;
+}
+
+static void add_pending_cmd(client_conn *conn, uint32_t req_id, uint64_t shm_end) {
+	pending_cmd *cmd;
+
+	if (conn->pending_count == ASYNC_MAX_PENDING)
+		complete_async_cmd(conn);
+	cmd = &conn->pending[(conn->pending_head + conn->pending_count) % ASYNC_MAX_PENDING];
+	cmd->req_id = req_id;
+	cmd->shm_end = shm_end;
+	conn->pending_count++;
+}
+
+static uint32_t new_req_id(client_conn *conn) {
+	uint32_t req_id = conn->next_req_id++;
+
+	if (conn->next_req_id == 0)
+		conn->next_req_id = 1;
+
+	return req_id;
+}
+
+// The fast path can be turned off with GPUSOCK_FAST_PATH=0, e.g. to talk
+// to an older server.
+static int use_fast_path(void) {
+	static int enabled = -1;
+	const char *env;
+
+	if (enabled < 0) {
+		env = getenv("GPUSOCK_FAST_PATH");
+		enabled = (env == NULL || atoi(env) != 0);
+	}
+
+	return enabled;
+}
+
+// Batching is turned on with GPUSOCK_BATCH=1
+static int use_batching(void) {
+	static int enabled = -1;
+	const char *env;
+
+	if (enabled < 0) {
+		env = getenv("GPUSOCK_BATCH");
+		enabled = (env != NULL && atoi(env) != 0);
+	}
+
+	return enabled;
+}
+
+// Asynchronous mode is turned on with GPUSOCK_ASYNC=1
+static int use_async_mode(void) {
+	static int enabled = -1;
+	const char *env;
+
+	if (enabled < 0) {
+		env = getenv("GPUSOCK_ASYNC");
+		enabled = (env != NULL && atoi(env) != 0) || use_batching();
+	}
+
+	return enabled;
+}
+
+// Local connections share memory with the server unless GPUSOCK_SHM=0
+static int use_shm(void) {
+	static int enabled = -1;
+	const char *env;
+
+	if (enabled < 0) {
+		env = getenv("GPUSOCK_SHM");
+		enabled = (env == NULL || atoi(env) != 0) && use_fast_path();
+	}
+
+	return enabled;
+}
+
+static long get_batch_timeout_us(void) {
+	static long timeout = -1;
+	const char *env;
+
+	if (timeout < 0) {
+		env = getenv("GPUSOCK_BATCH_US");
+		timeout = (env != NULL) ? atol(env) : BATCH_DEFAULT_US;
+		if (timeout < 0)
+			timeout = BATCH_DEFAULT_US;
+	}
+
+	return timeout;
+}
+
+static size_t encode_cuda_cmd(void **buffer, var **args, size_t arg_count, int type, uint32_t req_id) {
+	void *payload = NULL;
+	CudaCmd *cmd;
+	size_t buf_size;
+
+	if (use_fast_path() && is_fast_cmd(type)) {
+		buf_size = encode_fast_frame(buffer, CUDA_CMD, type, req_id, args, arg_count);
+		if (buf_size > 0)
+			return buf_size;
+	}
+
+	pack_cuda_cmd(&payload, args, arg_count, type);
+	buf_size = encode_message(buffer, CUDA_CMD, req_id, payload);
+	cmd = payload;
+	free(cmd->extra_args);
+	free(cmd);
+
+	return buf_size;
+}
+
+static int write_cuda_cmd(int sock_fd, var **args, size_t arg_count, int type, uint32_t req_id) {
+	void *buffer = NULL, *payload = NULL;
+	size_t buf_size;
+
+	gdprintf("Sendind CUDA cmd...\n");
+	if (use_fast_path() && is_fast_cmd(type) &&
+			send_fast_frame(sock_fd, CUDA_CMD, type, req_id, args, arg_count) == 0)
+		return 0;
+
+	pack_cuda_cmd(&payload, args, arg_count, type);
+	buf_size = encode_message(&buffer, CUDA_CMD, req_id, payload);
+	if (buffer == NULL)
+		return -1;
+
+	send_message(sock_fd, buffer, buf_size);
+
+	free(buffer);
+
+	return 0;
+}
+
+// INIT on a local connection passes the server a shared memory region
+static int write_init_cmd(client_conn *conn, var **args, size_t arg_count, uint32_t req_id) {
+	void *buffer = NULL, *payload = NULL;
+	CudaCmd *cmd;
+	size_t buf_size;
+
+	if (!conn->local || !use_shm() || conn->shm.base != NULL ||
+			create_shm_region(&conn->shm, get_shm_size()) < 0)
+		return write_cuda_cmd(conn->sock_fd, args, arg_count, INIT, req_id);
+
+	pack_cuda_cmd(&payload, args, arg_count, INIT);
+	buf_size = encode_message(&buffer, CUDA_CMD, req_id, payload);
+	cmd = payload;
+	free(cmd->extra_args);
+	free(cmd);
+	if (buffer == NULL)
+		return -1;
+
+	send_message_with_fd(conn->sock_fd, buffer, buf_size, conn->shm.fd);
+	conn->shm_offered = req_id;
+	free(buffer);
+
+	return 0;
+}
+
+static void write_batch(client_conn *conn, void *data, size_t length, uint64_t cmd_count, uint32_t req_id) {
+	var arg_uint = { .type = UINT, .elements = 1, .length = sizeof(uint64_t), .data = &cmd_count },
+		arg_b = { .type = BYTES, .elements = 1, .length = length, .data = data },
+		*args[] = { &arg_uint, &arg_b };
+
+	gdprintf("Flushing batch of %" PRIu64 " commands (%zu bytes)\n", cmd_count, length);
+	if (write_cuda_cmd(conn->sock_fd, args, 2, CUDA_CMD_BATCH, req_id) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd batch!\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Sends the queued commands as one CUDA_CMD_BATCH, whose single result
+// is read like that of any asynchronous command
+static void flush_batch(client_conn *conn) {
+	uint32_t req_id;
+
+	// Anything sent now has to go after the batch of the flusher
+	while (conn->flushing_busy)
+		pthread_cond_wait(&conn->flush_done, &conn->lock);
+
+	if (conn->batch_cmds == 0)
+		return;
+
+	req_id = new_req_id(conn);
+	write_batch(conn, conn->batch.data, conn->batch_used, conn->batch_cmds, req_id);
+	conn->batch_used = 0;
+	conn->batch_cmds = 0;
+
+	add_pending_cmd(conn, req_id, 0);
+}
+
+/*
+ * flush_batch() for the flusher thread: the batch moves to a buffer of its
+ * own and is sent without the lock, so that client calls can go on
+ * queueing commands meanwhile.
+ */
+static void flush_batch_unlocked(client_conn *conn) {
+	msg_buffer batch = conn->batch;
+	size_t length = conn->batch_used;
+	uint64_t cmd_count = conn->batch_cmds;
+	uint32_t req_id;
+
+	conn->batch = conn->flushing;
+	conn->flushing = batch;
+	conn->batch_used = 0;
+	conn->batch_cmds = 0;
+	req_id = new_req_id(conn);
+	add_pending_cmd(conn, req_id, 0);
+
+	conn->flushing_busy = 1;
+	pthread_mutex_unlock(&conn->lock);
+	write_batch(conn, batch.data, length, cmd_count, req_id);
+	pthread_mutex_lock(&conn->lock);
+	conn->flushing_busy = 0;
+	pthread_cond_broadcast(&conn->flush_done);
+}
+
+static int is_batchable(int type, var **args, size_t arg_count) {
+	size_t i, length = 0;
+
+	switch (type) {
+		case MEMORY_FREE:
+		case MEMCPY_HOST_TO_DEV:
+		case LAUNCH_KERNEL:
+			break;
+		default:
+			return 0;
+	}
+
+	for (i = 0; i < arg_count; i++)
+		length += args[i]->length;
+
+	// which also keeps every command well below BATCH_MAX_BYTES
+	return length <= BATCH_MAX_PAYLOAD;
+}
+
+// Flushes batches that have been waiting for longer than the timeout
+static void *batch_flusher(void *arg) {
+	client_conn *conn = arg;
+	unsigned long seq;
+	int ret;
+
+	pthread_mutex_lock(&conn->lock);
+	while (!conn->flusher_stop) {
+		while (conn->batch_cmds == 0 && !conn->flusher_stop)
+			pthread_cond_wait(&conn->batch_cond, &conn->lock);
+
+		seq = conn->batch_seq;
+		ret = 0;
+		while (conn->batch_cmds > 0 && conn->batch_seq == seq && ret != ETIMEDOUT &&
+				!conn->flusher_stop)
+			ret = pthread_cond_timedwait(&conn->batch_cond, &conn->lock, &conn->batch_deadline);
+
+		// Unless it was sent meanwhile
+		if (conn->batch_cmds > 0 && conn->batch_seq == seq && !conn->flusher_stop)
+			flush_batch_unlocked(conn);
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	return NULL;
+}
+
+static void start_batch_flusher(client_conn *conn) {
+	pthread_condattr_t attr;
+	int ret;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&conn->batch_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&conn->flush_done, NULL);
+
+	ret = pthread_create(&conn->flusher, NULL, batch_flusher, conn);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	conn->flusher_started = 1;
+}
+
+/*
+ * Stops the flusher of a connection and waits for it. Called with the
+ * lock held, which the flusher needs to see the request; commands still
+ * queued are left for the next flush.
+ */
+static void stop_batch_flusher(client_conn *conn) {
+	if (!conn->flusher_started)
+		return;
+
+	conn->flusher_stop = 1;
+	pthread_cond_signal(&conn->batch_cond);
+	pthread_mutex_unlock(&conn->lock);
+	pthread_join(conn->flusher, NULL);
+	pthread_mutex_lock(&conn->lock);
+
+	pthread_cond_destroy(&conn->batch_cond);
+	pthread_cond_destroy(&conn->flush_done);
+	conn->flusher_started = 0;
+	conn->flusher_stop = 0;
+}
+
+// Library destructor: no flusher outlives the connections it works on
+static void __attribute__((destructor)) stop_batch_flushers(void) {
+	struct timespec deadline;
+	client_conn *conn;
+	int i;
+
+	pthread_mutex_lock(&conns_lock);
+	for (i = 0; i < conns_size; i++) {
+		conn = conns[i];
+		if (conn == NULL || !conn->flusher_started)
+			continue;
+		// A thread still blocked in a client call keeps the lock
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		if (pthread_mutex_timedlock(&conn->lock, &deadline) != 0)
+			continue;
+		stop_batch_flusher(conn);
+		pthread_mutex_unlock(&conn->lock);
+	}
+	pthread_mutex_unlock(&conns_lock);
+}
+
+/*
+ * Forgets the state of a connection, before its socket is closed and the
+ * fd number can come back for another one. Commands still queued or in
+ * flight are dropped with it.
+ */
+void release_client_conn(int sock_fd) {
+	client_conn *conn = NULL;
+
+	pthread_mutex_lock(&conns_lock);
+	if (sock_fd >= 0 && sock_fd < conns_size) {
+		conn = conns[sock_fd];
+		conns[sock_fd] = NULL;
+	}
+	pthread_mutex_unlock(&conns_lock);
+	if (conn == NULL)
+		return;
+
+	pthread_mutex_lock(&conn->lock);
+	stop_batch_flusher(conn);
+	pthread_mutex_unlock(&conn->lock);
+
+	close_stripe_set(&conn->stripes);
+	unmap_shm_region(&conn->shm);
+	free_msg_buffer(&conn->batch);
+	free_msg_buffer(&conn->flushing);
+	free_arena(&conn->arena);
+	free_reader(&conn->reader);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+static void add_to_batch(client_conn *conn, var **args, size_t arg_count, int type, uint32_t req_id) {
+	void *buffer = NULL;
+	size_t buf_size;
+	long timeout_us;
+
+	buf_size = encode_cuda_cmd(&buffer, args, arg_count, type, req_id);
+	if (conn->batch_used + buf_size > BATCH_MAX_BYTES)
+		flush_batch(conn);
+
+	if (conn->batch_cmds == 0)
+		reserve_msg_buffer(&conn->batch, BATCH_MAX_BYTES);
+	memcpy(conn->batch.data + conn->batch_used, buffer, buf_size);
+	conn->batch_used += buf_size;
+	free(buffer);
+
+	if (conn->batch_cmds++ == 0) {
+		// A new batch: arm the flush timer
+		if (!conn->flusher_started)
+			start_batch_flusher(conn);
+		timeout_us = get_batch_timeout_us();
+		clock_gettime(CLOCK_MONOTONIC, &conn->batch_deadline);
+		conn->batch_deadline.tv_sec += timeout_us / 1000000;
+		conn->batch_deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+		if (conn->batch_deadline.tv_nsec >= 1000000000) {
+			conn->batch_deadline.tv_sec++;
+			conn->batch_deadline.tv_nsec -= 1000000000;
+		}
+		conn->batch_seq++;
+		pthread_cond_signal(&conn->batch_cond);
+	}
+
+	if (conn->batch_cmds >= BATCH_MAX_CMDS || conn->batch_used >= BATCH_MAX_BYTES)
+		flush_batch(conn);
+}
+
+static int64_t wait_cuda_cmd_result(void **result, void *dst, size_t dst_length, client_conn *conn) {
+	uint32_t req_id;
+	int64_t res_code;
+
+	flush_batch(conn);
+	while (conn->pending_count > 0)
+		complete_async_cmd(conn);
+
+	res_code = read_cuda_cmd_result(result, dst, dst_length, &req_id, conn);
+	check_req_id(req_id, conn->last_req_id);
+
+	return res_code;
+}
+
+int64_t get_cuda_cmd_result(void **result, int sock_fd) {
+	int64_t res_code;
+	client_conn *conn = get_client_conn(sock_fd);
+
+	pthread_mutex_lock(&conn->lock);
+	res_code = wait_cuda_cmd_result(result, NULL, 0, conn);
+	pthread_mutex_unlock(&conn->lock);
+	record_result(res_code, (result != NULL) ? *result : NULL, 0);
+
+	return res_code;
+}
+
+/*
+ * Like get_cuda_cmd_result(), for a command that returns length bytes of
+ * data, which are read straight into dst rather than into a new buffer.
+ */
+int64_t get_cuda_cmd_result_into(void *dst, size_t length, int sock_fd) {
+	int64_t res_code;
+	client_conn *conn = get_client_conn(sock_fd);
+
+	pthread_mutex_lock(&conn->lock);
+	res_code = wait_cuda_cmd_result(NULL, dst, length, conn);
+	pthread_mutex_unlock(&conn->lock);
+	record_result(res_code, NULL, 0);
+
+	return res_code;
+}
+
+/*
+ * Stands in for get_cuda_cmd_result() for commands whose result the caller
+ * does not need right away. In asynchronous mode it returns CUDA_SUCCESS
+ * at once and the result is read later; otherwise it waits for it.
+ */
+int64_t defer_cuda_cmd_result(int sock_fd) {
+	void *result = NULL;
+	int64_t res_code = CUDA_SUCCESS;
+	client_conn *conn = get_client_conn(sock_fd);
+
+	pthread_mutex_lock(&conn->lock);
+	if (!use_async_mode()) {
+		res_code = wait_cuda_cmd_result(&result, NULL, 0, conn);
+		if (result != NULL)
+			free(result);
+	} else if (!conn->last_batched) {
+		// Batched commands share the result of their batch
+		add_pending_cmd(conn, conn->last_req_id, 0);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	record_result(res_code, NULL, use_async_mode());
 
 	return res_code;
 }
 
+/*
+ * Reports the first error of the asynchronous commands completed so far,
+ * unless the synchronizing command itself failed. Either way the error is
+ * cleared.
+ */
+int64_t check_deferred_error(int sock_fd, int64_t res_code) {
+	client_conn *conn = get_client_conn(sock_fd);
+	int64_t deferred;
+
+	pthread_mutex_lock(&conn->lock);
+	deferred = conn->deferred_error;
+	conn->deferred_error = CUDA_SUCCESS;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (res_code != CUDA_SUCCESS)
+		return res_code;
+
+	return deferred;
+}
+
 int get_available_gpus(int sock_fd) {
 	CudaDeviceList *devices;
-	size_t buf_size, msg_length;
+	size_t buf_size;
+	uint32_t msg_length;
 	void *buffer=NULL, *payload=NULL, *dec_msg=NULL;
+	client_conn *conn = get_client_conn(sock_fd);
+
+	pthread_mutex_lock(&conn->lock);
+	flush_batch(conn);
+	while (conn->pending_count > 0)
+		complete_async_cmd(conn);
 
 	gdprintf("Sending request for available cuda devices...\n");
-	buf_size = encode_message(&buffer, CUDA_DEVICE_QUERY, NULL);
+	buf_size = encode_message(&buffer, CUDA_DEVICE_QUERY, 0, NULL);
 	send_message(sock_fd, buffer, buf_size);
 	if (buffer != NULL)
 		free(buffer);
 
 	gdprintf("Waiting for response:\n");
-	msg_length = receive_message(&buffer, sock_fd);
-	if (msg_length > 0) {
-		decode_message(&dec_msg, &payload, buffer, msg_length);
+	if (reader_next_message(&conn->reader, &buffer, &msg_length, 0) > 0) {
+		decode_message(&dec_msg, &payload, buffer, msg_length, &conn->arena);
 	} else {
 		fprintf(stderr, "Problem receiving response!\n");
 		exit(EXIT_FAILURE);
@@ -160,31 +849,351 @@ int get_available_gpus(int sock_fd) {
 	} else {
 		devices = payload;
 		gdprintf("Got response, free devices: %u\n", devices->devices_free);
-		free_decoded_message(dec_msg);
+		free_decoded_message(dec_msg, &conn->arena);
 	}
-
-	if (buffer != NULL)
-		free(buffer);
+	reset_arena(&conn->arena);
+	pthread_mutex_unlock(&conn->lock);
 
 	return 0;
 }
 
 int send_cuda_cmd(int sock_fd, var **args, size_t arg_count, int type) {
-	void *buffer = NULL, *payload = NULL;
-	size_t buf_size;
+	uint32_t req_id;
+	int ret = 0;
+	client_conn *conn = get_client_conn(sock_fd);
 
-	gdprintf("Sendind CUDA cmd...\n");
-	pack_cuda_cmd(&payload, args, arg_count, type);
+	record_cmd(args, arg_count, type);
+	pthread_mutex_lock(&conn->lock);
+	req_id = new_req_id(conn);
+	conn->last_req_id = req_id;
+	conn->last_batched = use_batching() && is_batchable(type, args, arg_count);
 
-	buf_size = encode_message(&buffer, CUDA_CMD, payload);
-	if (buffer == NULL)
+	if (conn->last_batched) {
+		add_to_batch(conn, args, arg_count, type, req_id);
+	} else {
+		// Queued commands go first
+		flush_batch(conn);
+		if (type == INIT)
+			ret = write_init_cmd(conn, args, arg_count, req_id);
+		else
+			ret = write_cuda_cmd(sock_fd, args, arg_count, type, req_id);
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	return ret;
+}
+
+// Records a memcpy that bypasses send_cuda_cmd(), as if it did not
+static void record_memcpy_htod(uint64_t dst_device, const void *src, size_t length) {
+	var arg_uint = { .type = UINT, .elements = 1, .length = sizeof(uint64_t), .data = &dst_device },
+		arg_b = { .type = BYTES, .elements = 1, .length = length, .data = (void *) src },
+		*args[] = { &arg_uint, &arg_b };
+
+	record_cmd(args, 2, MEMCPY_HOST_TO_DEV);
+}
+
+int has_shm_transport(int sock_fd) {
+	client_conn *conn = get_client_conn(sock_fd);
+
+	return conn->shm_ready;
+}
+
+// Takes room for a payload off the ring, reading results until there is
+static int64_t reserve_shm(client_conn *conn, size_t length, uint64_t *end) {
+	int64_t offset;
+
+	while ((offset = shm_alloc(&conn->shm, length, end)) < 0) {
+		if (conn->pending_count == 0) {
+			fprintf(stderr, "No room for %zu bytes in shared memory\n", length);
+			exit(EXIT_FAILURE);
+		}
+		complete_async_cmd(conn);
+	}
+
+	return offset;
+}
+
+static size_t shm_chunk_size(client_conn *conn) {
+	return (conn->shm.size / SHM_RING_SLOTS) & ~((size_t) SHM_ALIGN - 1);
+}
+
+/*
+ * cuMemcpyHtoD through shared memory. The payload is copied to the ring,
+ * in chunks if it does not fit, and the commands are handled like any
+ * other deferred command; the ring space is released with their results.
+ */
+int64_t shm_memcpy_htod(int sock_fd, uint64_t dst_device, const void *src, size_t length) {
+	client_conn *conn = get_client_conn(sock_fd);
+	var arg_uint = { .type = UINT, .elements = 1, .length = sizeof(uint64_t) },
+		*args[] = { &arg_uint };
+	size_t offset, chunk, chunk_max;
+	uint64_t dst, end;
+	int64_t shm_offset, res_code = CUDA_SUCCESS;
+	uint32_t req_id;
+
+	record_memcpy_htod(dst_device, src, length);
+	pthread_mutex_lock(&conn->lock);
+	flush_batch(conn);
+	chunk_max = shm_chunk_size(conn);
+	arg_uint.data = &dst;
+
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = (length - offset < chunk_max) ? length - offset : chunk_max;
+		shm_offset = reserve_shm(conn, chunk, &end);
+		memcpy(conn->shm.base + shm_offset, src + offset, chunk);
+
+		dst = dst_device + offset;
+		req_id = new_req_id(conn);
+		conn->last_req_id = req_id;
+		conn->last_batched = 0;
+		if (send_shm_frame(sock_fd, CUDA_CMD, MEMCPY_HOST_TO_DEV, req_id, args, 1, shm_offset, chunk) == -1) {
+			fprintf(stderr, "Problem sending CUDA cmd!\n");
+			exit(EXIT_FAILURE);
+		}
+		add_pending_cmd(conn, req_id, end);
+	}
+
+	if (!use_async_mode()) {
+		while (conn->pending_count > 0)
+			complete_async_cmd(conn);
+		res_code = conn->deferred_error;
+		conn->deferred_error = CUDA_SUCCESS;
+	}
+	pthread_mutex_unlock(&conn->lock);
+	record_result(res_code, NULL, use_async_mode());
+
+	return res_code;
+}
+
+/*
+ * cuMemcpyDtoH through shared memory. The server copies each chunk
+ * straight to the ring and only the result code comes back on the socket.
+ * Up to SHM_RING_SLOTS chunks are requested ahead, so that the server
+ * copies the next chunk while the last one is copied out here.
+ */
+int64_t shm_memcpy_dtoh(int sock_fd, void *dst, uint64_t src_device, size_t length) {
+	client_conn *conn = get_client_conn(sock_fd);
+	struct {
+		uint32_t req_id;
+		int64_t shm_offset;
+		uint64_t end;
+		size_t length;
+	} chunks[SHM_RING_SLOTS], *c;
+	uint64_t uints[2];
+	var arg_uint = { .type = UINT, .elements = 2, .length = sizeof(uints), .data = uints },
+		*args[] = { &arg_uint };
+	size_t sent = 0, done = 0, chunk_max;
+	unsigned int first = 0, count = 0;
+	int64_t res_code = CUDA_SUCCESS, chunk_res;
+	uint32_t req_id;
+
+	uints[0] = src_device;
+	uints[1] = length;
+	record_cmd(args, 1, MEMCPY_DEV_TO_HOST);
+	pthread_mutex_lock(&conn->lock);
+	// Earlier commands first, which also empties the ring
+	flush_batch(conn);
+	while (conn->pending_count > 0)
+		complete_async_cmd(conn);
+	chunk_max = shm_chunk_size(conn);
+
+	while (done < length) {
+		while (sent < length && count < SHM_RING_SLOTS) {
+			c = &chunks[(first + count) % SHM_RING_SLOTS];
+			c->length = (length - sent < chunk_max) ? length - sent : chunk_max;
+			c->shm_offset = shm_alloc(&conn->shm, c->length, &c->end);
+			if (c->shm_offset < 0)
+				break;
+
+			uints[0] = src_device + sent;
+			uints[1] = c->length;
+			c->req_id = new_req_id(conn);
+			conn->last_req_id = c->req_id;
+			conn->last_batched = 0;
+			if (send_shm_frame(sock_fd, CUDA_CMD, MEMCPY_DEV_TO_HOST, c->req_id, args, 1, c->shm_offset, c->length) == -1) {
+				fprintf(stderr, "Problem sending CUDA cmd!\n");
+				exit(EXIT_FAILURE);
+			}
+			sent += c->length;
+			count++;
+		}
+		// Only chunks that went out have a result to wait for
+		if (count == 0) {
+			fprintf(stderr, "No room for a memcpy chunk in shared memory!\n");
+			res_code = CUDA_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+
+		c = &chunks[first];
+		chunk_res = read_cuda_cmd_result(NULL, NULL, 0, &req_id, conn);
+		check_req_id(req_id, c->req_id);
+		if (chunk_res == CUDA_SUCCESS)
+			memcpy(dst + done, conn->shm.base + c->shm_offset, c->length);
+		else if (res_code == CUDA_SUCCESS)
+			res_code = chunk_res;
+		shm_release(&conn->shm, c->end);
+
+		done += c->length;
+		first = (first + 1) % SHM_RING_SLOTS;
+		count--;
+	}
+	pthread_mutex_unlock(&conn->lock);
+	record_result(res_code, NULL, 0);
+
+	return res_code;
+}
+
+// Attaches a new data connection to the session of token; 0 on success
+static int attach_data_conn(int sock_fd, uint64_t token, int index) {
+	uint64_t uints[2] = { token, index };
+	var arg_uint = { .type = UINT, .elements = 2, .length = sizeof(uints), .data = uints },
+		*args[] = { &arg_uint };
+	conn_reader reader;
+	msg_arena arena;
+	CudaCmd *cmd;
+	void *buffer = NULL, *payload = NULL, *dec_msg = NULL;
+	uint32_t msg_length;
+	int res_code = CUDA_ERROR_UNKNOWN;
+
+	if (write_cuda_cmd(sock_fd, args, 1, STRIPE_ATTACH, 1) == -1)
 		return -1;
 
-	send_message(sock_fd, buffer, buf_size);
+	// The server answers on the data connection itself
+	init_reader(&reader, sock_fd);
+	init_arena(&arena);
+	if (reader_next_message(&reader, &buffer, &msg_length, 0) > 0 &&
+			decode_message(&dec_msg, &payload, buffer, msg_length, &arena) == CUDA_CMD_RESULT) {
+		cmd = payload;
+		if (cmd->n_int_args > 0)
+			res_code = cmd->int_args[0];
+	}
+	free_decoded_message(dec_msg, &arena);
+	free_arena(&arena);
+	free_reader(&reader);
 
-	free(buffer);
+	return (res_code == CUDA_SUCCESS) ? 0 : -1;
+}
 
-	return 0;
+/*
+ * Opens the GPUSOCK_STRIPES data connections of a TCP connection, to the
+ * address it is connected to. Called right after INIT; if anything goes
+ * wrong, payloads keep going over the connection itself.
+ */
+void open_stripes(int sock_fd) {
+	client_conn *conn = get_client_conn(sock_fd);
+	uint64_t count = get_stripe_count(), token;
+	var arg_uint = { .type = UINT, .elements = 1, .length = sizeof(uint64_t), .data = &count },
+		*args[] = { &arg_uint };
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	void *result = NULL;
+	int i, fd;
+
+	if (count == 0 || conn->local || !use_fast_path() || conn->stripes.count > 0)
+		return;
+
+	if (send_cuda_cmd(sock_fd, args, 1, STRIPE_OPEN) == -1 ||
+			get_cuda_cmd_result(&result, sock_fd) != CUDA_SUCCESS || result == NULL) {
+		fprintf(stderr, "Server does not stripe payloads\n");
+		free(result);
+		return;
+	}
+	token = *(uint64_t *) result;
+	free(result);
+
+	if (getpeername(sock_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+		perror("getpeername failed");
+		return;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	for (i = 0; i < count; i++) {
+		fd = socket(addr.ss_family, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *) &addr, addr_len) < 0) {
+			perror("Could not open data connection");
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		tune_socket(fd, (addr.ss_family == AF_INET6) ? TRANSPORT_TCP6 : TRANSPORT_TCP);
+		if (attach_data_conn(fd, token, i) < 0) {
+			fprintf(stderr, "Server refused data connection %d\n", i);
+			close(fd);
+			break;
+		}
+		add_stripe(&conn->stripes, i, fd);
+	}
+	if (conn->stripes.count < count)
+		close_stripe_set(&conn->stripes);
+	else
+		gdprintf("Striping large payloads over %d data connections\n", conn->stripes.count);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+int has_stripes(int sock_fd) {
+	client_conn *conn = get_client_conn(sock_fd);
+
+	return conn->stripes.count > 0;
+}
+
+/*
+ * cuMemcpyHtoD with the payload striped over the data connections. The
+ * stripes are out by the time it returns, so src can be reused, and the
+ * result is handled like that of any deferred command.
+ */
+int64_t striped_memcpy_htod(int sock_fd, uint64_t dst_device, const void *src, size_t length) {
+	client_conn *conn = get_client_conn(sock_fd);
+	var arg_uint = { .type = UINT, .elements = 1, .length = sizeof(uint64_t), .data = &dst_device },
+		*args[] = { &arg_uint };
+	stripe_transfer xfer;
+	uint32_t req_id;
+
+	// Completed by defer_cuda_cmd_result() below
+	record_memcpy_htod(dst_device, src, length);
+	pthread_mutex_lock(&conn->lock);
+	flush_batch(conn);
+	req_id = new_req_id(conn);
+	conn->last_req_id = req_id;
+	conn->last_batched = 0;
+	if (send_striped_frame(sock_fd, CUDA_CMD, MEMCPY_HOST_TO_DEV, req_id, args, 1, length) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	init_stripe_transfer(&xfer);
+	start_stripe_transfer(&conn->stripes, &xfer, 1, req_id, (void *) src, length, NULL);
+	if (wait_stripe_transfer(&xfer) < 0) {
+		fprintf(stderr, "Problem sending striped payload!\n");
+		exit(EXIT_FAILURE);
+	}
+	free_stripe_transfer(&xfer);
+	pthread_mutex_unlock(&conn->lock);
+
+	return defer_cuda_cmd_result(sock_fd);
 }
 
+// cuMemcpyDtoH with the result payload striped over the data connections
+int64_t striped_memcpy_dtoh(int sock_fd, void *dst, uint64_t src_device, size_t length) {
+	client_conn *conn = get_client_conn(sock_fd);
+	uint64_t uints[2] = { src_device, length };
+	var arg_uint = { .type = UINT, .elements = 2, .length = sizeof(uints), .data = uints },
+		*args[] = { &arg_uint };
+	int64_t res_code;
+	uint32_t req_id;
 
+	record_cmd(args, 1, MEMCPY_DEV_TO_HOST);
+	pthread_mutex_lock(&conn->lock);
+	flush_batch(conn);
+	req_id = new_req_id(conn);
+	conn->last_req_id = req_id;
+	conn->last_batched = 0;
+	if (send_striped_frame(sock_fd, CUDA_CMD, MEMCPY_DEV_TO_HOST, req_id, args, 1, 0) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd!\n");
+		exit(EXIT_FAILURE);
+	}
+	res_code = wait_cuda_cmd_result(NULL, dst, length, conn);
+	pthread_mutex_unlock(&conn->lock);
+	record_result(res_code, NULL, 0);
+
+	return res_code;
+}
@@ -3,6 +3,28 @@
 
 #include "common.h"
 #include "process.h"
+#include "stripe.h"
+
+// Asynchronous commands in flight on a connection before the client
+// stops to read their results
+#define ASYNC_MAX_PENDING 256
+
+/*
+ * With GPUSOCK_BATCH=1 (which implies asynchronous mode) the deferred
+ * commands are not sent one by one but queued into a CUDA_CMD_BATCH
+ * message. The batch goes out at the next synchronous command, when it
+ * reaches BATCH_MAX_CMDS commands or BATCH_MAX_BYTES bytes, or
+ * GPUSOCK_BATCH_US microseconds after its first command was queued.
+ * Commands carrying more than BATCH_MAX_PAYLOAD bytes are sent on their own.
+ */
+#define BATCH_MAX_CMDS 128
+#define BATCH_MAX_BYTES (32 * 1024)
+#define BATCH_MAX_PAYLOAD (4 * 1024)
+#define BATCH_DEFAULT_US 50
+
+// Over a Unix domain socket (unix:// in GPUSOCK_SERVER), memcpy payloads of at
+// least this size go through shared memory instead of the socket
+#define SHM_MIN_PAYLOAD (64 * 1024)
 
 typedef struct params_s {
 	int id;
@@ -27,8 +49,30 @@ int remove_param_from_list(param_node *list, uint32_t param_id);
 
 void get_server_connection(params *p);
 
+void release_client_conn(int sock_fd);
+
 int64_t get_cuda_cmd_result(void **result, int sock_fd);
 
+int64_t get_cuda_cmd_result_into(void *dst, size_t length, int sock_fd);
+
+int64_t defer_cuda_cmd_result(int sock_fd);
+
+int64_t check_deferred_error(int sock_fd, int64_t res_code);
+
 int send_cuda_cmd(int sock_fd, var **args, size_t arg_count, int type); 
 
+int has_shm_transport(int sock_fd);
+
+int64_t shm_memcpy_htod(int sock_fd, uint64_t dst_device, const void *src, size_t length);
+
+int64_t shm_memcpy_dtoh(int sock_fd, void *dst, uint64_t src_device, size_t length);
+
+void open_stripes(int sock_fd);
+
+int has_stripes(int sock_fd);
+
+int64_t striped_memcpy_htod(int sock_fd, uint64_t dst_device, const void *src, size_t length);
+
+int64_t striped_memcpy_dtoh(int sock_fd, void *dst, uint64_t src_device, size_t length);
+
 #endif /* CLIENT_H */
@@ -42,29 +42,3 @@ inline void *calloc_safe_f(size_t nmemb, size_t size, const char *file, const in
 
 	return ptr;
 }
-
-int get_server_ip(char *server_ip, char *server_port) {
-	const char *gs_server = getenv("GPUSOCK_SERVER"),
-		  *gs_port = getenv("GPUSOCK_PORT");
-
-	if (gs_server == NULL) {
-		gs_server = DEFAULT_SERVER_IP;
-		gdprintf("GPUSOCK_SERVER not defined, using default server ip: %s\n", gs_server);
-	}
-	if (gs_port == NULL) {
-		gs_port = DEFAULT_SERVER_PORT;
-		gdprintf("GPUSOCK_PORT not defined, using default server port: %s\n", gs_port);
-	}
-
-	sprintf(server_ip, "%s", gs_server);
-	sprintf(server_port, "%s", gs_port);
-
-	if (server_ip[0] != '\0' && server_port[0] != '\0')
-		return 0;
-	else if (server_port[0] != '\0')
-		return 1;
-	else if (server_ip[0] != '\0')
-		return 2;
-	else
-		return 3;
-}
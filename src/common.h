@@ -24,7 +24,7 @@ typedef enum var_type_e {
 
 typedef struct var_s {
 	var_type type;
-	uint32_t length;
+	uint64_t length;
 	uint32_t elements;
 	void *data;
 } var;
@@ -51,7 +51,11 @@ enum {
 	MEMORY_FREE,
 	MEMCPY_HOST_TO_DEV,
 	MEMCPY_DEV_TO_HOST,
-	LAUNCH_KERNEL
+	LAUNCH_KERNEL,
+	CONTEXT_SYNCHRONIZE,
+	CUDA_CMD_BATCH,
+	STRIPE_OPEN,
+	STRIPE_ATTACH
 };
 
 inline void *malloc_safe_f(size_t size, const char *file, const int line);
@@ -63,8 +67,6 @@ inline void *realloc_safe_f(void *ptr, size_t size, const char *file, const int
 inline void *calloc_safe_f(size_t nmemb, size_t size, const char *file, const int line);
 #define calloc_safe(nmemb, size) calloc_safe_f(nmemb, size, __FILE__, __LINE__)
 
-int get_server_ip(char *server_ip, char *server_port);
-
 #ifdef GPUSOCK_DEBUG
 #define gdprintf printf
 #else
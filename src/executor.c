@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "executor.h"
+#include "common.h"
+
+void init_completion_queue(completion_queue *cq) {
+	pthread_mutex_init(&cq->lock, NULL);
+	INIT_LIST_HEAD(&cq->done);
+
+	cq->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cq->event_fd < 0) {
+		perror("eventfd failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Called by the executors; wakes the network thread up
+void complete_job(completion_queue *cq, job *j) {
+	uint64_t one = 1;
+	int wake;
+
+	pthread_mutex_lock(&cq->lock);
+	wake = list_empty(&cq->done);
+	list_add_tail(&j->node, &cq->done);
+	pthread_mutex_unlock(&cq->lock);
+
+	// The network thread drains the whole queue on every wakeup
+	if (wake && write(cq->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write failed");
+}
+
+// Moves every finished job to done, in completion order
+void take_completions(completion_queue *cq, struct list_head *done) {
+	uint64_t count;
+
+	if (read(cq->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("eventfd read failed");
+
+	pthread_mutex_lock(&cq->lock);
+	list_splice_tail_init(&cq->done, done);
+	pthread_mutex_unlock(&cq->lock);
+}
+
+void free_completion_queue(completion_queue *cq) {
+	close(cq->event_fd);
+	pthread_mutex_destroy(&cq->lock);
+}
+
+static void *executor_loop(void *arg) {
+	executor *exec = arg;
+	job *j;
+
+	gdprintf("Executor %d for <%s> started\n", exec->id, exec->device->cuda_device_name);
+	init_staging_area(&exec->staging, &exec->pool);
+	set_thread_staging_area(&exec->staging);
+	for (;;) {
+		pthread_mutex_lock(&exec->lock);
+		while (list_empty(&exec->jobs) && !exec->stop)
+			pthread_cond_wait(&exec->cond, &exec->lock);
+
+		if (list_empty(&exec->jobs)) {
+			pthread_mutex_unlock(&exec->lock);
+			break;
+		}
+		j = list_first_entry(&exec->jobs, job, node);
+		list_del(&j->node);
+		pthread_mutex_unlock(&exec->lock);
+
+		j->run(j);
+		complete_job(exec->cq, j);
+	}
+	free_staging_area(&exec->staging);
+	gdprintf("Executor %d stopped\n", exec->id);
+
+	return NULL;
+}
+
+// Starts one executor for every device in the list
+int start_executors(struct list_head *executors, void *free_list, completion_queue *cq) {
+	cuda_device_node *pos, *free_list_p = free_list;
+	executor *exec;
+	char name[16];
+	int count = 0, ret;
+
+	list_for_each_entry(pos, &free_list_p->node, node) {
+		exec = malloc_safe(sizeof(*exec));
+		exec->id = count;
+		exec->device = pos;
+		exec->cq = cq;
+		exec->stop = 0;
+		INIT_LIST_HEAD(&exec->jobs);
+		pthread_mutex_init(&exec->lock, NULL);
+		pthread_cond_init(&exec->cond, NULL);
+		init_pinned_pool(&exec->pool, *pos->cuda_device);
+		snprintf(name, sizeof(name), "%d", exec->id);
+		register_traffic(&exec->traffic, "device", name);
+
+		ret = pthread_create(&exec->thread, NULL, executor_loop, exec);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+		list_add_tail(&exec->node, executors);
+		count++;
+	}
+	printf("Started %d executor(s)\n", count);
+
+	return count;
+}
+
+// Looks an executor up by the device handle given to clients
+executor *find_executor(struct list_head *executors, uintptr_t dev_ptr) {
+	executor *exec;
+
+	list_for_each_entry(exec, executors, node) {
+		if ((uintptr_t) exec->device->cuda_device == dev_ptr)
+			return exec;
+	}
+
+	return NULL;
+}
+
+void submit_job(executor *exec, job *j) {
+	pthread_mutex_lock(&exec->lock);
+	list_add_tail(&j->node, &exec->jobs);
+	pthread_cond_signal(&exec->cond);
+	pthread_mutex_unlock(&exec->lock);
+}
+
+// Lets the executors finish their queued jobs and joins them
+void stop_executors(struct list_head *executors) {
+	executor *exec;
+
+	list_for_each_entry(exec, executors, node) {
+		pthread_mutex_lock(&exec->lock);
+		exec->stop = 1;
+		pthread_cond_signal(&exec->cond);
+		pthread_mutex_unlock(&exec->lock);
+	}
+
+	list_for_each_entry(exec, executors, node)
+		pthread_join(exec->thread, NULL);
+}
+
+// Frees stopped executors, once nothing holds buffers of their pools
+void free_executors(struct list_head *executors) {
+	executor *exec, *tmp;
+
+	list_for_each_entry_safe(exec, tmp, executors, node) {
+		free_pinned_pool(&exec->pool);
+		unregister_traffic(&exec->traffic);
+		pthread_cond_destroy(&exec->cond);
+		pthread_mutex_destroy(&exec->lock);
+		list_del(&exec->node);
+		free(exec);
+	}
+}
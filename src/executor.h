@@ -0,0 +1,66 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "process.h"
+#include "metrics.h"
+#include "pool.h"
+#include "staging.h"
+
+/*
+ * One executor thread per CUDA device. The network thread decodes
+ * requests and queues them to the executor of the device the client
+ * works on, so a long memcpy or module load only holds up clients of the
+ * same device. Finished jobs are handed back through a completion queue,
+ * which wakes the network thread up with an eventfd to encode and send
+ * the results. Each executor stages the large memcpys of its device, and
+ * keeps the pinned pool its sessions share.
+ */
+typedef struct job_s {
+	struct list_head node;
+	void (*run)(struct job_s *job);
+} job;
+
+typedef struct completion_queue_s {
+	pthread_mutex_t lock;
+	struct list_head done;
+	int event_fd;
+} completion_queue;
+
+typedef struct executor_s {
+	int id;
+	cuda_device_node *device;
+	completion_queue *cq;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head jobs;
+	pinned_pool pool;
+	staging_area staging;
+	traffic_counters traffic;
+	int stop;
+	struct list_head node;
+} executor;
+
+void init_completion_queue(completion_queue *cq);
+
+void complete_job(completion_queue *cq, job *j);
+
+void take_completions(completion_queue *cq, struct list_head *done);
+
+void free_completion_queue(completion_queue *cq);
+
+int start_executors(struct list_head *executors, void *free_list, completion_queue *cq);
+
+executor *find_executor(struct list_head *executors, uintptr_t dev_ptr);
+
+void submit_job(executor *exec, job *j);
+
+void stop_executors(struct list_head *executors);
+
+void free_executors(struct list_head *executors);
+
+#endif /* EXECUTOR_H */
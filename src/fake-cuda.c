@@ -0,0 +1,732 @@
+/*
+ * A stand-in for the CUDA driver library (libcuda.so.1), so that the
+ * server and the wrapper can be run, benchmarked and tested on machines
+ * without a GPU. It needs no CUDA install either: the declarations it
+ * implements are in fake-cuda.h. It is built by `make fake-cuda` into
+ * fake/, to be put first in LD_LIBRARY_PATH (and in the library path when
+ * linking, where there is no real libcuda at all).
+ *
+ * Device memory is host memory, so device pointers work as host ones.
+ * Every call that would reach a device takes GPUSOCK_FAKE_LATENCY_US
+ * microseconds, and copies also take as long as moving their bytes at
+ * GPUSOCK_FAKE_BW_MBPS MB/s would; both default to 0, for the speed of
+ * the host. GPUSOCK_FAKE_DEVICES sets the number of devices (1 if unset).
+ * Asynchronous copies complete before they return. With
+ * GPUSOCK_FAKE_FAIL_HTOD=n, every nth host-to-device copy fails, to test
+ * how errors in the middle of a transfer are handled.
+ *
+ * Kernels do nothing but take the call latency, except matSum of the
+ * test-cuda example, which adds the ints its first two arguments point
+ * to into the third. Its arguments must come in a parameter buffer
+ * (CU_LAUNCH_PARAM_BUFFER_POINTER), which is how the server passes them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fake-cuda.h"
+#include "utils.h"
+
+#define FAKE_MAX_DEVICES 64
+#define FAKE_CTX_STACK 16
+#define FAKE_ALLOC_BUCKETS 4096
+#define FAKE_MAX_NAME 256
+// Waits longer than this sleep, shorter ones spin
+#define FAKE_SPIN_NS 100000
+
+struct CUctx_st {
+	CUdevice device;
+};
+
+struct CUfunc_st {
+	struct CUfunc_st *next;
+	char name[FAKE_MAX_NAME];
+};
+
+struct CUmod_st {
+	struct CUfunc_st *functions;
+};
+
+struct CUstream_st {
+	int unused;
+};
+
+struct CUevent_st {
+	int unused;
+};
+
+typedef struct fake_alloc_s {
+	struct fake_alloc_s *next;
+	void *ptr;
+	size_t size;
+} fake_alloc;
+
+static int initialized = 0;
+static int device_count = 1;
+static uint64_t latency_ns = 0;
+static uint64_t bandwidth_mbps = 0;
+static uint64_t fail_htod = 0;
+static uint64_t htod_count = 0;
+
+static __thread CUcontext ctx_stack[FAKE_CTX_STACK];
+static __thread int ctx_depth = 0;
+
+// Device allocations, to tell them from bad pointers
+static fake_alloc *allocs[FAKE_ALLOC_BUCKETS];
+static pthread_mutex_t allocs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t get_env_u64(const char *name, uint64_t def) {
+	const char *env = getenv(name);
+
+	return (env != NULL && *env != '\0') ? strtoull(env, NULL, 10) : def;
+}
+
+static uint64_t call_start(void) {
+	return (latency_ns > 0 || bandwidth_mbps > 0) ? now_ns() : 0;
+}
+
+/*
+ * Holds the caller until the call that began at start has taken the
+ * configured latency, plus the time its bytes take at the configured
+ * bandwidth.
+ */
+static void call_end(uint64_t start, size_t bytes) {
+	struct timespec pause;
+	uint64_t deadline, now;
+
+	if (start == 0)
+		return;
+
+	deadline = start + latency_ns;
+	if (bandwidth_mbps > 0)
+		deadline += (uint64_t) bytes * 1000 / bandwidth_mbps;
+
+	while ((now = now_ns()) < deadline) {
+		if (deadline - now > FAKE_SPIN_NS) {
+			pause.tv_sec = (deadline - now - FAKE_SPIN_NS) / 1000000000;
+			pause.tv_nsec = (deadline - now - FAKE_SPIN_NS) % 1000000000;
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+static CUcontext current_ctx(void) {
+	return (ctx_depth > 0) ? ctx_stack[ctx_depth - 1] : NULL;
+}
+
+// The state device work needs: an initialized driver and a context
+static CUresult check_ctx(void) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+
+	return (current_ctx() != NULL) ? CUDA_SUCCESS : CUDA_ERROR_INVALID_CONTEXT;
+}
+
+static unsigned int alloc_bucket(void *ptr) {
+	return ((uintptr_t) ptr >> 8) % FAKE_ALLOC_BUCKETS;
+}
+
+static void add_alloc(void *ptr, size_t size) {
+	fake_alloc *a = malloc(sizeof(*a));
+	unsigned int b = alloc_bucket(ptr);
+
+	a->ptr = ptr;
+	a->size = size;
+	pthread_mutex_lock(&allocs_lock);
+	a->next = allocs[b];
+	allocs[b] = a;
+	pthread_mutex_unlock(&allocs_lock);
+}
+
+// Returns 0 if ptr was allocated and is now forgotten, -1 if it was not
+static int remove_alloc(void *ptr) {
+	fake_alloc **pos, *a;
+	int ret = -1;
+
+	pthread_mutex_lock(&allocs_lock);
+	for (pos = &allocs[alloc_bucket(ptr)]; (a = *pos) != NULL; pos = &a->next) {
+		if (a->ptr == ptr) {
+			*pos = a->next;
+			free(a);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&allocs_lock);
+
+	return ret;
+}
+
+// The allocation that holds ptr, which may point inside it; NULL if none does
+static fake_alloc *find_alloc(void *ptr) {
+	fake_alloc *a, *found = NULL;
+	unsigned int b;
+
+	// Interior pointers hash anywhere, so every bucket is searched
+	pthread_mutex_lock(&allocs_lock);
+	for (b = 0; b < FAKE_ALLOC_BUCKETS && found == NULL; b++) {
+		for (a = allocs[b]; a != NULL; a = a->next) {
+			if ((char *) ptr >= (char *) a->ptr && (char *) ptr < (char *) a->ptr + a->size) {
+				found = a;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&allocs_lock);
+
+	return found;
+}
+
+CUresult cuInit(unsigned int Flags) {
+	uint64_t start;
+
+	if (Flags != 0)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	if (!initialized) {
+		device_count = get_env_u64("GPUSOCK_FAKE_DEVICES", 1);
+		if (device_count > FAKE_MAX_DEVICES)
+			device_count = FAKE_MAX_DEVICES;
+		latency_ns = get_env_u64("GPUSOCK_FAKE_LATENCY_US", 0) * 1000;
+		bandwidth_mbps = get_env_u64("GPUSOCK_FAKE_BW_MBPS", 0);
+		fail_htod = get_env_u64("GPUSOCK_FAKE_FAIL_HTOD", 0);
+		initialized = 1;
+	}
+	start = call_start();
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDriverGetVersion(int *driverVersion) {
+	if (driverVersion == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	*driverVersion = CUDA_VERSION;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetCount(int *count) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (count == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	*count = device_count;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGet(CUdevice *device, int ordinal) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (device == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (ordinal < 0 || ordinal >= device_count)
+		return CUDA_ERROR_INVALID_DEVICE;
+
+	*device = ordinal;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetName(char *name, int len, CUdevice dev) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (name == NULL || len <= 0)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (dev < 0 || dev >= device_count)
+		return CUDA_ERROR_INVALID_DEVICE;
+
+	snprintf(name, len, "gpusockets fake device %d", dev);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev) {
+	CUcontext ctx;
+	uint64_t start;
+
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (pctx == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (dev < 0 || dev >= device_count)
+		return CUDA_ERROR_INVALID_DEVICE;
+	if (ctx_depth == FAKE_CTX_STACK)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+
+	start = call_start();
+	ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	ctx->device = dev;
+	// The new context is pushed on the stack of the calling thread
+	ctx_stack[ctx_depth++] = ctx;
+	*pctx = ctx;
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxDestroy(CUcontext ctx) {
+	uint64_t start;
+
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (ctx == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	start = call_start();
+	if (current_ctx() == ctx)
+		ctx_depth--;
+	free(ctx);
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSetCurrent(CUcontext ctx) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+
+	if (ctx == NULL) {
+		if (ctx_depth > 0)
+			ctx_depth--;
+	} else if (ctx_depth == 0) {
+		ctx_stack[ctx_depth++] = ctx;
+	} else {
+		ctx_stack[ctx_depth - 1] = ctx;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetCurrent(CUcontext *pctx) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (pctx == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	*pctx = current_ctx();
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPushCurrent(CUcontext ctx) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (ctx == NULL)
+		return CUDA_ERROR_INVALID_CONTEXT;
+	if (ctx_depth == FAKE_CTX_STACK)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+
+	ctx_stack[ctx_depth++] = ctx;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPopCurrent(CUcontext *pctx) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (ctx_depth == 0)
+		return CUDA_ERROR_INVALID_CONTEXT;
+
+	ctx_depth--;
+	if (pctx != NULL)
+		*pctx = ctx_stack[ctx_depth];
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSynchronize(void) {
+	CUresult res;
+	uint64_t start;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+
+	start = call_start();
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+static CUresult new_module(CUmodule *module) {
+	*module = calloc(1, sizeof(**module));
+
+	return (*module != NULL) ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+CUresult cuModuleLoad(CUmodule *module, const char *fname) {
+	CUresult res;
+	uint64_t start;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (module == NULL || fname == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+	if (access(fname, R_OK) != 0)
+		return CUDA_ERROR_FILE_NOT_FOUND;
+
+	start = call_start();
+	res = new_module(module);
+	call_end(start, 0);
+
+	return res;
+}
+
+CUresult cuModuleLoadData(CUmodule *module, const void *image) {
+	CUresult res;
+	uint64_t start;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (module == NULL || image == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	start = call_start();
+	res = new_module(module);
+	call_end(start, 0);
+
+	return res;
+}
+
+CUresult cuModuleUnload(CUmodule module) {
+	struct CUfunc_st *func, *next;
+
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+	if (module == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	for (func = module->functions; func != NULL; func = next) {
+		next = func->next;
+		free(func);
+	}
+	free(module);
+
+	return CUDA_SUCCESS;
+}
+
+// Every module has every function; the name picks what a launch does
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule module, const char *name) {
+	CUresult res;
+	CUfunction func;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (hfunc == NULL || module == NULL || name == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	for (func = module->functions; func != NULL; func = func->next) {
+		if (strcmp(func->name, name) == 0)
+			break;
+	}
+	if (func == NULL) {
+		func = calloc(1, sizeof(*func));
+		if (func == NULL)
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		snprintf(func->name, sizeof(func->name), "%s", name);
+		func->next = module->functions;
+		module->functions = func;
+	}
+	*hfunc = func;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize) {
+	CUresult res;
+	uint64_t start;
+	void *ptr;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (dptr == NULL || bytesize == 0)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	start = call_start();
+	// Allocations on a real device are aligned to at least 256 bytes
+	if (posix_memalign(&ptr, 256, bytesize) != 0)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	add_alloc(ptr, bytesize);
+	*dptr = (CUdeviceptr) (uintptr_t) ptr;
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemFree(CUdeviceptr dptr) {
+	CUresult res;
+	uint64_t start;
+	void *ptr = (void *) (uintptr_t) dptr;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+
+	start = call_start();
+	if (remove_alloc(ptr) < 0)
+		return CUDA_ERROR_INVALID_VALUE;
+	free(ptr);
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemGetAddressRange(CUdeviceptr *pbase, size_t *psize, CUdeviceptr dptr) {
+	CUresult res;
+	fake_alloc *a;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if ((a = find_alloc((void *) (uintptr_t) dptr)) == NULL)
+		return CUDA_ERROR_NOT_FOUND;
+
+	if (pbase != NULL)
+		*pbase = (CUdeviceptr) (uintptr_t) a->ptr;
+	if (psize != NULL)
+		*psize = a->size;
+
+	return CUDA_SUCCESS;
+}
+
+static CUresult fake_memcpy(void *dst, const void *src, size_t bytes) {
+	CUresult res;
+	uint64_t start;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if ((dst == NULL || src == NULL) && bytes > 0)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	start = call_start();
+	memcpy(dst, src, bytes);
+	call_end(start, bytes);
+
+	return CUDA_SUCCESS;
+}
+
+// Whether this host-to-device copy is one that is made to fail
+static int htod_fails(void) {
+	return fail_htod > 0 && __atomic_add_fetch(&htod_count, 1, __ATOMIC_RELAXED) % fail_htod == 0;
+}
+
+CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount) {
+	if (htod_fails())
+		return CUDA_ERROR_UNKNOWN;
+
+	return fake_memcpy((void *) (uintptr_t) dstDevice, srcHost, ByteCount);
+}
+
+CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount) {
+	return fake_memcpy(dstHost, (void *) (uintptr_t) srcDevice, ByteCount);
+}
+
+CUresult cuMemcpyHtoDAsync(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount, CUstream hStream) {
+	if (htod_fails())
+		return CUDA_ERROR_UNKNOWN;
+
+	return fake_memcpy((void *) (uintptr_t) dstDevice, srcHost, ByteCount);
+}
+
+CUresult cuMemcpyDtoHAsync(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount, CUstream hStream) {
+	return fake_memcpy(dstHost, (void *) (uintptr_t) srcDevice, ByteCount);
+}
+
+CUresult cuMemHostAlloc(void **pp, size_t bytesize, unsigned int Flags) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (pp == NULL || bytesize == 0)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	if (posix_memalign(pp, sysconf(_SC_PAGESIZE), bytesize) != 0)
+		return CUDA_ERROR_OUT_OF_MEMORY;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAllocHost(void **pp, size_t bytesize) {
+	return cuMemHostAlloc(pp, bytesize, 0);
+}
+
+CUresult cuMemFreeHost(void *p) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+
+	free(p);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemHostRegister(void *p, size_t bytesize, unsigned int Flags) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+
+	return (p != NULL && bytesize > 0) ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+CUresult cuMemHostUnregister(void *p) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+
+	return (p != NULL) ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+CUresult cuStreamCreate(CUstream *phStream, unsigned int Flags) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (phStream == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	*phStream = calloc(1, sizeof(**phStream));
+
+	return (*phStream != NULL) ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+CUresult cuStreamDestroy(CUstream hStream) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+
+	free(hStream);
+
+	return CUDA_SUCCESS;
+}
+
+// Work completes as it is issued, so there is never anything to wait for
+CUresult cuStreamSynchronize(CUstream hStream) {
+	return check_ctx();
+}
+
+CUresult cuEventCreate(CUevent *phEvent, unsigned int Flags) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (phEvent == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	*phEvent = calloc(1, sizeof(**phEvent));
+
+	return (*phEvent != NULL) ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+CUresult cuEventDestroy(CUevent hEvent) {
+	if (!initialized)
+		return CUDA_ERROR_NOT_INITIALIZED;
+
+	free(hEvent);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventRecord(CUevent hEvent, CUstream hStream) {
+	CUresult res;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+
+	return (hEvent != NULL) ? CUDA_SUCCESS : CUDA_ERROR_INVALID_HANDLE;
+}
+
+CUresult cuEventQuery(CUevent hEvent) {
+	return cuEventRecord(hEvent, NULL);
+}
+
+CUresult cuEventSynchronize(CUevent hEvent) {
+	return cuEventRecord(hEvent, NULL);
+}
+
+// Returns the device pointer passed as argument index in the parameter
+// buffer of a launch, or NULL if there is none
+static void *get_buffer_arg(void **extra, int index) {
+	void *buffer = NULL;
+	size_t size = 0;
+	int i;
+
+	for (i = 0; extra != NULL && extra[i] != CU_LAUNCH_PARAM_END; i += 2) {
+		if (extra[i] == CU_LAUNCH_PARAM_BUFFER_POINTER)
+			buffer = extra[i + 1];
+		else if (extra[i] == CU_LAUNCH_PARAM_BUFFER_SIZE)
+			size = *(size_t *) extra[i + 1];
+	}
+	if (buffer == NULL || size < (index + 1) * sizeof(CUdeviceptr))
+		return NULL;
+
+	return (void *) (uintptr_t) ((CUdeviceptr *) buffer)[index];
+}
+
+CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+		unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+		unsigned int sharedMemBytes, CUstream hStream, void **kernelParams, void **extra) {
+	CUresult res;
+	uint64_t start;
+	int *a, *b, *c;
+
+	if ((res = check_ctx()) != CUDA_SUCCESS)
+		return res;
+	if (f == NULL)
+		return CUDA_ERROR_INVALID_HANDLE;
+	if (gridDimX * gridDimY * gridDimZ == 0 || blockDimX * blockDimY * blockDimZ == 0)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	start = call_start();
+	if (strcmp(f->name, "matSum") == 0) {
+		a = get_buffer_arg(extra, 0);
+		b = get_buffer_arg(extra, 1);
+		c = get_buffer_arg(extra, 2);
+		if (a == NULL || b == NULL || c == NULL)
+			return CUDA_ERROR_INVALID_VALUE;
+		*c = *a + *b;
+	}
+	call_end(start, 0);
+
+	return CUDA_SUCCESS;
+}
+
+#if CUDA_VERSION >= 6000
+CUresult cuGetErrorName(CUresult error, const char **pStr) {
+	static const struct {
+		CUresult code;
+		const char *name;
+	} names[] = {
+		{ CUDA_SUCCESS, "CUDA_SUCCESS" },
+		{ CUDA_ERROR_INVALID_VALUE, "CUDA_ERROR_INVALID_VALUE" },
+		{ CUDA_ERROR_OUT_OF_MEMORY, "CUDA_ERROR_OUT_OF_MEMORY" },
+		{ CUDA_ERROR_NOT_INITIALIZED, "CUDA_ERROR_NOT_INITIALIZED" },
+		{ CUDA_ERROR_INVALID_DEVICE, "CUDA_ERROR_INVALID_DEVICE" },
+		{ CUDA_ERROR_INVALID_CONTEXT, "CUDA_ERROR_INVALID_CONTEXT" },
+		{ CUDA_ERROR_FILE_NOT_FOUND, "CUDA_ERROR_FILE_NOT_FOUND" },
+		{ CUDA_ERROR_INVALID_HANDLE, "CUDA_ERROR_INVALID_HANDLE" },
+	};
+	size_t i;
+
+	if (pStr == NULL)
+		return CUDA_ERROR_INVALID_VALUE;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (names[i].code == error) {
+			*pStr = names[i].name;
+			return CUDA_SUCCESS;
+		}
+	}
+	*pStr = NULL;
+
+	return CUDA_ERROR_INVALID_VALUE;
+}
+#endif
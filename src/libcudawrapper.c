@@ -12,6 +12,8 @@
 #include "common.h"
 #include "common.pb-c.h"
 #include "client.h"
+#include "record.h"
+#include "trace.h"
 
 
 //TODO: assert stored results' size fits...
@@ -29,6 +31,8 @@ CUresult cuInit(unsigned int Flags) {
 	if (cuInit_real == NULL)
 		cuInit_real = dlsym(RTLD_NEXT, "cuInit");
 
+	trace_init();
+	record_init();
 	init_params(&c_params);	
 	get_server_connection(&c_params);
 	
@@ -44,6 +48,7 @@ CUresult cuInit(unsigned int Flags) {
 	if (res_code == CUDA_SUCCESS) {
 		c_params.id = *(uint64_t *) result;
 		free(result);	
+		open_stripes(c_params.sock_fd);
 	}
 
 	// Server should have already initialized CUDA Driver API,
@@ -245,6 +250,7 @@ CUresult cuCtxDestroy(CUcontext ctx) {
 		--ctx_count;
 		free(result);	
 	}
+	res_code = check_deferred_error(c_params.sock_fd, res_code);
 
 	// for testing
 	// close(c_params.sock_fd);
@@ -253,6 +259,29 @@ CUresult cuCtxDestroy(CUcontext ctx) {
 	return res_code; // cuCtxDestroy_real(CUcontext ctx);
 }
 
+CUresult cuCtxSynchronize(void) {
+	static CUresult (*cuCtxSynchronize_real) (void) = NULL;
+	void *result = NULL;
+	CUresult res_code;
+
+	if (cuCtxSynchronize_real == NULL)
+		cuCtxSynchronize_real = dlsym(RTLD_NEXT, "cuCtxSynchronize");
+
+	get_server_connection(&c_params);
+
+	if (send_cuda_cmd(c_params.sock_fd, NULL, 0, CONTEXT_SYNCHRONIZE) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	res_code = get_cuda_cmd_result(&result, c_params.sock_fd);
+	if (result != NULL)
+		free(result);
+	res_code = check_deferred_error(c_params.sock_fd, res_code);
+
+	return res_code; // cuCtxSynchronize_real();
+}
+
 CUresult cuModuleLoad(CUmodule *module, const char *fname) {
 	static CUresult (*cuModuleLoad_real) (CUmodule *module, const char *fname) = NULL;
 	void *result = NULL, *file = NULL;
@@ -369,7 +398,6 @@ CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize) {
 
 CUresult cuMemFree(CUdeviceptr dptr) {
 	static CUresult (*cuMemFree_real) (CUdeviceptr dptr) = NULL;
-	void *result = NULL;
 	CUresult res_code;
 	var arg = { .elements = 1 }, *args[] = { &arg };
 	uint32_t param_id;
@@ -389,11 +417,9 @@ CUresult cuMemFree(CUdeviceptr dptr) {
 		exit(EXIT_FAILURE);
 	}
 
-	res_code = get_cuda_cmd_result(&result, c_params.sock_fd);
-	if (res_code == CUDA_SUCCESS) {
+	res_code = defer_cuda_cmd_result(c_params.sock_fd);
+	if (res_code == CUDA_SUCCESS)
 		dptr = 0;
-		free(result);
-	}
 
 	// for testing
 	// close(c_params.sock_fd);
@@ -405,7 +431,6 @@ CUresult cuMemFree(CUdeviceptr dptr) {
 CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount) {
 	static CUresult (*cuMemcpyHtoD_real)
 		(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount) = NULL;
-	void *result = NULL;
 	CUresult res_code;
 	var arg_uint = { .elements = 1 }, arg_b = { .elements = 1 },
 		*args[] = { &arg_uint, &arg_b };
@@ -417,6 +442,12 @@ CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCou
 
 	get_server_connection(&c_params);
 
+	// Co-located clients hand bulk payloads over in shared memory
+	if (ByteCount >= SHM_MIN_PAYLOAD && has_shm_transport(c_params.sock_fd))
+		return shm_memcpy_htod(c_params.sock_fd, dstDevice, srcHost, ByteCount);
+	if (ByteCount >= STRIPE_MIN_PAYLOAD && has_stripes(c_params.sock_fd))
+		return striped_memcpy_htod(c_params.sock_fd, dstDevice, srcHost, ByteCount);
+
 	arg_uint.type = UINT;
 	arg_uint.length = sizeof(uint64_t);
 	arg_uint.data = &dstDevice;
@@ -430,10 +461,8 @@ CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCou
 		exit(EXIT_FAILURE);
 	}
 
-	res_code = get_cuda_cmd_result(&result, c_params.sock_fd);
-
-	if (result != NULL)
-		free(result);	
+	// srcHost has been written out already, so it can be reused at once
+	res_code = defer_cuda_cmd_result(c_params.sock_fd);
 
 	// for testing
 	// close(c_params.sock_fd);
@@ -445,7 +474,6 @@ CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t ByteCou
 CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount) {
 	static CUresult (*cuMemcpyDtoH_real)
 		(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount) = NULL;
-	void *result = NULL;
 	CUresult res_code;
 	var arg = { .elements = 2 }, *args[] = { &arg };
 	uint32_t param_id;
@@ -455,6 +483,15 @@ CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount) {
 		cuMemcpyDtoH_real = dlsym(RTLD_NEXT, "cuMemcpyDtoH");
 
 	get_server_connection(&c_params);
+
+	if (ByteCount >= SHM_MIN_PAYLOAD && has_shm_transport(c_params.sock_fd)) {
+		res_code = shm_memcpy_dtoh(c_params.sock_fd, dstHost, srcDevice, ByteCount);
+		return check_deferred_error(c_params.sock_fd, res_code);
+	}
+	if (ByteCount >= STRIPE_MIN_PAYLOAD && has_stripes(c_params.sock_fd)) {
+		res_code = striped_memcpy_dtoh(c_params.sock_fd, dstHost, srcDevice, ByteCount);
+		return check_deferred_error(c_params.sock_fd, res_code);
+	}
 	
 	arg.type = UINT;
 	arg.length = sizeof(uint64_t) * arg.elements;
@@ -467,11 +504,9 @@ CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount) {
 		exit(EXIT_FAILURE);
 	}
 
-	res_code = get_cuda_cmd_result(&result, c_params.sock_fd);
-	if (res_code == CUDA_SUCCESS) {
-		memcpy(dstHost, result, ByteCount);
-		free(result);
-	}
+	// The data goes straight to dstHost
+	res_code = get_cuda_cmd_result_into(dstHost, ByteCount, c_params.sock_fd);
+	res_code = check_deferred_error(c_params.sock_fd, res_code);
 
 	// for testing
 	// close(c_params.sock_fd);
@@ -490,7 +525,6 @@ CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX,
 		 unsigned int gridDimZ, unsigned int blockDimX, unsigned int blockDimY,
 		 unsigned int blockDimZ, unsigned int sharedMemBytes, CUstream hStream,
 		 void **kernelParams, void **extra) = NULL;
-	void *result = NULL;
 	CUresult res_code;
 	var arg_uint = { .elements = 9 }, arg_b = { .elements = 1 },
 		*args[] = { &arg_uint, &arg_b };
@@ -546,10 +580,7 @@ CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX,
 		exit(EXIT_FAILURE);
 	}
 
-	res_code = get_cuda_cmd_result(&result, c_params.sock_fd);
-
-	if (result != NULL)
-		free(result);	
+	res_code = defer_cuda_cmd_result(c_params.sock_fd);
 
 	// for testing
 	// close(c_params.sock_fd);
@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <cuda.h>
+
+#include "common.h"
+#include "utils.h"
+#include "client.h"
+#include "stripe.h"
+
+/*
+ * Load generator: runs concurrent synthetic client sessions against a
+ * server, each on its own connection and thread, for scaling tests.
+ *
+ *   loadgen [-c sessions] [-d seconds] [-m mix] [-p sizes] [-t think_us]
+ *       [-r seed] [-o results.json]
+ *
+ * The server is found as by the wrapper (GPUSOCK_SERVER and friends), and
+ * the GPUSOCK_* transport settings apply the same way. Every session
+ * connects, gets a device and a context and a buffer on it, waits for the
+ * others, and then issues commands drawn from the mix for the duration,
+ * pausing between them for think times drawn from an exponential
+ * distribution with the given mean (none by default).
+ *
+ * The mix is a list of command:weight, e.g. the default
+ * DEVICE_GET_COUNT:1,MEMCPY_HOST_TO_DEV:4,MEMCPY_DEV_TO_HOST:4,MEMORY_ALLOCATE:1,CONTEXT_SYNCHRONIZE:1
+ * where MEMORY_ALLOCATE is followed by the MEMORY_FREE of the allocation.
+ * Memcpy payload sizes are drawn from sizes, a list of bytes:weight with
+ * K, M or G suffixes (4K:8,64K:4,1M:1 by default).
+ *
+ * The server hands out devices exclusively, so sessions beyond the number
+ * of free devices get none; they only issue DEVICE_GET_COUNT, if the mix
+ * has it, and are reported. At the end it prints the aggregate throughput,
+ * the latency of each command type and the fairness across sessions:
+ * Jain's index of their command counts (1 when all did the same) and
+ * the spread of the counts and of their p99 latencies.
+ */
+
+#define DEFAULT_SESSIONS 10
+#define DEFAULT_SECONDS 10
+#define DEFAULT_MIX "DEVICE_GET_COUNT:1,MEMCPY_HOST_TO_DEV:4,MEMCPY_DEV_TO_HOST:4,MEMORY_ALLOCATE:1,CONTEXT_SYNCHRONIZE:1"
+#define DEFAULT_SIZES "4K:8,64K:4,1M:1"
+#define MAX_CHOICES 32
+#define SMALL_ALLOC 256
+#define SESSION_STACK (256 * 1024)
+
+typedef struct choice_s {
+	uint64_t value;		// command type or payload size
+	double weight;
+} choice;
+
+typedef struct distribution_s {
+	choice choices[MAX_CHOICES];
+	int count;
+	double total;
+} distribution;
+
+typedef struct samples_s {
+	uint64_t *ns;
+	long count;
+	long size;
+} samples;
+
+typedef struct session_s {
+	int index;
+	pthread_t thread;
+	params p;
+	unsigned short rand_state[3];
+	int has_device;
+	uint64_t ctx;
+	uint64_t dptr;
+	void *host;
+	// results
+	samples latency[STRIPE_ATTACH + 1];
+	long ops;
+	long errors;
+	uint64_t bytes;
+	double p99_us;
+} session;
+
+typedef struct command_name_s {
+	int type;
+	const char *name;
+} command_name;
+
+static const command_name command_names[] = {
+	{ DEVICE_GET_COUNT, "DEVICE_GET_COUNT" },
+	{ MEMORY_ALLOCATE, "MEMORY_ALLOCATE" },
+	{ MEMORY_FREE, "MEMORY_FREE" },
+	{ MEMCPY_HOST_TO_DEV, "MEMCPY_HOST_TO_DEV" },
+	{ MEMCPY_DEV_TO_HOST, "MEMCPY_DEV_TO_HOST" },
+	{ CONTEXT_SYNCHRONIZE, "CONTEXT_SYNCHRONIZE" },
+};
+static const int n_command_names = sizeof(command_names) / sizeof(command_names[0]);
+
+static distribution mix, sizes;
+static uint64_t max_size = 0;
+static double think_us = 0;
+static uint64_t deadline_ns;
+static pthread_barrier_t start_barrier;
+
+// Parses value:weight,... where values are command names or byte counts
+static void parse_distribution(distribution *d, const char *spec, int commands) {
+	char *copy = strdup(spec), *item, *colon, *end, *save = NULL;
+	int i;
+
+	d->count = 0;
+	d->total = 0;
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (d->count == MAX_CHOICES || (colon = strchr(item, ':')) == NULL) {
+			fprintf(stderr, "Invalid entry %s\n", item);
+			exit(EXIT_FAILURE);
+		}
+		*colon = '\0';
+		if (commands) {
+			for (i = 0; i < n_command_names; i++) {
+				if (command_names[i].type != MEMORY_FREE && strcmp(command_names[i].name, item) == 0)
+					break;
+			}
+			if (i == n_command_names) {
+				fprintf(stderr, "Unknown command %s\n", item);
+				exit(EXIT_FAILURE);
+			}
+			d->choices[d->count].value = command_names[i].type;
+		} else {
+			d->choices[d->count].value = parse_bytes(item, &end);
+			if (*end != '\0' || d->choices[d->count].value == 0) {
+				fprintf(stderr, "Invalid size %s\n", item);
+				exit(EXIT_FAILURE);
+			}
+		}
+		d->choices[d->count].weight = atof(colon + 1);
+		if (d->choices[d->count].weight <= 0) {
+			fprintf(stderr, "Invalid weight of %s\n", item);
+			exit(EXIT_FAILURE);
+		}
+		d->total += d->choices[d->count++].weight;
+	}
+	free(copy);
+
+	if (d->count == 0) {
+		fprintf(stderr, "Empty distribution %s\n", spec);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Draws a value; device-less sessions only draw DEVICE_GET_COUNT
+static int draw(session *s, distribution *d, uint64_t *value) {
+	double x, total = d->total;
+	int i;
+
+	if (d == &mix && !s->has_device) {
+		for (i = 0; i < d->count; i++) {
+			if (d->choices[i].value == DEVICE_GET_COUNT) {
+				*value = DEVICE_GET_COUNT;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	x = erand48(s->rand_state) * total;
+	for (i = 0; i < d->count - 1 && x >= d->choices[i].weight; i++)
+		x -= d->choices[i].weight;
+	*value = d->choices[i].value;
+
+	return 0;
+}
+
+static void add_sample(samples *smp, uint64_t ns) {
+	if (smp->count == smp->size) {
+		smp->size = (smp->size == 0) ? 1024 : 2 * smp->size;
+		smp->ns = realloc_safe(smp->ns, sizeof(*smp->ns) * smp->size);
+	}
+	smp->ns[smp->count++] = ns;
+}
+
+// Sends a command and waits for its result, which is returned if asked for
+static int64_t call(session *s, var **args, size_t arg_count, int type, uint64_t *value) {
+	void *result = NULL;
+	int64_t res_code;
+
+	if (send_cuda_cmd(s->p.sock_fd, args, arg_count, type) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd!\n");
+		exit(EXIT_FAILURE);
+	}
+	res_code = get_cuda_cmd_result(&result, s->p.sock_fd);
+	if (res_code == CUDA_SUCCESS && value != NULL && result != NULL)
+		*value = *(uint64_t *) result;
+	free(result);
+
+	return res_code;
+}
+
+static int64_t call_uints(session *s, int type, uint64_t *uints, size_t n, uint64_t *value) {
+	var arg = { .type = UINT, .length = sizeof(uint64_t) * n, .elements = n, .data = uints },
+		*args[] = { &arg };
+
+	return call(s, args, (n > 0) ? 1 : 0, type, value);
+}
+
+static int64_t memcpy_htod(session *s, size_t length) {
+	var arg_uint = { .type = UINT, .length = sizeof(uint64_t), .elements = 1, .data = &s->dptr },
+		arg_b = { .type = BYTES, .length = length, .elements = 1, .data = s->host },
+		*args[] = { &arg_uint, &arg_b };
+
+	// Payloads take the same routes as with the wrapper
+	if (length >= SHM_MIN_PAYLOAD && has_shm_transport(s->p.sock_fd))
+		return shm_memcpy_htod(s->p.sock_fd, s->dptr, s->host, length);
+	if (length >= STRIPE_MIN_PAYLOAD && has_stripes(s->p.sock_fd))
+		return striped_memcpy_htod(s->p.sock_fd, s->dptr, s->host, length);
+
+	return call(s, args, 2, MEMCPY_HOST_TO_DEV, NULL);
+}
+
+static int64_t memcpy_dtoh(session *s, size_t length) {
+	uint64_t uints[] = { s->dptr, length };
+	var arg = { .type = UINT, .length = sizeof(uints), .elements = 2, .data = uints },
+		*args[] = { &arg };
+
+	if (length >= SHM_MIN_PAYLOAD && has_shm_transport(s->p.sock_fd))
+		return shm_memcpy_dtoh(s->p.sock_fd, s->host, s->dptr, length);
+	if (length >= STRIPE_MIN_PAYLOAD && has_stripes(s->p.sock_fd))
+		return striped_memcpy_dtoh(s->p.sock_fd, s->host, s->dptr, length);
+
+	if (send_cuda_cmd(s->p.sock_fd, args, 1, MEMCPY_DEV_TO_HOST) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return get_cuda_cmd_result_into(s->host, length, s->p.sock_fd);
+}
+
+// Connects and sets the session up with a device, if one is free
+static void start_session(session *s) {
+	int id = -1;
+	var arg = { .type = INT, .length = sizeof(int), .elements = 1, .data = &id },
+		*args[] = { &arg };
+	uint64_t value, count = 0, dev, uints[2];
+	int64_t res_code;
+	uint64_t i;
+
+	init_params(&s->p);
+	get_server_connection(&s->p);
+	if (call(s, args, 1, INIT, &value) != CUDA_SUCCESS) {
+		fprintf(stderr, "Session %d: INIT failed\n", s->index);
+		exit(EXIT_FAILURE);
+	}
+	s->p.id = value;
+	open_stripes(s->p.sock_fd);
+
+	call_uints(s, DEVICE_GET_COUNT, NULL, 0, &count);
+	// Another session may take the free device first
+	for (i = 0; i < count && !s->has_device; i++) {
+		id = 0;
+		if (call(s, args, 1, DEVICE_GET, &dev) != CUDA_SUCCESS)
+			break;
+		uints[0] = 0;
+		uints[1] = dev;
+		res_code = call_uints(s, CONTEXT_CREATE, uints, 2, &s->ctx);
+		s->has_device = (res_code == CUDA_SUCCESS);
+	}
+	if (!s->has_device)
+		return;
+
+	if (call_uints(s, MEMORY_ALLOCATE, &max_size, 1, &s->dptr) != CUDA_SUCCESS) {
+		fprintf(stderr, "Session %d: cannot allocate %" PRIu64 " bytes\n", s->index, max_size);
+		exit(EXIT_FAILURE);
+	}
+	s->host = malloc_safe(max_size);
+	memset(s->host, s->index, max_size);
+}
+
+static void end_session(session *s) {
+	uint64_t uints[2];
+
+	if (s->has_device) {
+		call_uints(s, MEMORY_FREE, &s->dptr, 1, NULL);
+		// The last context of the client gives the device back
+		uints[0] = s->ctx;
+		uints[1] = 1;
+		call_uints(s, CONTEXT_DESTROY, uints, 2, NULL);
+		free(s->host);
+	}
+	release_client_conn(s->p.sock_fd);
+	close(s->p.sock_fd);
+}
+
+static void think(session *s) {
+	struct timespec pause;
+	double us;
+
+	if (think_us <= 0)
+		return;
+
+	us = -think_us * log(1.0 - erand48(s->rand_state));
+	pause.tv_sec = (time_t) (us / 1e6);
+	pause.tv_nsec = (long) ((us - pause.tv_sec * 1e6) * 1e3);
+	nanosleep(&pause, NULL);
+}
+
+// Issues one command of the mix; returns its type
+static int run_command(session *s, int type) {
+	uint64_t start, size = 0, dptr;
+	int64_t res_code = CUDA_SUCCESS;
+
+	if (type == MEMCPY_HOST_TO_DEV || type == MEMCPY_DEV_TO_HOST)
+		draw(s, &sizes, &size);
+
+	start = now_ns();
+	switch (type) {
+		case DEVICE_GET_COUNT:
+		case CONTEXT_SYNCHRONIZE:
+			res_code = call_uints(s, type, NULL, 0, NULL);
+			break;
+		case MEMORY_ALLOCATE:
+			size = SMALL_ALLOC;
+			res_code = call_uints(s, MEMORY_ALLOCATE, &size, 1, &dptr);
+			size = 0;
+			add_sample(&s->latency[MEMORY_ALLOCATE], now_ns() - start);
+			s->ops++;
+			if (res_code != CUDA_SUCCESS)
+				break;
+			start = now_ns();
+			res_code = call_uints(s, MEMORY_FREE, &dptr, 1, NULL);
+			type = MEMORY_FREE;
+			break;
+		case MEMCPY_HOST_TO_DEV:
+			res_code = memcpy_htod(s, size);
+			break;
+		case MEMCPY_DEV_TO_HOST:
+			res_code = memcpy_dtoh(s, size);
+			break;
+	}
+	add_sample(&s->latency[type], now_ns() - start);
+	s->ops++;
+	s->bytes += size;
+	if (res_code != CUDA_SUCCESS)
+		s->errors++;
+
+	return type;
+}
+
+static void *run_session(void *arg) {
+	session *s = arg;
+	uint64_t type;
+
+	start_session(s);
+	// Once for the setup of every session and once for the deadline
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+
+	while (now_ns() < deadline_ns && draw(s, &mix, &type) == 0) {
+		run_command(s, type);
+		think(s);
+	}
+
+	end_session(s);
+
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// Gathers the samples of every session for a command type, or for all types
+static long merge_samples(session *sessions, int n, int type, uint64_t **merged) {
+	long count = 0, off = 0;
+	int i, t;
+
+	for (i = 0; i < n; i++) {
+		for (t = 0; t <= STRIPE_ATTACH; t++) {
+			if (type < 0 || t == type)
+				count += sessions[i].latency[t].count;
+		}
+	}
+	*merged = malloc_safe(sizeof(**merged) * (count + 1));
+	for (i = 0; i < n; i++) {
+		for (t = 0; t <= STRIPE_ATTACH; t++) {
+			if (type >= 0 && t != type)
+				continue;
+			memcpy(*merged + off, sessions[i].latency[t].ns, sizeof(**merged) * sessions[i].latency[t].count);
+			off += sessions[i].latency[t].count;
+		}
+	}
+	qsort(*merged, count, sizeof(**merged), compare_u64);
+
+	return count;
+}
+
+static void report(session *sessions, int n, double seconds, const char *json_path) {
+	extern char **environ;
+	uint64_t *merged, bytes = 0;
+	long count, ops = 0, errors = 0, min_ops = -1, max_ops = 0;
+	double sum = 0, sum_sq = 0, jain, *p99s;
+	int i, t, with_device = 0, sep = 0;
+	char **env, *eq;
+	FILE *f = NULL;
+
+	p99s = malloc_safe(sizeof(*p99s) * n);
+	for (i = 0; i < n; i++) {
+		ops += sessions[i].ops;
+		errors += sessions[i].errors;
+		bytes += sessions[i].bytes;
+		with_device += sessions[i].has_device;
+		sum += sessions[i].ops;
+		sum_sq += (double) sessions[i].ops * sessions[i].ops;
+		if (min_ops < 0 || sessions[i].ops < min_ops)
+			min_ops = sessions[i].ops;
+		if (sessions[i].ops > max_ops)
+			max_ops = sessions[i].ops;
+		count = merge_samples(&sessions[i], 1, -1, &merged);
+		p99s[i] = sessions[i].p99_us = percentile_us(merged, count, 0.99);
+		free(merged);
+	}
+	jain = (sum_sq > 0) ? sum * sum / (n * sum_sq) : 0;
+	qsort(p99s, n, sizeof(*p99s), compare_double);
+
+	if (json_path != NULL && (f = fopen(json_path, "w")) == NULL) {
+		perror("Cannot write the results");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("sessions %d (%d with a device), %.1f s\n", n, with_device, seconds);
+	printf("commands %ld (%.0f/s), errors %ld, payload %.2f MB/s\n", ops, ops / seconds, errors,
+			bytes / seconds / 1e6);
+	printf("fairness: jain %.4f, commands per session min %ld max %ld, "
+			"session p99 min %.2f us median %.2f us max %.2f us\n",
+			jain, min_ops, max_ops, p99s[0], p99s[n / 2], p99s[n - 1]);
+	if (f != NULL) {
+		fprintf(f, "{\n  \"sessions\": %d,\n  \"sessions_with_device\": %d,\n  \"seconds\": %.3f,\n"
+				"  \"commands\": %ld,\n  \"commands_per_s\": %.3f,\n  \"errors\": %ld,\n"
+				"  \"payload_mb_per_s\": %.3f,\n", n, with_device, seconds, ops, ops / seconds, errors,
+				bytes / seconds / 1e6);
+		fprintf(f, "  \"fairness\": {\"jain\": %.6f, \"min_commands\": %ld, \"max_commands\": %ld, "
+				"\"min_p99_us\": %.3f, \"median_p99_us\": %.3f, \"max_p99_us\": %.3f},\n",
+				jain, min_ops, max_ops, p99s[0], p99s[n / 2], p99s[n - 1]);
+		fprintf(f, "  \"settings\": {");
+		for (env = environ; *env != NULL; env++) {
+			if (strncmp(*env, "GPUSOCK_", 8) != 0 || (eq = strchr(*env, '=')) == NULL ||
+					strpbrk(eq, "\"\\") != NULL)
+				continue;
+			fprintf(f, "%s\n    \"%.*s\": \"%s\"", sep++ ? "," : "", (int) (eq - *env), *env, eq + 1);
+		}
+		fprintf(f, "\n  },\n  \"latency\": [");
+	}
+
+	printf("\n%-20s %10s %10s %10s %10s %10s\n", "command", "count", "p50_us", "p99_us", "p99.9_us", "max_us");
+	for (t = -1, sep = 0; t < n_command_names; t++) {
+		count = merge_samples(sessions, n, (t < 0) ? -1 : command_names[t].type, &merged);
+		if (count > 0) {
+			printf("%-20s %10ld %10.2f %10.2f %10.2f %10.2f\n", (t < 0) ? "all" : command_names[t].name,
+					count, percentile_us(merged, count, 0.50), percentile_us(merged, count, 0.99),
+					percentile_us(merged, count, 0.999), merged[count - 1] / 1e3);
+			if (f != NULL)
+				fprintf(f, "%s\n    {\"command\": \"%s\", \"count\": %ld, \"p50_us\": %.3f, "
+						"\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}", sep++ ? "," : "",
+						(t < 0) ? "all" : command_names[t].name, count, percentile_us(merged, count, 0.50),
+						percentile_us(merged, count, 0.99), percentile_us(merged, count, 0.999),
+						merged[count - 1] / 1e3);
+		}
+		free(merged);
+	}
+
+	if (f != NULL) {
+		fprintf(f, "\n  ],\n  \"per_session\": [");
+		for (i = 0; i < n; i++)
+			fprintf(f, "%s\n    {\"commands\": %ld, \"errors\": %ld, \"device\": %s, \"p99_us\": %.3f}",
+					i ? "," : "", sessions[i].ops, sessions[i].errors,
+					sessions[i].has_device ? "true" : "false", sessions[i].p99_us);
+		fprintf(f, "\n  ]\n}\n");
+		fclose(f);
+	}
+	free(p99s);
+}
+
+int main(int argc, char *argv[]) {
+	const char *mix_spec = DEFAULT_MIX, *sizes_spec = DEFAULT_SIZES, *json_path = NULL;
+	int opt, i, t, n = DEFAULT_SESSIONS, ret;
+	double seconds = DEFAULT_SECONDS;
+	long seed = 1;
+	uint64_t start;
+	pthread_attr_t attr;
+	session *sessions;
+
+	while ((opt = getopt(argc, argv, "c:d:m:p:t:r:o:")) != -1) {
+		switch (opt) {
+			case 'c':
+				n = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atof(optarg);
+				break;
+			case 'm':
+				mix_spec = optarg;
+				break;
+			case 'p':
+				sizes_spec = optarg;
+				break;
+			case 't':
+				think_us = atof(optarg);
+				break;
+			case 'r':
+				seed = atol(optarg);
+				break;
+			case 'o':
+				json_path = optarg;
+				break;
+			default:
+				printf("Usage: loadgen [-c sessions] [-d seconds] [-m mix] [-p sizes] "
+						"[-t think_us] [-r seed] [-o results.json]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (n <= 0 || seconds <= 0) {
+		fprintf(stderr, "sessions and seconds must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+	parse_distribution(&mix, mix_spec, 1);
+	parse_distribution(&sizes, sizes_spec, 0);
+	for (i = 0; i < sizes.count; i++) {
+		if (sizes.choices[i].value > max_size)
+			max_size = sizes.choices[i].value;
+	}
+
+	sessions = calloc_safe(n, sizeof(*sessions));
+	pthread_barrier_init(&start_barrier, NULL, n + 1);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, SESSION_STACK);
+	for (i = 0; i < n; i++) {
+		sessions[i].index = i;
+		sessions[i].rand_state[0] = seed;
+		sessions[i].rand_state[1] = seed >> 16;
+		sessions[i].rand_state[2] = i;
+		ret = pthread_create(&sessions[i].thread, &attr, run_session, &sessions[i]);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	// Sessions start together, once all of them are set up
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	deadline_ns = start + (uint64_t) (seconds * 1e9);
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < n; i++)
+		pthread_join(sessions[i].thread, NULL);
+	seconds = (now_ns() - start) / 1e9;
+
+	report(sessions, n, seconds, json_path);
+
+	for (i = 0; i < n; i++) {
+		for (t = 0; t <= STRIPE_ATTACH; t++)
+			free(sessions[i].latency[t].ns);
+	}
+	free(sessions);
+	pthread_barrier_destroy(&start_barrier);
+
+	return 0;
+}
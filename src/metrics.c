@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "protocol.h"
+#include "trace.h"
+#include "transport.h"
+
+#define METRICS_MAX_REQUEST 4096
+
+typedef struct latency_histogram_s {
+	uint64_t buckets[METRICS_BUCKETS];
+	uint64_t sum_ns;
+} latency_histogram;
+
+typedef struct command_metrics_s {
+	uint64_t count;
+	uint64_t failed;
+	latency_histogram phases[METRICS_PHASES];
+} command_metrics;
+
+// Growing text of a scrape
+typedef struct metrics_text_s {
+	char *data;
+	size_t length;
+	size_t size;
+} metrics_text;
+
+static command_metrics commands[METRICS_CMD_TYPES];
+
+static LIST_HEAD(traffic);
+static pthread_mutex_t traffic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int listen_fd = -1;
+static int stopping = 0;
+static pthread_t metrics_thread;
+
+static const char *command_names[METRICS_CMD_TYPES] = {
+	[CUDA_DEVICE_QUERY] = "device_query",
+	[INIT] = "init",
+	[DEVICE_GET] = "device_get",
+	[DEVICE_GET_COUNT] = "device_get_count",
+	[DEVICE_GET_NAME] = "device_get_name",
+	[CONTEXT_CREATE] = "context_create",
+	[CONTEXT_DESTROY] = "context_destroy",
+	[MODULE_LOAD] = "module_load",
+	[MODULE_GET_FUNCTION] = "module_get_function",
+	[MEMORY_ALLOCATE] = "memory_allocate",
+	[MEMORY_FREE] = "memory_free",
+	[MEMCPY_HOST_TO_DEV] = "memcpy_htod",
+	[MEMCPY_DEV_TO_HOST] = "memcpy_dtoh",
+	[LAUNCH_KERNEL] = "launch_kernel",
+	[CONTEXT_SYNCHRONIZE] = "context_synchronize",
+	[CUDA_CMD_BATCH] = "batch",
+	[STRIPE_OPEN] = "stripe_open",
+	[STRIPE_ATTACH] = "stripe_attach",
+};
+
+static const char *phase_names[METRICS_PHASES] = { "decode", "exec", "encode", "send" };
+
+uint64_t metrics_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Upper bound of bucket i: 1us, 1.5us, 2us, 3us, 4us, 6us, ...
+static uint64_t bucket_bound(int i) {
+	return (uint64_t) ((i % 2) ? 1500 : 1000) << (i / 2);
+}
+
+static int bucket_of(uint64_t ns) {
+	int lo = 0, hi = METRICS_BUCKETS - 1, mid;
+
+	// The first bucket whose bound is not below ns; the last one if none
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ns <= bucket_bound(mid))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+// Adds the time since start_ns to the histogram of a command phase
+void record_phase(int cmd_type, int phase, uint64_t start_ns) {
+	latency_histogram *h;
+	uint64_t ns = metrics_now() - start_ns;
+
+	if (cmd_type < 0 || cmd_type >= METRICS_CMD_TYPES || command_names[cmd_type] == NULL)
+		return;
+
+	h = &commands[cmd_type].phases[phase];
+	__atomic_fetch_add(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+void count_command(int cmd_type, int failed) {
+	if (cmd_type < 0 || cmd_type >= METRICS_CMD_TYPES || command_names[cmd_type] == NULL)
+		return;
+
+	__atomic_fetch_add(&commands[cmd_type].count, 1, __ATOMIC_RELAXED);
+	if (failed)
+		__atomic_fetch_add(&commands[cmd_type].failed, 1, __ATOMIC_RELAXED);
+}
+
+void register_traffic(traffic_counters *t, const char *kind, const char *label) {
+	t->kind = kind;
+	snprintf(t->label, sizeof(t->label), "%s", label);
+	t->bytes_in = 0;
+	t->bytes_out = 0;
+
+	pthread_mutex_lock(&traffic_lock);
+	list_add_tail(&t->node, &traffic);
+	pthread_mutex_unlock(&traffic_lock);
+}
+
+void unregister_traffic(traffic_counters *t) {
+	pthread_mutex_lock(&traffic_lock);
+	list_del(&t->node);
+	pthread_mutex_unlock(&traffic_lock);
+}
+
+void add_traffic(traffic_counters *t, uint64_t bytes_in, uint64_t bytes_out) {
+	if (bytes_in > 0)
+		__atomic_fetch_add(&t->bytes_in, bytes_in, __ATOMIC_RELAXED);
+	if (bytes_out > 0)
+		__atomic_fetch_add(&t->bytes_out, bytes_out, __ATOMIC_RELAXED);
+}
+
+static void append(metrics_text *text, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(text->data + text->length, text->size - text->length, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (text->length + n < text->size)
+			break;
+		text->size = 2 * (text->length + n + 1);
+		text->data = realloc_safe(text->data, text->size);
+	}
+	text->length += n;
+}
+
+static void format_histograms(metrics_text *text) {
+	latency_histogram *h;
+	uint64_t counts[METRICS_BUCKETS], total;
+	int cmd, phase, i;
+
+	append(text, "# HELP gpusock_command_phase_seconds Time commands spent in each phase.\n");
+	append(text, "# TYPE gpusock_command_phase_seconds histogram\n");
+	for (cmd = 0; cmd < METRICS_CMD_TYPES; cmd++) {
+		for (phase = 0; command_names[cmd] != NULL && phase < METRICS_PHASES; phase++) {
+			h = &commands[cmd].phases[phase];
+			total = 0;
+			for (i = 0; i < METRICS_BUCKETS; i++) {
+				counts[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+				total += counts[i];
+			}
+			if (total == 0)
+				continue;
+
+			// Buckets are cumulative; the count is taken from them so
+			// that the series agree with each other
+			total = 0;
+			for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+				total += counts[i];
+				append(text, "gpusock_command_phase_seconds_bucket{command=\"%s\",phase=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+						command_names[cmd], phase_names[phase], bucket_bound(i) / 1e9, total);
+			}
+			total += counts[i];
+			append(text, "gpusock_command_phase_seconds_bucket{command=\"%s\",phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+					command_names[cmd], phase_names[phase], total);
+			append(text, "gpusock_command_phase_seconds_sum{command=\"%s\",phase=\"%s\"} %.9f\n",
+					command_names[cmd], phase_names[phase],
+					__atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+			append(text, "gpusock_command_phase_seconds_count{command=\"%s\",phase=\"%s\"} %" PRIu64 "\n",
+					command_names[cmd], phase_names[phase], total);
+		}
+	}
+}
+
+static void format_metrics(metrics_text *text) {
+	traffic_counters *t;
+	int cmd;
+
+	append(text, "# HELP gpusock_commands_total Commands run.\n");
+	append(text, "# TYPE gpusock_commands_total counter\n");
+	for (cmd = 0; cmd < METRICS_CMD_TYPES; cmd++) {
+		if (command_names[cmd] != NULL)
+			append(text, "gpusock_commands_total{command=\"%s\"} %" PRIu64 "\n", command_names[cmd],
+					__atomic_load_n(&commands[cmd].count, __ATOMIC_RELAXED));
+	}
+	append(text, "# HELP gpusock_command_errors_total Commands that did not return CUDA_SUCCESS.\n");
+	append(text, "# TYPE gpusock_command_errors_total counter\n");
+	for (cmd = 0; cmd < METRICS_CMD_TYPES; cmd++) {
+		if (command_names[cmd] != NULL)
+			append(text, "gpusock_command_errors_total{command=\"%s\"} %" PRIu64 "\n", command_names[cmd],
+					__atomic_load_n(&commands[cmd].failed, __ATOMIC_RELAXED));
+	}
+	format_histograms(text);
+
+	append(text, "# HELP gpusock_bytes_total Bytes received and sent over the sockets.\n");
+	append(text, "# TYPE gpusock_bytes_total counter\n");
+	pthread_mutex_lock(&traffic_lock);
+	list_for_each_entry(t, &traffic, node) {
+		append(text, "gpusock_bytes_total{%s=\"%s\",direction=\"in\"} %" PRIu64 "\n", t->kind, t->label,
+				__atomic_load_n(&t->bytes_in, __ATOMIC_RELAXED));
+		append(text, "gpusock_bytes_total{%s=\"%s\",direction=\"out\"} %" PRIu64 "\n", t->kind, t->label,
+				__atomic_load_n(&t->bytes_out, __ATOMIC_RELAXED));
+	}
+	pthread_mutex_unlock(&traffic_lock);
+
+	append(text, "# HELP gpusock_socket_syscalls_total Socket reads and writes.\n");
+	append(text, "# TYPE gpusock_socket_syscalls_total counter\n");
+	append(text, "gpusock_socket_syscalls_total{direction=\"rx\"} %" PRIu64 "\n",
+			__atomic_load_n(&gs_io_stats.rx_syscalls, __ATOMIC_RELAXED));
+	append(text, "gpusock_socket_syscalls_total{direction=\"tx\"} %" PRIu64 "\n",
+			__atomic_load_n(&gs_io_stats.tx_syscalls, __ATOMIC_RELAXED));
+}
+
+static void send_all(int sock_fd, const char *data, size_t length) {
+	ssize_t ret;
+
+	while (length > 0) {
+		ret = send(sock_fd, data, length, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		data += ret;
+		length -= ret;
+	}
+}
+
+#ifdef GPUSOCK_TRACE
+// Sends the trace recorded so far, if tracing is on
+static void serve_trace(int sock_fd) {
+	char header[256], *data = NULL;
+	size_t length = 0;
+	FILE *f;
+	int ret;
+
+	f = open_memstream(&data, &length);
+	if (f == NULL) {
+		perror("open_memstream failed");
+		return;
+	}
+	ret = trace_dump(f);
+	fclose(f);
+
+	if (ret < 0)
+		snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+	else
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: application/json\r\n"
+				"Content-Length: %zu\r\n\r\n", length);
+	send_all(sock_fd, header, strlen(header));
+	if (ret >= 0)
+		send_all(sock_fd, data, length);
+	free(data);
+}
+#endif
+
+// Answers one HTTP request; the scraper opens a connection per scrape
+static void serve_scrape(int sock_fd) {
+	char request[METRICS_MAX_REQUEST], header[256], *path, *end;
+	struct timeval timeout = { .tv_sec = 2 };
+	metrics_text text = { NULL, 0, 0 };
+	size_t length = 0;
+	ssize_t ret;
+
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (length < sizeof(request) - 1) {
+		ret = recv(sock_fd, request + length, sizeof(request) - 1 - length, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		length += ret;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n") != NULL)
+			break;
+	}
+	request[length] = '\0';
+
+	if (strncmp(request, "GET ", 4) != 0) {
+		append(&text, "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+		send_all(sock_fd, text.data, text.length);
+		free(text.data);
+		return;
+	}
+	path = request + 4;
+	end = path + strcspn(path, " ?\r\n");
+	*end = '\0';
+#ifdef GPUSOCK_TRACE
+	if (strcmp(path, "/trace") == 0) {
+		serve_trace(sock_fd);
+		return;
+	}
+#endif
+	if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+		append(&text, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+		send_all(sock_fd, text.data, text.length);
+		free(text.data);
+		return;
+	}
+
+	format_metrics(&text);
+	snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", text.length);
+	send_all(sock_fd, header, strlen(header));
+	send_all(sock_fd, text.data, text.length);
+	free(text.data);
+}
+
+static void *metrics_loop(void *arg) {
+	int sock_fd;
+
+	for (;;) {
+		sock_fd = accept(listen_fd, NULL, NULL);
+		if (sock_fd < 0) {
+			if (__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+				break;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("metrics accept failed");
+			break;
+		}
+		serve_scrape(sock_fd);
+		close(sock_fd);
+	}
+
+	return NULL;
+}
+
+// Serves the metrics on GPUSOCK_METRICS_PORT, if set
+void start_metrics(void) {
+	const char *port = getenv("GPUSOCK_METRICS_PORT");
+	transport_addr addr;
+	int ret;
+
+	if (port == NULL || *port == '\0')
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.kind = TRANSPORT_TCP;
+	snprintf(addr.port, sizeof(addr.port), "%s", port);
+	listen_fd = transport_listen(&addr);
+
+	ret = pthread_create(&metrics_thread, NULL, metrics_loop, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	printf("Serving metrics on port %s\n", port);
+}
+
+void stop_metrics(void) {
+	if (listen_fd < 0)
+		return;
+
+	// Shutting the listening socket down wakes accept() up
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+	shutdown(listen_fd, SHUT_RDWR);
+	pthread_join(metrics_thread, NULL);
+	close(listen_fd);
+	listen_fd = -1;
+}
@@ -0,0 +1,63 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "list.h"
+
+/*
+ * Server metrics: per command type counts and latency histograms of the
+ * decode, execute, encode and send phases, and the bytes that went in and
+ * out over the sockets per session and per device. They are updated with
+ * relaxed atomics by whichever thread finishes a phase, so nothing on the
+ * command path takes a lock for them.
+ *
+ * With GPUSOCK_METRICS_PORT set, a thread of their own serves them in the
+ * Prometheus text format over HTTP on that port (any path but /metrics
+ * and / gets a 404), reading the counters while the server runs. Built
+ * with tracing, it serves the trace recorded so far at /trace too.
+ *
+ * Histograms are log-linear like HDR histograms, with two buckets per
+ * power of two from 1us up; the last bucket takes everything longer.
+ * Commands are indexed by their CUDA_CMD type, and a device query by its
+ * message type, which no command type uses.
+ */
+#define METRICS_CMD_TYPES (STRIPE_ATTACH + 1)
+#define METRICS_BUCKETS 48
+#define METRICS_MAX_LABEL 64
+
+enum {
+	PHASE_DECODE,
+	PHASE_EXEC,
+	PHASE_ENCODE,
+	PHASE_SEND,
+	METRICS_PHASES
+};
+
+// Bytes of a session or device; registered while they exist
+typedef struct traffic_counters_s {
+	struct list_head node;
+	const char *kind;	// "session" or "device"
+	char label[METRICS_MAX_LABEL];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} traffic_counters;
+
+void start_metrics(void);
+
+void stop_metrics(void);
+
+uint64_t metrics_now(void);
+
+void record_phase(int cmd_type, int phase, uint64_t start_ns);
+
+void count_command(int cmd_type, int failed);
+
+void register_traffic(traffic_counters *t, const char *kind, const char *label);
+
+void unregister_traffic(traffic_counters *t);
+
+void add_traffic(traffic_counters *t, uint64_t bytes_in, uint64_t bytes_out);
+
+#endif /* METRICS_H */
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "process.h"
+#include "common.h"
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define REGISTRY_BUCKETS 256
+
+typedef struct pinned_buffer_s {
+	struct list_head node;		// in the idle list of its class
+	struct pinned_buffer_s *next;	// in its registry bucket
+	pinned_pool *pool;
+	void *data;
+	int cls;
+	int huge;
+} pinned_buffer;
+
+// Every buffer of every pool, idle or not, by address, to find the pool of
+// a buffer and to tell pinned buffers from pageable ones
+static pinned_buffer *registry[REGISTRY_BUCKETS];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t class_size(int cls) {
+	return (size_t) POOL_MIN_BUFFER << cls;
+}
+
+static unsigned int bucket_of(const void *ptr) {
+	return ((uintptr_t) ptr / POOL_MIN_BUFFER) % REGISTRY_BUCKETS;
+}
+
+static void register_buffer(pinned_buffer *buf) {
+	unsigned int b = bucket_of(buf->data);
+
+	pthread_mutex_lock(&registry_lock);
+	buf->next = registry[b];
+	registry[b] = buf;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void unregister_buffer(pinned_buffer *buf) {
+	pinned_buffer **pos;
+
+	pthread_mutex_lock(&registry_lock);
+	for (pos = &registry[bucket_of(buf->data)]; *pos != NULL; pos = &(*pos)->next) {
+		if (*pos == buf) {
+			*pos = buf->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static pinned_buffer *find_buffer(const void *ptr) {
+	pinned_buffer *buf;
+
+	pthread_mutex_lock(&registry_lock);
+	for (buf = registry[bucket_of(ptr)]; buf != NULL; buf = buf->next) {
+		if (buf->data == ptr)
+			break;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	return buf;
+}
+
+void init_pinned_pool(pinned_pool *pool, CUdevice device) {
+	const char *env;
+	int i;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->device = device;
+	pool->ctx = NULL;
+	pool->budget = (size_t) POOL_DEFAULT_MB << 20;
+	pool->pinned = 0;
+	pool->in_use = 0;
+	pool->hugepages = 0;
+	pool->failed = 0;
+	for (i = 0; i < POOL_CLASSES; i++)
+		INIT_LIST_HEAD(&pool->idle[i]);
+
+	if ((env = getenv("GPUSOCK_PINNED_POOL_MB")) != NULL)
+		pool->budget = (size_t) strtoul(env, NULL, 10) << 20;
+	if ((env = getenv("GPUSOCK_PINNED_HUGEPAGES")) != NULL)
+		pool->hugepages = (atoi(env) != 0);
+}
+
+// Creates the context of the pool on first use; called with the lock held
+static int get_context(pinned_pool *pool) {
+	CUcontext ctx;
+
+	if (pool->ctx != NULL)
+		return 0;
+	if (pool->failed)
+		return -1;
+
+	// cuCtxCreate() makes the new context current; popping it restores
+	// the context of the calling thread
+	if (cuda_err_print(cuCtxCreate(&pool->ctx, 0, pool->device), 0) != CUDA_SUCCESS) {
+		fprintf(stderr, "Cannot create the context of the pinned pool, using pageable memory\n");
+		pool->ctx = NULL;
+		pool->failed = 1;
+		return -1;
+	}
+	cuCtxPopCurrent(&ctx);
+
+	return 0;
+}
+
+static void *map_huge_pages(size_t size) {
+	void *data;
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+	if (cuda_err_print(cuMemHostRegister(data, size, CU_MEMHOSTREGISTER_PORTABLE), 0) != CUDA_SUCCESS) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	return data;
+}
+
+// Pins a new buffer of class cls, whose size is already counted as
+// pinned; called without the lock, since pinning can take a while
+static pinned_buffer *new_buffer(pinned_pool *pool, int cls) {
+	pinned_buffer *buf;
+	CUcontext ctx;
+	size_t size = class_size(cls);
+
+	buf = malloc_safe(sizeof(*buf));
+	buf->pool = pool;
+	buf->data = NULL;
+	buf->cls = cls;
+	buf->huge = 0;
+
+	cuCtxPushCurrent(pool->ctx);
+	if (pool->hugepages && size >= HUGE_PAGE_SIZE) {
+		buf->data = map_huge_pages(size);
+		buf->huge = (buf->data != NULL);
+	}
+	if (buf->data == NULL && cuda_err_print(cuMemHostAlloc(&buf->data, size, CU_MEMHOSTALLOC_PORTABLE), 0) != CUDA_SUCCESS)
+		buf->data = NULL;
+	cuCtxPopCurrent(&ctx);
+
+	if (buf->data == NULL) {
+		free(buf);
+		return NULL;
+	}
+	gdprintf("Pinned a %zuB buffer%s for device %d\n", size, buf->huge ? " on huge pages" : "", pool->device);
+	register_buffer(buf);
+
+	return buf;
+}
+
+// Unpins an idle buffer; called with the lock held
+static void destroy_buffer(pinned_buffer *buf) {
+	pinned_pool *pool = buf->pool;
+	CUcontext ctx;
+	size_t size = class_size(buf->cls);
+
+	list_del(&buf->node);
+	unregister_buffer(buf);
+
+	cuCtxPushCurrent(pool->ctx);
+	if (buf->huge) {
+		cuMemHostUnregister(buf->data);
+		munmap(buf->data, size);
+	} else {
+		cuMemFreeHost(buf->data);
+	}
+	cuCtxPopCurrent(&ctx);
+
+	pool->pinned -= size;
+	free(buf);
+}
+
+// Gives idle buffers back until size more bytes fit in the budget
+static int make_room(pinned_pool *pool, size_t size) {
+	int cls;
+
+	for (cls = POOL_CLASSES - 1; cls >= 0 && pool->pinned + size > pool->budget; cls--) {
+		while (!list_empty(&pool->idle[cls]) && pool->pinned + size > pool->budget)
+			destroy_buffer(list_first_entry(&pool->idle[cls], pinned_buffer, node));
+	}
+
+	return (pool->pinned + size <= pool->budget) ? 0 : -1;
+}
+
+/*
+ * Returns a pinned buffer of at least size bytes, or NULL if the pool
+ * cannot provide one and the caller should use pageable memory.
+ */
+void *pool_alloc(pinned_pool *pool, size_t size) {
+	pinned_buffer *buf = NULL;
+	int cls, grow = 0;
+
+	if (pool == NULL || pool->budget == 0 || size > POOL_MAX_BUFFER)
+		return NULL;
+
+	for (cls = 0; class_size(cls) < size; cls++)
+		;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!list_empty(&pool->idle[cls])) {
+		buf = list_first_entry(&pool->idle[cls], pinned_buffer, node);
+		list_del(&buf->node);
+		pool->in_use++;
+	} else if (get_context(pool) == 0 && make_room(pool, class_size(cls)) == 0) {
+		// Counted in now, so that the context stays and the budget holds
+		// while the buffer is pinned
+		pool->pinned += class_size(cls);
+		pool->in_use++;
+		grow = 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (grow && (buf = new_buffer(pool, cls)) == NULL) {
+		pthread_mutex_lock(&pool->lock);
+		pool->pinned -= class_size(cls);
+		pool->in_use--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return (buf != NULL) ? buf->data : NULL;
+}
+
+int is_pinned_buffer(const void *ptr) {
+	return ptr != NULL && find_buffer(ptr) != NULL;
+}
+
+// Returns a buffer that pool_alloc() handed out to its pool
+void pool_free(void *ptr) {
+	pinned_buffer *buf;
+	pinned_pool *pool;
+
+	if (ptr == NULL)
+		return;
+
+	buf = find_buffer(ptr);
+	if (buf == NULL) {
+		fprintf(stderr, "pool_free: %p is not a pool buffer\n", ptr);
+		return;
+	}
+
+	pool = buf->pool;
+	pthread_mutex_lock(&pool->lock);
+	list_add(&buf->node, &pool->idle[buf->cls]);
+	pool->in_use--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Unpins the idle buffers. The context goes too unless buffers are still
+ * held, e.g. by responses that never made it out.
+ */
+void free_pinned_pool(pinned_pool *pool) {
+	int cls;
+
+	pthread_mutex_lock(&pool->lock);
+	for (cls = 0; cls < POOL_CLASSES; cls++) {
+		while (!list_empty(&pool->idle[cls]))
+			destroy_buffer(list_first_entry(&pool->idle[cls], pinned_buffer, node));
+	}
+	if (pool->ctx != NULL && pool->in_use == 0) {
+		cuCtxDestroy(pool->ctx);
+		pool->ctx = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,56 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <cuda.h>
+
+#include "list.h"
+
+/*
+ * Page-locked host buffers for memcpy payloads, one pool per device shared
+ * by all the sessions on it. The driver copies to and from pinned memory
+ * with DMA directly, where pageable memory is bounced through its own
+ * pinned buffers. The network thread receives host-to-device payloads into
+ * pool buffers and the executor reads device-to-host results into them;
+ * either thread may return a buffer. Pools are the server's: the request
+ * (or response) that took a buffer records it and gives it back.
+ *
+ * Buffers come in power of two size classes from POOL_MIN_BUFFER to
+ * POOL_MAX_BUFFER and are kept once allocated. GPUSOCK_PINNED_POOL_MB
+ * bounds the pinned memory of a pool (0 turns pools off); when a request
+ * does not fit, idle buffers of other classes are given back first, and
+ * failing that the caller falls back to pageable memory.
+ * GPUSOCK_PINNED_HUGEPAGES=1 backs buffers of a huge page or more with
+ * huge pages, pinned with cuMemHostRegister().
+ *
+ * Like the staging slots, buffers belong to a context of the pool's own.
+ */
+#define POOL_MIN_BUFFER (64 * 1024)
+#define POOL_CLASSES 11
+#define POOL_MAX_BUFFER ((size_t) POOL_MIN_BUFFER << (POOL_CLASSES - 1))
+#define POOL_DEFAULT_MB 256
+
+typedef struct pinned_pool_s {
+	pthread_mutex_t lock;
+	CUdevice device;
+	CUcontext ctx;
+	size_t budget;		// bytes that may be pinned
+	size_t pinned;		// bytes pinned now, idle or not
+	int in_use;
+	int hugepages;
+	int failed;
+	struct list_head idle[POOL_CLASSES];
+} pinned_pool;
+
+void init_pinned_pool(pinned_pool *pool, CUdevice device);
+
+void free_pinned_pool(pinned_pool *pool);
+
+void *pool_alloc(pinned_pool *pool, size_t size);
+
+int is_pinned_buffer(const void *ptr);
+
+void pool_free(void *ptr);
+
+#endif /* POOL_H */
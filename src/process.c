@@ -12,6 +12,7 @@
 #include "common.pb-c.h"
 #include "cuda.h"
 #include "list.h"
+#include "trace.h"
 
 // cuGetErrorName() doesn't exist for CUDA < 6.0 ...
 #if defined(CUDA_VERSION) && CUDA_VERSION < 6000
@@ -31,9 +32,6 @@ CUresult cuGetErrorName(CUresult error, const char** pStr) {
 }
 #endif
 
-#define cuda_err_print(res, ef) \
-	cuda_error_print(res, ef, __FILE__, __LINE__)
-
 inline CUresult cuda_error_print(CUresult result, int exit_flag, const char *file, const int line) {
 	const char *cuda_err_str = NULL;
 	
@@ -270,11 +268,25 @@ int get_client_handle(void **client_handle, void **client_list, int client_id) {
 	return 0;
 }
 
+// Frees a param list, head included
+static void free_param_list(param_node *list) {
+	param_node *pos, *tmp;
+
+	if (list == NULL)
+		return;
+
+	list_for_each_entry_safe(pos, tmp, &list->node, node)
+		del_param_of_list(pos);
+	free(list);
+}
+
 int del_client_of_list(void *client_handle) {
 	client_node *client = client_handle;
 	
 	gdprintf("Deleting client <%d> from list\n", client->id);
 	list_del(&client->node);
+	free_param_list(client->cuda_dev_node);
+	free_param_list(client->cuda_context);
 	free(client_handle);
 
 	return 0;
@@ -432,6 +444,50 @@ int free_device_from_client(uintptr_t dev_ptr, cuda_device_node *free_list, cuda
 	return -1;
 }
 
+/*
+ * Releases a client that went away without destroying its contexts: they
+ * are destroyed, their devices go back to the free list and the client is
+ * deleted from the list.
+ */
+void release_client(void *client_handle, void *free_list, void *busy_list) {
+	client_node *client = client_handle;
+	param_node *pos, *tmp;
+	CUcontext *cuda_context;
+
+	if (client == NULL)
+		return;
+
+	gdprintf("Releasing client <%d>...\n", client->id);
+	if (client->cuda_context != NULL) {
+		list_for_each_entry_safe(pos, tmp, &client->cuda_context->node, node) {
+			cuda_context = (CUcontext *) pos->ptr;
+			cuda_err_print(cuCtxDestroy(*cuda_context), 0);
+			// The device of the context is the one assigned to the client
+			free_device_from_client((uintptr_t) pos->rel, free_list, busy_list, client);
+			del_param_of_list(pos);
+			free(cuda_context);
+		}
+	}
+
+	del_client_of_list(client);
+}
+
+// Makes the context of the client current on the calling thread, since
+// many clients share the server threads.
+int set_client_context(void *client_handle) {
+	client_node *client = client_handle;
+	param_node *ctx;
+
+	if (client == NULL || client->cuda_context == NULL)
+		return CUDA_SUCCESS;
+
+	ctx = list_first_entry_or_null(&client->cuda_context->node, param_node, node);
+	if (ctx == NULL)
+		return CUDA_SUCCESS;
+
+	return cuda_err_print(cuCtxSetCurrent(*(CUcontext *) ctx->ptr), 0);
+}
+
 int get_device_count_for_client(uint64_t *host_count) {
 	CUresult res;
 	int count;
@@ -501,6 +557,7 @@ int destroy_context_of_client(uintptr_t *dev_ptr, uintptr_t ctx_ptr, client_node
 		} else {
 			*dev_ptr = (uintptr_t) param->rel;
 			del_param_of_list(param);
+			free(cuda_context);
 		}
 	}
 
@@ -579,20 +636,54 @@ int memcpy_host_to_dev_for_client(uintptr_t dev_mem_ptr, void *host_mem_ptr, siz
 	return res;
 }
 
+/*
+ * Checks that length bytes from dev_ptr lie within one device allocation.
+ * The length of a cuMemcpyDtoH is only the client's word, and a result
+ * buffer of that size is allocated before the copy.
+ */
+int check_dev_range(CUdeviceptr dev_ptr, size_t length) {
+	CUdeviceptr base;
+	size_t size;
+
+	if (cuMemGetAddressRange(&base, &size, dev_ptr) != CUDA_SUCCESS ||
+			length > size - (dev_ptr - base)) {
+		fprintf(stderr, "Copy of %zuB from @0x%llx is out of bounds\n", length, dev_ptr);
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
 int memcpy_dev_to_host_for_client(void **host_mem_ptr, size_t *host_mem_size, uintptr_t dev_mem_ptr, size_t mem_size) {
 	CUresult res;
 	CUdeviceptr cuda_dev_ptr = (CUdeviceptr) dev_mem_ptr;
 
 	gdprintf("Memcpying %zuB from CUDA device @0x%llx to host...\n", mem_size, cuda_dev_ptr);
 
+	res = check_dev_range(cuda_dev_ptr, mem_size);
+	if (res != CUDA_SUCCESS)
+		return res;
+	*host_mem_ptr = malloc(mem_size);
+	if (*host_mem_ptr == NULL && mem_size > 0)
+		return CUDA_ERROR_OUT_OF_MEMORY;
 	*host_mem_size = mem_size;
-	*host_mem_ptr = malloc_safe(mem_size);
 
 	res = cuda_err_print(cuMemcpyDtoH(*host_mem_ptr, cuda_dev_ptr, mem_size), 0);
 
 	return res;
 }
 
+int memcpy_dev_to_shared_host(void *host_mem_ptr, uintptr_t dev_mem_ptr, size_t mem_size) {
+	CUresult res;
+	CUdeviceptr cuda_dev_ptr = (CUdeviceptr) dev_mem_ptr;
+
+	gdprintf("Memcpying %zuB from CUDA device @0x%llx to shared memory...\n", mem_size, cuda_dev_ptr);
+
+	res = cuda_err_print(cuMemcpyDtoH(host_mem_ptr, cuda_dev_ptr, mem_size), 0);
+
+	return res;
+}
+
 int launch_kernel_of_client(uint64_t *uints, size_t n_uints, ProtobufCBinaryData *extras, size_t n_extras) {
 	CUresult res;
 	unsigned int grid_x = uints[0], grid_y = uints[1], grid_z = uints[2],
@@ -645,7 +736,8 @@ int process_cuda_cmd(void **result, void *cmd_ptr, void *free_list, void *busy_l
 	void *extra_args = NULL, *res_data = NULL;
 	size_t extra_args_size = 0, res_length = 0;
 	var **res = NULL;
-	var_type res_type;
+	var_type res_type = BYTES;
+	trace_stamp start;
 
 	if (*client_handle == NULL && cmd->type != INIT) {
 		fprintf(stderr, "process_cuda_cmd: Invalid client handle\n");
@@ -653,6 +745,7 @@ int process_cuda_cmd(void **result, void *cmd_ptr, void *free_list, void *busy_l
 	}
 
 	gdprintf("Processing CUDA_CMD\n");
+	start = trace_begin();
 	switch(cmd->type) {
 		case INIT:
 			gdprintf("Executing cuInit...\n");
@@ -730,13 +823,22 @@ int process_cuda_cmd(void **result, void *cmd_ptr, void *free_list, void *busy_l
 			break;
 		case MEMCPY_DEV_TO_HOST:
 			gdprintf("Executing cuMemcpyDtoH...\n");
-			cuda_result = memcpy_dev_to_host_for_client(&extra_args, &extra_args_size, cmd->uint_args[0], cmd->uint_args[1]);
+			if (cmd->n_extra_args > 0)
+				// The client gave a destination in shared memory
+				cuda_result = memcpy_dev_to_shared_host(cmd->extra_args[0].data, cmd->uint_args[0], cmd->extra_args[0].len);
+			else
+				cuda_result = memcpy_dev_to_host_for_client(&extra_args, &extra_args_size, cmd->uint_args[0], cmd->uint_args[1]);
 			break;
 		case LAUNCH_KERNEL:
 			gdprintf("Executing cuLaunchKernel...\n");
 			cuda_result = launch_kernel_of_client(cmd->uint_args, cmd->n_uint_args, cmd->extra_args, cmd->n_extra_args);
 			break;
+		case CONTEXT_SYNCHRONIZE:
+			gdprintf("Executing cuCtxSynchronize...\n");
+			cuda_result = cuda_err_print(cuCtxSynchronize(), 0);
+			break;
 	}
+	trace_end(TRACE_CUDA_CALL, cmd->type, start);
 
 	if (res_type == UINT) {
 		res_length = sizeof(uint64_t);
@@ -754,8 +856,14 @@ int process_cuda_cmd(void **result, void *cmd_ptr, void *free_list, void *busy_l
 		res[1]->type = res_type;
 		res[1]->elements = 1;
 		res[1]->length = res_length;
-		res[1]->data = malloc_safe(res_length);
-		memcpy(res[1]->data, res_data, res_length);
+		if (res_data == extra_args) {
+			// Hand the read back buffer over rather than copy it
+			res[1]->data = extra_args;
+			extra_args = NULL;
+		} else {
+			res[1]->data = malloc_safe(res_length);
+			memcpy(res[1]->data, res_data, res_length);
+		}
 		arg_count = 2;
 	} else {
 		res = malloc_safe(sizeof(*res));
@@ -776,6 +884,20 @@ int process_cuda_cmd(void **result, void *cmd_ptr, void *free_list, void *busy_l
 	return arg_count;
 }
 
+void free_cuda_cmd_result(void *result, int arg_count) {
+	var **res = result;
+	int i;
+
+	if (res == NULL)
+		return;
+
+	for (i = 0; i < arg_count; i++) {
+		free(res[i]->data);
+		free(res[i]);
+	}
+	free(res);
+}
+
 int process_cuda_device_query(void **result, void *free_list, void *busy_list) {
 	CudaDeviceList *cuda_devs;
 	CudaDevice **cuda_devs_dev;
@@ -810,8 +932,7 @@ int process_cuda_device_query(void **result, void *free_list, void *busy_list) {
 	}
 	cuda_devs->devices_free = i;
 	
-	// busy
-	i = 0;
+	// busy, after the free ones
 	list_for_each_entry(pos, &busy_list_p->node, node){
 		gdprintf("%d -> %s\n", i, pos->cuda_device_name);
 		cuda_devs_dev[i] = malloc_safe(sizeof(CudaDevice));
@@ -828,43 +949,16 @@ int process_cuda_device_query(void **result, void *free_list, void *busy_list) {
 	return 0;
 }
 
-int pack_cuda_cmd(void **payload, var **args, size_t arg_count, int type) {
-	CudaCmd *cmd;
-	int i;
+// The names belong to the device lists
+void free_cuda_device_list(void *result) {
+	CudaDeviceList *cuda_devs = result;
+	size_t i;
 
-	gdprintf("Packing CUDA cmd...\n");
-
-	cmd = malloc_safe(sizeof(CudaCmd));
-	cuda_cmd__init(cmd);
-
-	cmd->type = type;
-	cmd->arg_count = arg_count;
-
-	for (i = 0; i < arg_count; i++) {	
-		switch (args[i]->type) {
-			case INT:
-				cmd->n_int_args = args[i]->elements;
-				cmd->int_args = args[i]->data;
-				break;
-			case UINT:
-				cmd->n_uint_args = args[i]->elements;
-				cmd->uint_args = args[i]->data;
-				break;
-			case STRING:
-				cmd->n_str_args = args[i]->elements;
-				cmd->str_args = args[i]->data;
-				break;
-			case BYTES:
-				//cmd->n_extra_args = args[i]->elements;
-				cmd->n_extra_args = 1;
-				cmd->extra_args = malloc_safe(sizeof(*(cmd->extra_args)) * cmd->n_extra_args);
-				cmd->extra_args[0].data = args[i]->data;
-				cmd->extra_args[0].len = args[i]->length;
-				break;
-		}
-	}
+	if (cuda_devs == NULL)
+		return;
 
-	*payload = cmd;
-	return 0;
+	for (i = 0; i < cuda_devs->n_device; i++)
+		free(cuda_devs->device[i]);
+	free(cuda_devs->device);
+	free(cuda_devs);
 }
-
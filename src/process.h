@@ -30,6 +30,11 @@ typedef struct client_node_s {
 } client_node;
 
 
+#define cuda_err_print(res, ef) \
+	cuda_error_print(res, ef, __FILE__, __LINE__)
+
+CUresult cuda_error_print(CUresult result, int exit_flag, const char *file, const int line);
+
 size_t read_cuda_module_file(void **buffer, const char *filename);
 
 int discover_cuda_devices(void **free_list, void **busy_list);
@@ -40,18 +45,26 @@ void print_clients(void *client_list);
 
 unsigned int get_client_status(void *client_handle);
 
+void release_client(void *client_handle, void *free_list, void *busy_list);
+
+int set_client_context(void *client_handle);
+
 uint32_t add_param_to_list(param_node **list, uint64_t uintptr, void *relation);
 
 int find_param_by_id(param_node **param, param_node *list, uint32_t param_id);
 
 int del_param_of_list(param_node *param);
 
+int check_dev_range(CUdeviceptr dev_ptr, size_t length);
+
 int process_cuda_cmd(void **result, void *cmd_ptr, void *free_list, void *busy_list, void **client_list, void **client_handle);
 
+void free_cuda_cmd_result(void *result, int arg_count);
+
 int process_cuda_device_query(void **result, void *free_list, void *busy_list);
 
-void free_cdn_list(void *list);
+void free_cuda_device_list(void *result);
 
-int pack_cuda_cmd(void **payload, var **args, size_t arg_count, int type); 
+void free_cdn_list(void *list);
 
 #endif /* PROCESS_H */
@@ -1,11 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include "protocol.h"
 #include "common.h"
 #include "common.pb-c.h"
+#include "arena.h"
+#include "trace.h"
+
+// Decoded fast path frames are exposed through this view, so that callers
+// can keep treating every payload as a CudaCmd. The view is taken from the
+// request arena; without one it is only valid until the next
+// decode_message() call on the same thread. Args that are not 8-byte
+// aligned in the frame are copied after it.
+typedef struct fast_frame_view_s {
+	Cookie cookie;
+	CudaCmd cmd;
+	ProtobufCBinaryData extra;
+} fast_frame_view;
+
+static __thread fast_frame_view fast_view;
+static __thread uint64_t fast_view_args[2 * FRAME_MAX_ARGS];
+
+io_stats gs_io_stats;
 
 #if 0
 ssize_t read_socket_msg(int fd, void *buffer, size_t bytes) {
@@ -35,14 +56,23 @@ ssize_t read_socket_msg(int fd, void *buffer, size_t bytes) {
 }
 #endif
 
+// Reads exactly bytes from a blocking socket; returns -1 if the socket
+// failed or was closed before
 ssize_t read_socket(int fd, void *buffer, size_t bytes) {
 	ssize_t	b_read, b_total = 0;
 
 	do {
 		b_read = read(fd, buffer+b_total, bytes-b_total);
+		__atomic_fetch_add(&gs_io_stats.rx_syscalls, 1, __ATOMIC_RELAXED);
+		if (b_read < 0 && errno == EINTR)
+			continue;
 		if (b_read < 0) {
 			perror("read socket failed");
-			exit(EXIT_FAILURE);
+			return -1;
+		}
+		if (b_read == 0) {
+			fprintf(stderr, "read socket failed: connection closed\n");
+			return -1;
 		}
 		b_total += b_read;
 	} while (b_total < bytes);
@@ -51,15 +81,20 @@ ssize_t read_socket(int fd, void *buffer, size_t bytes) {
 	return b_total;
 }
 
+// Writes all bytes to a blocking socket; returns -1 if it failed. A peer
+// that went away is reported as EPIPE rather than with SIGPIPE.
 ssize_t write_socket(int fd, void *buffer, size_t bytes) {
 	ssize_t b_written, b_total;
 
 	b_total = 0;
 	do {
-		b_written = write(fd, buffer+b_total, bytes-b_total);
+		b_written = send(fd, buffer+b_total, bytes-b_total, MSG_NOSIGNAL);
+		__atomic_fetch_add(&gs_io_stats.tx_syscalls, 1, __ATOMIC_RELAXED);
+		if (b_written < 0 && errno == EINTR)
+			continue;
 		if (b_written < 0) {
 			perror("write socket failed");
-			exit(EXIT_FAILURE);
+			return -1;
 		}
 		b_total += b_written;
 	} while (b_total < bytes);
@@ -68,39 +103,469 @@ ssize_t write_socket(int fd, void *buffer, size_t bytes) {
 	return b_total;
 }
 
-void send_message(int sock_fd, void *buffer, size_t buf_size) {
+int send_message(int sock_fd, void *buffer, size_t buf_size) {
+	trace_stamp start = trace_begin();
+
 	gdprintf("Going to send %zu bytes...\n", buf_size);
-	write_socket(sock_fd, buffer, buf_size);
+	if (write_socket(sock_fd, buffer, buf_size) < 0)
+		return -1;
+	trace_end(TRACE_SEND, buf_size, start);
+
+	return 0;
+}
+
+// Sends a message along with a descriptor, over a Unix domain socket
+int send_message_with_fd(int sock_fd, void *buffer, size_t buf_size, int fd) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t b_written;
+
+	gdprintf("Going to send %zu bytes and fd %d...\n", buf_size, fd);
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = buffer;
+	iov.iov_len = buf_size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		b_written = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+		__atomic_fetch_add(&gs_io_stats.tx_syscalls, 1, __ATOMIC_RELAXED);
+	} while (b_written < 0 && errno == EINTR);
+	if (b_written < 0) {
+		perror("sendmsg failed");
+		return -1;
+	}
+
+	// The descriptor went with the first byte
+	if ((size_t) b_written < buf_size &&
+			write_socket(sock_fd, buffer + b_written, buf_size - b_written) < 0)
+		return -1;
+
+	return 0;
 }
 
 uint32_t receive_message(void **enc_msg, int sock_fd) {
 	void *buffer;
 	uint32_t msg_length;
-	int ret = 0;
+	trace_stamp start = trace_begin();
 
-	buffer = malloc_safe(sizeof(uint32_t));
-	
+	*enc_msg = NULL;
 	// read message length
-	read_socket(sock_fd, buffer, sizeof(uint32_t));
+	if (read_socket(sock_fd, &msg_length, sizeof(msg_length)) < 0)
+		return 0;
 
-	msg_length = ntohl(*(uint32_t *)buffer);
+	msg_length = ntohl(msg_length);
 	gdprintf("Going to read a message of %u bytes...\n", msg_length);
-	
-	buffer = realloc(buffer, msg_length);
-	
+
+	buffer = malloc_safe(msg_length);
+
 	// read message
-	read_socket(sock_fd, buffer, msg_length);
-	
+	if (read_socket(sock_fd, buffer, msg_length) < 0) {
+		free(buffer);
+		return 0;
+	}
+
 	*enc_msg = buffer;
+	trace_end(TRACE_RECEIVE, msg_length, start);
+
+	return msg_length;
+}
+
+void init_msg_buffer(msg_buffer *buf) {
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+void *reserve_msg_buffer(msg_buffer *buf, size_t size) {
+	if (size > buf->size) {
+		// no need to preserve the old contents
+		free(buf->data);
+		buf->data = malloc_safe(size);
+		buf->size = size;
+	}
+
+	return buf->data;
+}
+
+void trim_msg_buffer(msg_buffer *buf) {
+	if (buf->size > MSG_BUFFER_KEEP_MAX)
+		free_msg_buffer(buf);
+}
+
+void free_msg_buffer(msg_buffer *buf) {
+	free(buf->data);
+	init_msg_buffer(buf);
+}
+
+uint32_t receive_message_into(msg_buffer *buf, int sock_fd) {
+	uint32_t msg_length;
+	trace_stamp start = trace_begin();
+
+	// read message length
+	if (read_socket(sock_fd, &msg_length, sizeof(msg_length)) < 0)
+		return 0;
+
+	msg_length = ntohl(msg_length);
+	gdprintf("Going to read a message of %u bytes...\n", msg_length);
+
+	// read message
+	reserve_msg_buffer(buf, msg_length);
+	if (read_socket(sock_fd, buf->data, msg_length) < 0)
+		return 0;
+	trace_end(TRACE_RECEIVE, msg_length, start);
 
 	return msg_length;
 }
 
-int decode_message(void **result, void **payload, void *enc_msg, uint32_t enc_msg_length) {
+void init_reader(conn_reader *reader, int sock_fd) {
+	reader->sock_fd = sock_fd;
+	init_msg_buffer(&reader->buf);
+	reader->head = 0;
+	reader->tail = 0;
+	reader->pending = 0;
+	reader->passed_fd = -1;
+	reader->recv_calls = 0;
+	reader->messages = 0;
+}
+
+void free_reader(conn_reader *reader) {
+	free_msg_buffer(&reader->buf);
+	reader->head = reader->tail = reader->pending = 0;
+	if (reader->passed_fd >= 0) {
+		close(reader->passed_fd);
+		reader->passed_fd = -1;
+	}
+}
+
+// Hands the last received descriptor over to the caller, -1 if none
+int reader_take_fd(conn_reader *reader) {
+	int fd = reader->passed_fd;
+
+	reader->passed_fd = -1;
+
+	return fd;
+}
+
+// Keeps a descriptor the peer passed along with its data
+static void reader_keep_fd(conn_reader *reader, struct msghdr *msg) {
+	struct cmsghdr *cmsg;
+	int fd;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+				cmsg->cmsg_len < CMSG_LEN(sizeof(int)))
+			continue;
+
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		gdprintf("Received fd %d\n", fd);
+		if (reader->passed_fd >= 0)
+			close(reader->passed_fd);
+		reader->passed_fd = fd;
+	}
+}
+
+// Makes room for a message of msg_size bytes starting at head
+static void reader_make_room(conn_reader *reader, size_t msg_size) {
+	size_t buffered = reader->tail - reader->head, new_size;
+	void *data;
+
+	if (reader->buf.size >= msg_size) {
+		if (reader->head + msg_size > reader->buf.size) {
+			memmove(reader->buf.data, reader->buf.data + reader->head, buffered);
+			reader->head = 0;
+			reader->tail = buffered;
+		}
+		return;
+	}
+
+	new_size = (msg_size > READER_BUFFER_SIZE) ? msg_size : READER_BUFFER_SIZE;
+	gdprintf("Growing reader buffer to %zu bytes\n", new_size);
+	data = malloc_safe(new_size);
+	if (buffered > 0)
+		memcpy(data, reader->buf.data + reader->head, buffered);
+	free(reader->buf.data);
+	reader->buf.data = data;
+	reader->buf.size = new_size;
+	reader->head = 0;
+	reader->tail = buffered;
+}
+
+// Returns bytes received, 0 if it would block and -1 on EOF or error
+static ssize_t reader_fill(conn_reader *reader, int flags) {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t b_read;
+
+	// Detached readers only get what is appended to them
+	if (reader->sock_fd < 0)
+		return 0;
+
+	// recvmsg() rather than recv(), as Unix domain peers may pass a
+	// descriptor along
+	do {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = reader->buf.data + reader->tail;
+		iov.iov_len = reader->buf.size - reader->tail;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		b_read = recvmsg(reader->sock_fd, &msg, flags | MSG_CMSG_CLOEXEC);
+		reader->recv_calls++;
+		__atomic_fetch_add(&gs_io_stats.rx_syscalls, 1, __ATOMIC_RELAXED);
+	} while (b_read < 0 && errno == EINTR);
+
+	if (b_read < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		perror("read socket failed");
+		return -1;
+	} else if (b_read == 0) {
+		gdprintf("Connection closed by peer\n");
+		return -1;
+	}
+
+	if (msg.msg_controllen > 0)
+		reader_keep_fd(reader, &msg);
+
+	reader->tail += b_read;
+	return b_read;
+}
+
+/*
+ * Adds data received by other means, e.g. through io_uring, to a detached
+ * reader (one initialized with sock_fd -1). This releases the message
+ * handed out last, and may move the buffered data.
+ */
+void reader_append(conn_reader *reader, const void *data, size_t length) {
+	reader->head += reader->pending;
+	reader->pending = 0;
+	if (reader->buf.data == NULL)
+		reserve_msg_buffer(&reader->buf, READER_BUFFER_SIZE);
+
+	reader_make_room(reader, reader->tail - reader->head + length);
+	memcpy(reader->buf.data + reader->tail, data, length);
+	reader->tail += length;
+}
+
+/*
+ * Hands out the next complete message of the connection. The message stays
+ * valid until the next call. Returns 1 on success, 0 when MSG_DONTWAIT is
+ * given and no complete message is buffered yet, and -1 when the peer
+ * closed the connection or it failed.
+ */
+int reader_next_message(conn_reader *reader, void **enc_msg, uint32_t *msg_length, int flags) {
+	uint32_t len_n, len;
+	size_t buffered;
+	ssize_t ret;
+	trace_stamp start = trace_begin();
+
+	// release the previous message
+	reader->head += reader->pending;
+	reader->pending = 0;
+	if (reader->head == reader->tail) {
+		reader->head = reader->tail = 0;
+		if (reader->buf.size > MSG_BUFFER_KEEP_MAX)
+			free_msg_buffer(&reader->buf);
+	}
+	if (reader->buf.data == NULL)
+		reserve_msg_buffer(&reader->buf, READER_BUFFER_SIZE);
+
+	for (;;) {
+		buffered = reader->tail - reader->head;
+		if (buffered >= sizeof(len_n)) {
+			memcpy(&len_n, reader->buf.data + reader->head, sizeof(len_n));
+			len = ntohl(len_n);
+			if (buffered >= sizeof(len_n) + len) {
+				*enc_msg = reader->buf.data + reader->head + sizeof(len_n);
+				*msg_length = len;
+				reader->pending = sizeof(len_n) + len;
+				reader->messages++;
+				gdprintf("Got a message of %u bytes\n", len);
+				// includes waiting for the message, unless MSG_DONTWAIT
+				trace_end(TRACE_RECEIVE, len, start);
+				return 1;
+			}
+			reader_make_room(reader, sizeof(len_n) + len);
+		} else {
+			reader_make_room(reader, READER_BUFFER_SIZE);
+		}
+
+		ret = reader_fill(reader, flags);
+		if (ret <= 0)
+			return ret;
+	}
+}
+
+/*
+ * Reads the out-of-band payload that follows the current message. Bytes
+ * already buffered are copied out, the rest is received straight into
+ * data. Returns the bytes delivered, which is less than length only with
+ * MSG_DONTWAIT, or -1 on EOF or error.
+ */
+ssize_t reader_read_bulk(conn_reader *reader, void *data, size_t length, int flags) {
+	size_t offset, buffered, start = reader->head + reader->pending;
+	ssize_t b_read;
+
+	buffered = reader->tail - start;
+	offset = (buffered < length) ? buffered : length;
+	if (offset > 0) {
+		memcpy(data, reader->buf.data + start, offset);
+		memmove(reader->buf.data + start, reader->buf.data + start + offset, buffered - offset);
+		reader->tail -= offset;
+	}
+
+	while (offset < length && reader->sock_fd >= 0) {
+		b_read = recv(reader->sock_fd, data + offset, length - offset, flags);
+		reader->recv_calls++;
+		__atomic_fetch_add(&gs_io_stats.rx_syscalls, 1, __ATOMIC_RELAXED);
+		if (b_read < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("read socket failed");
+			return -1;
+		} else if (b_read == 0) {
+			return -1;
+		}
+		offset += b_read;
+	}
+
+	return offset;
+}
+
+int is_fast_cmd(int cmd_type) {
+	if (!FAST_PATH_SUPPORTED)
+		return 0;
+
+	switch (cmd_type) {
+		case MEMORY_ALLOCATE:
+		case MEMORY_FREE:
+		case MEMCPY_HOST_TO_DEV:
+		case MEMCPY_DEV_TO_HOST:
+		case LAUNCH_KERNEL:
+		case CUDA_CMD_BATCH:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+int is_fast_frame(void *enc_msg, uint32_t msg_length) {
+	uint8_t *bytes = enc_msg;
+
+	return (FAST_PATH_SUPPORTED && msg_length >= sizeof(frame_hdr) &&
+			bytes[0] == FRAME_MAGIC_0 && bytes[1] == FRAME_MAGIC_1);
+}
+
+// Minimum number of uint args each fast path command carries
+static int fast_cmd_min_uints(int cmd_type) {
+	switch (cmd_type) {
+		case MEMCPY_DEV_TO_HOST:
+			return 2;
+		case LAUNCH_KERNEL:
+			return 9;
+		default:
+			return 1;
+	}
+}
+
+static int decode_fast_frame(void **result, void **payload, void *enc_msg, uint32_t enc_msg_length, msg_arena *arena) {
+	frame_hdr *hdr = enc_msg;
+	fast_frame_view *view;
+	uint8_t *args = (uint8_t *) (hdr + 1);
+	uint64_t *aligned_args, *arg_words;
+	size_t args_size, inline_len;
+
+	gdprintf("Decoding fast path frame...\n");
+	if (hdr->version != FRAME_VERSION) {
+		fprintf(stderr, "unsupported frame version %u\n", hdr->version);
+		return -1;
+	}
+
+	args_size = sizeof(uint64_t) * (hdr->n_int_args + hdr->n_uint_args);
+	if (hdr->flags & (FRAME_F_BULK | FRAME_F_STRIPED))
+		inline_len = 0;
+	else if (hdr->flags & FRAME_F_SHM)
+		inline_len = sizeof(uint64_t);	// the offset
+	else
+		inline_len = hdr->bytes_len;
+	if (sizeof(*hdr) + args_size + inline_len != enc_msg_length ||
+			(hdr->msg_type == CUDA_CMD &&
+			 hdr->n_uint_args < fast_cmd_min_uints(hdr->cmd_type))) {
+		fprintf(stderr, "malformed frame for command %u\n", hdr->cmd_type);
+		return -1;
+	}
+
+	if (arena != NULL) {
+		view = arena_alloc(arena, sizeof(*view) + (((uintptr_t) args % sizeof(uint64_t)) ? args_size : 0));
+		aligned_args = (uint64_t *) (view + 1);
+	} else {
+		view = &fast_view;
+		aligned_args = fast_view_args;
+	}
+	cookie__init(&view->cookie);
+	cuda_cmd__init(&view->cmd);
+	view->cookie.type = hdr->msg_type;
+	view->cookie.has_req_id = 1;
+	view->cookie.req_id = hdr->req_id;
+	view->cookie.cuda_cmd = &view->cmd;
+
+	// The frame may sit at any offset of the receive buffer
+	if ((uintptr_t) args % sizeof(uint64_t)) {
+		memcpy(aligned_args, args, args_size);
+		arg_words = aligned_args;
+	} else {
+		arg_words = (uint64_t *) args;
+	}
+
+	view->cmd.type = hdr->cmd_type;
+	view->cmd.n_int_args = hdr->n_int_args;
+	view->cmd.int_args = (int64_t *) arg_words;
+	view->cmd.n_uint_args = hdr->n_uint_args;
+	view->cmd.uint_args = arg_words + hdr->n_int_args;
+	view->cmd.arg_count = hdr->n_int_args + hdr->n_uint_args;
+	if (hdr->bytes_len > 0) {
+		// Bulk, shared memory and striped payloads are filled in by the
+		// caller
+		view->extra.len = hdr->bytes_len;
+		view->extra.data = (hdr->flags & (FRAME_F_BULK | FRAME_F_SHM | FRAME_F_STRIPED)) ? NULL : args + args_size;
+		view->cmd.n_extra_args = 1;
+		view->cmd.extra_args = &view->extra;
+		view->cmd.arg_count++;
+	}
+
+	*result = &view->cookie;
+	*payload = &view->cmd;
+
+	return hdr->msg_type;
+}
+
+static int decode_protobuf(void **result, void **payload, void *enc_msg, uint32_t enc_msg_length, msg_arena *arena) {
 	Cookie *msg;
 
 	gdprintf("Decoding message data...\n");
-	msg = cookie__unpack(NULL, enc_msg_length, (uint8_t *)enc_msg);
+	msg = cookie__unpack((arena != NULL) ? &arena->allocator : NULL,
+			enc_msg_length, (uint8_t *)enc_msg);
 	if (msg == NULL) {
 		fprintf(stderr, "message unpacking failed\n");
 		return -1;
@@ -133,14 +598,73 @@ int decode_message(void **result, void **payload, void *enc_msg, uint32_t enc_ms
 	return msg->type;
 }
 
-size_t encode_message(void **result, int msg_type, void *payload) {
+int decode_message(void **result, void **payload, void *enc_msg, uint32_t enc_msg_length, msg_arena *arena) {
+	trace_stamp start = trace_begin();
+	int msg_type;
+
+	if (is_fast_frame(enc_msg, enc_msg_length))
+		msg_type = decode_fast_frame(result, payload, enc_msg, enc_msg_length, arena);
+	else
+		msg_type = decode_protobuf(result, payload, enc_msg, enc_msg_length, arena);
+	trace_end(TRACE_DECODE, enc_msg_length, start);
+
+	return msg_type;
+}
+
+// Points a CudaCmd at the arguments; only the BYTES descriptor is allocated
+int pack_cuda_cmd(void **payload, var **args, size_t arg_count, int type) {
+	CudaCmd *cmd;
+	int i;
+
+	gdprintf("Packing CUDA cmd...\n");
+
+	cmd = malloc_safe(sizeof(CudaCmd));
+	cuda_cmd__init(cmd);
+
+	cmd->type = type;
+	cmd->arg_count = arg_count;
+
+	for (i = 0; i < arg_count; i++) {	
+		switch (args[i]->type) {
+			case INT:
+				cmd->n_int_args = args[i]->elements;
+				cmd->int_args = args[i]->data;
+				break;
+			case UINT:
+				cmd->n_uint_args = args[i]->elements;
+				cmd->uint_args = args[i]->data;
+				break;
+			case STRING:
+				cmd->n_str_args = args[i]->elements;
+				cmd->str_args = args[i]->data;
+				break;
+			case BYTES:
+				//cmd->n_extra_args = args[i]->elements;
+				cmd->n_extra_args = 1;
+				cmd->extra_args = malloc_safe(sizeof(*(cmd->extra_args)) * cmd->n_extra_args);
+				cmd->extra_args[0].data = args[i]->data;
+				cmd->extra_args[0].len = args[i]->length;
+				break;
+		}
+	}
+
+	*payload = cmd;
+	return 0;
+}
+
+size_t encode_message(void **result, int msg_type, uint32_t req_id, void *payload) {
 	size_t buf_size;
 	uint32_t msg_length, msg_len_n;
 	Cookie message = COOKIE__INIT;
-	void *buffer, *msg_buffer; 
+	void *buffer;
+	trace_stamp start = trace_begin();
 
 	gdprintf("Encoding message data...\n");
 	message.type = msg_type;
+	if (req_id != 0) {
+		message.has_req_id = 1;
+		message.req_id = req_id;
+	}
 
 	switch (msg_type) {
 		case CUDA_CMD:
@@ -154,24 +678,272 @@ size_t encode_message(void **result, int msg_type, void *payload) {
 			break;
 	}
 
+	// Pack the message right after the length prefix, so that the body
+	// is copied only once.
 	msg_length = cookie__get_packed_size(&message);
-	msg_buffer = malloc_safe(msg_length);
-	cookie__pack(&message, msg_buffer);
 	msg_len_n = htonl(msg_length);
 
 	buf_size = msg_length + sizeof(msg_len_n);
 	buffer = malloc_safe(buf_size);
 	memcpy(buffer, &msg_len_n, sizeof(msg_len_n));
-	memcpy(buffer+sizeof(msg_len_n), msg_buffer, msg_length);
+	cookie__pack(&message, buffer + sizeof(msg_len_n));
+
+	*result = buffer;
+	trace_end(TRACE_ENCODE, buf_size, start);
+
+	return buf_size;
+}
+
+// Copies var elements to the frame as 64-bit integers, since var users
+// store INT args as plain ints.
+static void put_frame_args(uint8_t *dst, var *arg) {
+	size_t i, width;
+	int64_t val;
+
+	if (arg->elements == 0)
+		return;
+
+	width = arg->length / arg->elements;
+	for (i = 0; i < arg->elements; i++) {
+		if (width == sizeof(int32_t))
+			val = (arg->type == INT) ? ((int32_t *) arg->data)[i] :
+				(int64_t) ((uint32_t *) arg->data)[i];
+		else
+			val = ((int64_t *) arg->data)[i];
+		memcpy(dst + i * sizeof(val), &val, sizeof(val));
+	}
+}
+
+size_t encode_fast_frame(void **result, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count) {
+	size_t i, n_ints = 0, n_uints = 0, buf_size, inline_len;
+	uint32_t msg_length, msg_len_n;
+	int bulk = 0;
+	var *ints = NULL, *uints = NULL, *bytes = NULL;
+	frame_hdr *hdr;
+	uint8_t *buffer, *pos;
+	trace_stamp start = trace_begin();
+
+	*result = NULL;
+	for (i = 0; i < arg_count; i++) {
+		switch (args[i]->type) {
+			case INT:
+				ints = args[i];
+				n_ints = ints->elements;
+				break;
+			case UINT:
+				uints = args[i];
+				n_uints = uints->elements;
+				break;
+			case BYTES:
+				bytes = args[i];
+				break;
+			default:
+				// strings only travel in protobuf messages
+				return 0;
+		}
+	}
+	if (n_ints > FRAME_MAX_ARGS || n_uints > FRAME_MAX_ARGS)
+		return 0;
+
+	gdprintf("Encoding fast path frame...\n");
+	if (bytes != NULL && bytes->length >= BULK_THRESHOLD) {
+		bulk = 1;
+		inline_len = 0;
+	} else {
+		inline_len = (bytes != NULL) ? bytes->length : 0;
+	}
+	msg_length = sizeof(*hdr) + sizeof(uint64_t) * (n_ints + n_uints) + inline_len;
+	msg_len_n = htonl(msg_length);
+
+	buf_size = msg_length + sizeof(msg_len_n);
+	buffer = malloc_safe(buf_size);
+	memcpy(buffer, &msg_len_n, sizeof(msg_len_n));
+
+	hdr = (frame_hdr *) (buffer + sizeof(msg_len_n));
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic[0] = FRAME_MAGIC_0;
+	hdr->magic[1] = FRAME_MAGIC_1;
+	hdr->version = FRAME_VERSION;
+	hdr->msg_type = msg_type;
+	hdr->cmd_type = cmd_type;
+	hdr->n_int_args = n_ints;
+	hdr->n_uint_args = n_uints;
+	hdr->flags = bulk ? FRAME_F_BULK : 0;
+	hdr->req_id = req_id;
+	hdr->bytes_len = (bytes != NULL) ? bytes->length : 0;
+
+	pos = (uint8_t *) (hdr + 1);
+	if (ints != NULL)
+		put_frame_args(pos, ints);
+	pos += sizeof(uint64_t) * n_ints;
+	if (uints != NULL)
+		put_frame_args(pos, uints);
+	pos += sizeof(uint64_t) * n_uints;
+	if (inline_len > 0)
+		memcpy(pos, bytes->data, inline_len);
 
 	*result = buffer;
+	trace_end(TRACE_ENCODE, buf_size, start);
 
 	return buf_size;
 }
 
-void free_decoded_message(void *msg) {
+int send_fast_frame(int sock_fd, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count) {
+	void *buffer = NULL;
+	size_t i, buf_size;
+	uint64_t bulk_length;
+
+	buf_size = encode_fast_frame(&buffer, msg_type, cmd_type, req_id, args, arg_count);
+	if (buf_size == 0)
+		return -1;
+
+	send_message(sock_fd, buffer, buf_size);
+	bulk_length = get_bulk_length(buffer + sizeof(uint32_t), buf_size - sizeof(uint32_t));
+	free(buffer);
+
+	if (bulk_length > 0) {
+		for (i = 0; i < arg_count; i++) {
+			if (args[i]->type == BYTES)
+				send_bulk_data(sock_fd, args[i]->data, bulk_length);
+		}
+	}
+
+	return 0;
+}
+
+uint64_t get_bulk_length(void *enc_msg, uint32_t msg_length) {
+	frame_hdr *hdr = enc_msg;
+
+	if (!is_fast_frame(enc_msg, msg_length) || !(hdr->flags & FRAME_F_BULK))
+		return 0;
+
+	return hdr->bytes_len;
+}
+
+/*
+ * Sends a command whose payload of shm_length bytes lies at shm_offset of
+ * the region shared with the peer. The args must not include BYTES.
+ */
+int send_shm_frame(int sock_fd, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count, uint64_t shm_offset, uint64_t shm_length) {
+	var desc = { .type = BYTES, .elements = 1, .length = sizeof(shm_offset), .data = &shm_offset };
+	var *frame_args[arg_count + 1];
+	void *buffer = NULL;
+	frame_hdr *hdr;
+	size_t buf_size;
+
+	memcpy(frame_args, args, sizeof(*args) * arg_count);
+	frame_args[arg_count] = &desc;
+
+	// Encoded with the offset as its inline payload, then marked as such
+	buf_size = encode_fast_frame(&buffer, msg_type, cmd_type, req_id, frame_args, arg_count + 1);
+	if (buf_size == 0)
+		return -1;
+	hdr = buffer + sizeof(uint32_t);
+	hdr->flags |= FRAME_F_SHM;
+	hdr->bytes_len = shm_length;
+
+	send_message(sock_fd, buffer, buf_size);
+	free(buffer);
+
+	return 0;
+}
+
+// Returns 1 and the payload range if the frame refers to shared memory
+int get_shm_range(void *enc_msg, uint32_t msg_length, uint64_t *shm_offset, uint64_t *shm_length) {
+	frame_hdr *hdr = enc_msg;
+
+	if (!is_fast_frame(enc_msg, msg_length) || !(hdr->flags & FRAME_F_SHM) ||
+			msg_length < sizeof(*hdr) + sizeof(uint64_t))
+		return 0;
+
+	memcpy(shm_offset, enc_msg + msg_length - sizeof(uint64_t), sizeof(uint64_t));
+	*shm_length = hdr->bytes_len;
+
+	return 1;
+}
+
+/*
+ * Sends a command whose payload of length bytes goes over the data
+ * connections instead; a length of 0 asks the peer to stripe the payload
+ * of the result. The args must not include BYTES.
+ */
+int send_striped_frame(int sock_fd, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count, uint64_t length) {
+	void *buffer = NULL;
+	frame_hdr *hdr;
+	size_t buf_size;
+
+	buf_size = encode_fast_frame(&buffer, msg_type, cmd_type, req_id, args, arg_count);
+	if (buf_size == 0)
+		return -1;
+	hdr = buffer + sizeof(uint32_t);
+	hdr->flags |= FRAME_F_STRIPED;
+	hdr->bytes_len = length;
+
+	send_message(sock_fd, buffer, buf_size);
+	free(buffer);
+
+	return 0;
+}
+
+int is_striped_frame(void *enc_msg, uint32_t msg_length) {
+	frame_hdr *hdr = enc_msg;
+
+	return is_fast_frame(enc_msg, msg_length) && (hdr->flags & FRAME_F_STRIPED);
+}
+
+// Length of the payload that goes over the data connections, if any
+uint64_t get_stripe_length(void *enc_msg, uint32_t msg_length) {
+	frame_hdr *hdr = enc_msg;
+
+	if (!is_striped_frame(enc_msg, msg_length))
+		return 0;
+
+	return hdr->bytes_len;
+}
+
+size_t send_bulk_data(int sock_fd, const void *data, size_t length) {
+	size_t offset, chunk;
+
+	gdprintf("Going to send %zu bytes of bulk data...\n", length);
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = (length - offset < BULK_CHUNK_SIZE) ? length - offset : BULK_CHUNK_SIZE;
+		if (write_socket(sock_fd, (void *) data + offset, chunk) < 0)
+			break;
+	}
+
+	return offset;
+}
+
+size_t receive_bulk_data(int sock_fd, void *data, size_t length) {
+	size_t offset, chunk;
+
+	gdprintf("Going to read %zu bytes of bulk data...\n", length);
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = (length - offset < BULK_CHUNK_SIZE) ? length - offset : BULK_CHUNK_SIZE;
+		if (read_socket(sock_fd, data + offset, chunk) < 0)
+			break;
+	}
+
+	return offset;
+}
+
+void free_decoded_message(void *msg, msg_arena *arena) {
 //	Cookie *message = msg;
 
+	// Arena-backed messages go away with reset_arena()
+	if (msg == NULL || msg == &fast_view.cookie || arena != NULL)
+		return;
+
 	gdprintf("Freeing allocated memory for message...\n");
 	cookie__free_unpacked((Cookie *) msg, NULL);
 }
+
+// Request id of a decoded message, 0 if it carries none
+uint32_t get_req_id(void *msg) {
+	Cookie *message = msg;
+
+	if (message == NULL || !message->has_req_id)
+		return 0;
+
+	return message->req_id;
+}
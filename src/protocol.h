@@ -1,18 +1,162 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stdint.h>
+#include "common.h"
+#include "arena.h"
+
+/*
+ * Fast path frames: the hot commands skip the protobuf Cookie envelope and
+ * are sent as a fixed header, followed by n_int_args int64s, n_uint_args
+ * uint64s and bytes_len bytes of payload, all in host (little-endian) byte
+ * order so that they can be decoded in place. Frames share the 4-byte
+ * length prefix with protobuf messages; a packed Cookie always starts with
+ * the tag of its required `type` field (0x08), so the magic tells them apart.
+ */
+#define FRAME_MAGIC_0 'G'
+#define FRAME_MAGIC_1 'S'
+#define FRAME_VERSION 2
+
+#define FRAME_MAX_ARGS 255
+
+// Frame flags
+#define FRAME_F_BULK 0x1	// payload follows the frame as a raw byte stream
+#define FRAME_F_SHM 0x2		// payload is in shared memory, the frame holds its offset
+#define FRAME_F_STRIPED 0x4	// payload goes over the data connections (see stripe.h)
+
+/*
+ * Payloads of at least BULK_THRESHOLD bytes are not carried inside the
+ * frame. The frame only holds their length and the bytes follow it on the
+ * socket, written and read in BULK_CHUNK_SIZE pieces straight from/to the
+ * user or staging buffer. This also lifts the 4 GB limit of the 32-bit
+ * message length.
+ */
+#define BULK_THRESHOLD (64 * 1024)
+#define BULK_CHUNK_SIZE (1024 * 1024)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FAST_PATH_SUPPORTED 1
+#else
+#define FAST_PATH_SUPPORTED 0
+#endif
+
+typedef struct frame_hdr_s {
+	uint8_t magic[2];
+	uint8_t version;
+	uint8_t msg_type;	// CUDA_CMD or CUDA_CMD_RESULT
+	uint16_t cmd_type;	// MEMORY_ALLOCATE, MEMCPY_HOST_TO_DEV, ...
+	uint8_t n_int_args;
+	uint8_t n_uint_args;
+	uint32_t flags;
+	uint32_t req_id;	// echoed back in the result
+	uint64_t bytes_len;
+} frame_hdr;
+
+/*
+ * Receive buffer that is kept across messages of a connection and only
+ * grows when a bigger message arrives, so steady-state traffic does not
+ * allocate on receive.
+ */
+typedef struct msg_buffer_s {
+	void *data;
+	size_t size;
+} msg_buffer;
+
+// Buffers above this size are released after use instead of being kept
+#define MSG_BUFFER_KEEP_MAX (64 * 1024 * 1024)
+
+/*
+ * Buffered connection reader. It recv()s as much as the socket holds into
+ * its buffer and hands out complete messages from there, so a burst of
+ * small commands costs a single syscall. The buffer is compacted instead
+ * of wrapping around, which keeps every message contiguous for in-place
+ * decoding.
+ */
+#define READER_BUFFER_SIZE (256 * 1024)
+
+typedef struct conn_reader_s {
+	int sock_fd;
+	msg_buffer buf;
+	size_t head;		// start of unconsumed data
+	size_t tail;		// end of received data
+	size_t pending;		// size of the message handed out last
+	int passed_fd;		// last descriptor received with SCM_RIGHTS
+	unsigned long recv_calls;
+	unsigned long messages;
+} conn_reader;
+
+// Socket syscall counters, for benchmarks and diagnostics
+typedef struct io_stats_s {
+	uint64_t rx_syscalls;
+	uint64_t tx_syscalls;
+} io_stats;
+
+extern io_stats gs_io_stats;
+
 ssize_t read_socket(int fd, void *buffer, size_t bytes);
 
 ssize_t write_socket(int fd, void *buffer, size_t bytes);
 
-void send_message(int sock_fd, void *buffer, size_t buf_size);
+int send_message(int sock_fd, void *buffer, size_t buf_size);
+
+int send_message_with_fd(int sock_fd, void *buffer, size_t buf_size, int fd);
 
 uint32_t receive_message(void **enc_msg, int sock_fd);
 
-int decode_message(void **result, void **payload, void *enc_msg, uint32_t msg_length);
+void init_msg_buffer(msg_buffer *buf);
+
+void *reserve_msg_buffer(msg_buffer *buf, size_t size);
+
+void trim_msg_buffer(msg_buffer *buf);
+
+void free_msg_buffer(msg_buffer *buf);
+
+uint32_t receive_message_into(msg_buffer *buf, int sock_fd);
+
+void init_reader(conn_reader *reader, int sock_fd);
+
+void free_reader(conn_reader *reader);
+
+int reader_take_fd(conn_reader *reader);
+
+void reader_append(conn_reader *reader, const void *data, size_t length);
+
+int reader_next_message(conn_reader *reader, void **enc_msg, uint32_t *msg_length, int flags);
+
+ssize_t reader_read_bulk(conn_reader *reader, void *data, size_t length, int flags);
+
+int decode_message(void **result, void **payload, void *enc_msg, uint32_t msg_length, msg_arena *arena);
+
+int pack_cuda_cmd(void **payload, var **args, size_t arg_count, int type);
+
+size_t encode_message(void **result, int msg_type, uint32_t req_id, void *payload);
+
+void free_decoded_message(void *msg, msg_arena *arena);
+
+uint32_t get_req_id(void *msg);
+
+int is_fast_cmd(int cmd_type);
+
+int is_fast_frame(void *enc_msg, uint32_t msg_length);
+
+size_t encode_fast_frame(void **result, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count);
+
+int send_fast_frame(int sock_fd, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count);
+
+uint64_t get_bulk_length(void *enc_msg, uint32_t msg_length);
+
+int send_shm_frame(int sock_fd, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count, uint64_t shm_offset, uint64_t shm_length);
+
+int get_shm_range(void *enc_msg, uint32_t msg_length, uint64_t *shm_offset, uint64_t *shm_length);
+
+int send_striped_frame(int sock_fd, int msg_type, int cmd_type, uint32_t req_id, var **args, size_t arg_count, uint64_t length);
+
+int is_striped_frame(void *enc_msg, uint32_t msg_length);
+
+uint64_t get_stripe_length(void *enc_msg, uint32_t msg_length);
 
-size_t encode_message(void **result, int msg_type, void *payload);
+size_t send_bulk_data(int sock_fd, const void *data, size_t length);
 
-void free_decoded_message(void *msg);
+size_t receive_bulk_data(int sock_fd, void *data, size_t length);
 
 #endif /* PROTOCOL_H */
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cuda.h>
+
+#include "record.h"
+#include "common.h"
+#include "utils.h"
+
+int gs_recording = 0;
+
+/*
+ * The command a thread sent last, encoded, until its result comes. The
+ * wrapper waits for (or defers) each result before the next command, so
+ * one per thread is enough.
+ */
+typedef struct pending_record_s {
+	record_hdr hdr;
+	void *args;
+	size_t size;
+	int active;
+} pending_record;
+
+static __thread pending_record pending = { .active = 0 };
+static FILE *record_file = NULL;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static uint64_t base_ns;
+static int store_payloads = 0;
+
+static void close_at_exit(void) {
+	pthread_mutex_lock(&record_lock);
+	gs_recording = 0;
+	fclose(record_file);
+	pthread_mutex_unlock(&record_lock);
+}
+
+static void init_recording(void) {
+	const char *prefix = getenv("GPUSOCK_RECORD"), *payloads = getenv("GPUSOCK_RECORD_PAYLOADS");
+	record_file_hdr file_hdr;
+	struct timespec ts;
+	char path[4096];
+
+	if (prefix == NULL || *prefix == '\0')
+		return;
+
+	snprintf(path, sizeof(path), "%s.%d.gsr", prefix, (int) getpid());
+	record_file = fopen(path, "w");
+	if (record_file == NULL) {
+		perror("Cannot write the recording");
+		return;
+	}
+	store_payloads = (payloads != NULL && atoi(payloads) > 0);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(file_hdr.magic, RECORD_MAGIC, sizeof(file_hdr.magic));
+	file_hdr.version = RECORD_VERSION;
+	file_hdr.start_time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	fwrite(&file_hdr, sizeof(file_hdr), 1, record_file);
+	base_ns = now_ns();
+
+	atexit(close_at_exit);
+	gs_recording = 1;
+	gdprintf("Recording commands into %s\n", path);
+}
+
+// Turns recording on if GPUSOCK_RECORD is set; only the first call counts
+void record_init(void) {
+	pthread_once(&init_once, init_recording);
+}
+
+// Commands whose result is a handle or a count, as a single uint64
+int returns_handle(int type) {
+	switch (type) {
+		case INIT:
+		case DEVICE_GET:
+		case DEVICE_GET_COUNT:
+		case CONTEXT_CREATE:
+		case MODULE_LOAD:
+		case MODULE_GET_FUNCTION:
+		case MEMORY_ALLOCATE:
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *reserve_args(size_t length) {
+	void *data;
+
+	if (pending.hdr.length + length > pending.size) {
+		pending.size = (pending.hdr.length + length > 2 * pending.size) ?
+			pending.hdr.length + length : 2 * pending.size;
+		pending.args = realloc_safe(pending.args, pending.size);
+	}
+	data = pending.args + pending.hdr.length;
+	pending.hdr.length += length;
+
+	return data;
+}
+
+// Starts the record of a command that is being sent
+void record_cmd(var **args, size_t arg_count, int type) {
+	record_arg *arg;
+	const char *str;
+	size_t i;
+
+	// Data connections are the transport's business
+	if (!gs_recording || type == STRIPE_OPEN || type == STRIPE_ATTACH)
+		return;
+
+	pending.hdr.start_ns = now_ns() - base_ns;
+	pending.hdr.res_code = 0;
+	pending.hdr.result = 0;
+	pending.hdr.length = 0;
+	pending.hdr.type = type;
+	pending.hdr.arg_count = arg_count;
+	pending.hdr.flags = 0;
+	pending.hdr.reserved = 0;
+
+	for (i = 0; i < arg_count; i++) {
+		arg = reserve_args(sizeof(*arg));
+		arg->type = args[i]->type;
+		arg->flags = 0;
+		arg->reserved = 0;
+		arg->elements = args[i]->elements;
+		if (args[i]->type == STRING) {
+			str = *(char **) args[i]->data;
+			arg->length = strlen(str) + 1;
+			memcpy(reserve_args(arg->length), str, arg->length);
+		} else if (args[i]->type == BYTES && !store_payloads && type == MEMCPY_HOST_TO_DEV) {
+			arg->flags = RECORD_ARG_SIZE_ONLY;
+			arg->length = args[i]->length;
+		} else {
+			arg->length = args[i]->length;
+			if (args[i]->length > 0)
+				memcpy(reserve_args(args[i]->length), args[i]->data, args[i]->length);
+		}
+	}
+	pending.active = 1;
+}
+
+// Completes the record of the command sent last by this thread and writes it
+void record_result(int64_t res_code, const void *result, int deferred) {
+	if (!gs_recording || !pending.active)
+		return;
+
+	pending.hdr.duration_ns = now_ns() - base_ns - pending.hdr.start_ns;
+	pending.hdr.res_code = res_code;
+	if (res_code == CUDA_SUCCESS && result != NULL && returns_handle(pending.hdr.type))
+		memcpy(&pending.hdr.result, result, sizeof(pending.hdr.result));
+	if (deferred)
+		pending.hdr.flags |= RECORD_F_DEFERRED;
+	pending.active = 0;
+
+	pthread_mutex_lock(&record_lock);
+	if (gs_recording) {
+		fwrite(&pending.hdr, sizeof(pending.hdr), 1, record_file);
+		fwrite(pending.args, 1, pending.hdr.length, record_file);
+	}
+	pthread_mutex_unlock(&record_lock);
+}
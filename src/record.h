@@ -0,0 +1,68 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+
+/*
+ * Recording of the commands a client sends, to replay them later against
+ * a server (see replay.c). It is turned on with GPUSOCK_RECORD=prefix and
+ * writes prefix.<pid>.gsr. Commands are recorded as the application issued
+ * them, before the transport splits, batches or moves their payloads, with
+ * the time they were sent, how long their result took and what it was.
+ * Memcpy payloads take most of the space and replays mostly do not need
+ * them, so by default only their size is kept; GPUSOCK_RECORD_PAYLOADS=1
+ * stores them too. Module images and kernel parameters are always stored.
+ *
+ * The file is a record_file_hdr followed by records: a record_hdr and its
+ * arguments, each a record_arg followed by its data unless it is a
+ * placeholder. STRING arguments are stored as the string, NUL included.
+ * Everything is in host byte order.
+ */
+#define RECORD_MAGIC "GSRC"
+#define RECORD_VERSION 1
+
+// Record flags
+#define RECORD_F_DEFERRED 0x1	// the result was left for later (asynchronous mode)
+
+// Argument flags
+#define RECORD_ARG_SIZE_ONLY 0x1	// payload not stored, only its length
+
+typedef struct record_file_hdr_s {
+	char magic[4];
+	uint32_t version;
+	uint64_t start_time;	// Unix time of the start, in nanoseconds
+} record_file_hdr;
+
+typedef struct record_hdr_s {
+	uint64_t start_ns;	// when the command was sent, since the start
+	uint64_t duration_ns;	// until its result was in, or it was deferred
+	int64_t res_code;
+	uint64_t result;	// handle or count the command returned, if any
+	uint64_t length;	// bytes of arguments that follow
+	uint16_t type;
+	uint8_t arg_count;
+	uint8_t flags;
+	uint32_t reserved;
+} record_hdr;
+
+typedef struct record_arg_s {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t elements;
+	uint64_t length;
+} record_arg;
+
+extern int gs_recording;
+
+void record_init(void);
+
+void record_cmd(var **args, size_t arg_count, int type);
+
+void record_result(int64_t res_code, const void *result, int deferred);
+
+int returns_handle(int type);
+
+#endif /* RECORD_H */
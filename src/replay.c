@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <cuda.h>
+
+#include "common.h"
+#include "utils.h"
+#include "client.h"
+#include "record.h"
+#include "stripe.h"
+
+/*
+ * Replays a recording of GPUSOCK_RECORD (see record.h) against a server:
+ *
+ *   replay [-m] [-v] [-o results.json] recording.gsr
+ *
+ * The server is found as by the wrapper (GPUSOCK_SERVER and friends), and
+ * the GPUSOCK_* transport settings apply the same way, so a recording can
+ * be replayed with other settings than it was made with. Commands are sent
+ * at the times they were recorded at, or one right after the other with
+ * -m, on a single connection, and their payloads take the same routes as
+ * in the wrapper. Payloads that were not stored are replaced by as many
+ * zero bytes.
+ *
+ * Handles and device pointers of the recording are mapped to those the
+ * server returns in the replay: the arguments that hold them are known
+ * per command, and a device pointer may point anywhere inside an
+ * allocation. Kernel parameter buffers are opaque, so every aligned 8-byte
+ * word in them that falls inside a recorded allocation is taken for a
+ * device pointer.
+ *
+ * It prints, for every command type, how long the commands took in the
+ * recording and in the replay, and with -v every command; -o writes the
+ * summary as JSON.
+ */
+
+#define MAX_ARGS 16
+
+typedef struct mapping_s {
+	uint64_t old;
+	uint64_t size;		// for allocations, 0 for other handles
+	uint64_t new;
+} mapping;
+
+typedef struct handle_arg_s {
+	int type;
+	int arg;
+	int elem;
+	int pointer;		// device pointer, into an allocation
+} handle_arg;
+
+// UINT arguments that hold handles, by command
+static const handle_arg handle_args[] = {
+	{ DEVICE_GET_NAME, 1, 0, 0 },
+	{ CONTEXT_CREATE, 0, 1, 0 },
+	{ CONTEXT_DESTROY, 0, 0, 0 },
+	{ MODULE_GET_FUNCTION, 0, 0, 0 },
+	{ MEMORY_FREE, 0, 0, 1 },
+	{ MEMCPY_HOST_TO_DEV, 0, 0, 1 },
+	{ MEMCPY_DEV_TO_HOST, 0, 0, 1 },
+	{ LAUNCH_KERNEL, 0, 7, 0 },
+};
+static const int n_handle_args = sizeof(handle_args) / sizeof(handle_args[0]);
+
+static const char *command_names[STRIPE_ATTACH + 1] = {
+	[INIT] = "INIT",
+	[DEVICE_GET] = "DEVICE_GET",
+	[DEVICE_GET_COUNT] = "DEVICE_GET_COUNT",
+	[DEVICE_GET_NAME] = "DEVICE_GET_NAME",
+	[CONTEXT_CREATE] = "CONTEXT_CREATE",
+	[CONTEXT_DESTROY] = "CONTEXT_DESTROY",
+	[MODULE_LOAD] = "MODULE_LOAD",
+	[MODULE_GET_FUNCTION] = "MODULE_GET_FUNCTION",
+	[MEMORY_ALLOCATE] = "MEMORY_ALLOCATE",
+	[MEMORY_FREE] = "MEMORY_FREE",
+	[MEMCPY_HOST_TO_DEV] = "MEMCPY_HOST_TO_DEV",
+	[MEMCPY_DEV_TO_HOST] = "MEMCPY_DEV_TO_HOST",
+	[LAUNCH_KERNEL] = "LAUNCH_KERNEL",
+	[CONTEXT_SYNCHRONIZE] = "CONTEXT_SYNCHRONIZE",
+};
+
+// Recorded and replayed durations of the commands of a type
+typedef struct timings_s {
+	uint64_t *recorded;
+	uint64_t *replayed;
+	long count;
+	long size;
+	long mismatches;	// result codes that differ
+} timings;
+
+static mapping *mappings = NULL;
+static long n_mappings = 0, mappings_size = 0;
+static timings stats[STRIPE_ATTACH + 1];
+
+static void add_mapping(uint64_t old, uint64_t size, uint64_t new) {
+	if (n_mappings == mappings_size) {
+		mappings_size = (mappings_size == 0) ? 64 : 2 * mappings_size;
+		mappings = realloc_safe(mappings, sizeof(*mappings) * mappings_size);
+	}
+	mappings[n_mappings].old = old;
+	mappings[n_mappings].size = size;
+	mappings[n_mappings++].new = new;
+}
+
+// Finds the mapping of a handle, or of the allocation a pointer is in
+static mapping *find_mapping(uint64_t value, int pointer) {
+	long i;
+
+	// Recent handles are the likely ones
+	for (i = n_mappings - 1; i >= 0; i--) {
+		if (!pointer && mappings[i].size == 0 && mappings[i].old == value)
+			return &mappings[i];
+		if (pointer && mappings[i].size > 0 && value >= mappings[i].old &&
+				value - mappings[i].old < mappings[i].size)
+			return &mappings[i];
+	}
+
+	return NULL;
+}
+
+static void remove_mapping(mapping *m) {
+	*m = mappings[--n_mappings];
+}
+
+static uint64_t map_value(uint64_t value, int pointer) {
+	mapping *m = find_mapping(value, pointer);
+
+	return (m != NULL) ? m->new + (value - m->old) : value;
+}
+
+static void map_handles(int type, var **args, size_t arg_count) {
+	uint64_t word;
+	size_t off;
+	int i;
+
+	for (i = 0; i < n_handle_args; i++) {
+		if (handle_args[i].type != type || handle_args[i].arg >= arg_count ||
+				args[handle_args[i].arg]->type != UINT ||
+				handle_args[i].elem >= args[handle_args[i].arg]->elements)
+			continue;
+		((uint64_t *) args[handle_args[i].arg]->data)[handle_args[i].elem] =
+			map_value(((uint64_t *) args[handle_args[i].arg]->data)[handle_args[i].elem], handle_args[i].pointer);
+	}
+
+	if (type == LAUNCH_KERNEL && arg_count > 1 && args[1]->type == BYTES) {
+		for (off = 0; off + sizeof(word) <= args[1]->length; off += sizeof(word)) {
+			memcpy(&word, args[1]->data + off, sizeof(word));
+			word = map_value(word, 1);
+			memcpy(args[1]->data + off, &word, sizeof(word));
+		}
+	}
+}
+
+static void add_timing(int type, uint64_t recorded, uint64_t replayed, int mismatch) {
+	timings *t = &stats[type];
+
+	if (t->count == t->size) {
+		t->size = (t->size == 0) ? 256 : 2 * t->size;
+		t->recorded = realloc_safe(t->recorded, sizeof(*t->recorded) * t->size);
+		t->replayed = realloc_safe(t->replayed, sizeof(*t->replayed) * t->size);
+	}
+	t->recorded[t->count] = recorded;
+	t->replayed[t->count++] = replayed;
+	t->mismatches += mismatch;
+}
+
+// Reads exactly length bytes; 0 at a clean end of file, -1 if truncated
+static int read_exactly(FILE *f, void *data, size_t length, int eof_ok) {
+	size_t n = fread(data, 1, length, f);
+
+	if (n == length)
+		return 1;
+	if (n == 0 && eof_ok && feof(f))
+		return 0;
+
+	return -1;
+}
+
+static void *grow(void *buffer, size_t *size, size_t length) {
+	if (length > *size) {
+		*size = length;
+		buffer = realloc_safe(buffer, length);
+	}
+
+	return buffer;
+}
+
+// Sends a command the way the wrapper does and returns its result code
+static int64_t issue(params *p, int type, var **args, size_t arg_count, void *host, uint64_t *value) {
+	void *result = NULL;
+	uint64_t dptr, length;
+	int64_t res_code;
+
+	if (type == MEMCPY_HOST_TO_DEV && arg_count == 2) {
+		dptr = *(uint64_t *) args[0]->data;
+		length = args[1]->length;
+		if (length >= SHM_MIN_PAYLOAD && has_shm_transport(p->sock_fd))
+			return shm_memcpy_htod(p->sock_fd, dptr, args[1]->data, length);
+		if (length >= STRIPE_MIN_PAYLOAD && has_stripes(p->sock_fd))
+			return striped_memcpy_htod(p->sock_fd, dptr, args[1]->data, length);
+	} else if (type == MEMCPY_DEV_TO_HOST && arg_count == 1 && args[0]->elements == 2) {
+		dptr = ((uint64_t *) args[0]->data)[0];
+		length = ((uint64_t *) args[0]->data)[1];
+		if (length >= SHM_MIN_PAYLOAD && has_shm_transport(p->sock_fd))
+			return shm_memcpy_dtoh(p->sock_fd, host, dptr, length);
+		if (length >= STRIPE_MIN_PAYLOAD && has_stripes(p->sock_fd))
+			return striped_memcpy_dtoh(p->sock_fd, host, dptr, length);
+	}
+
+	if (send_cuda_cmd(p->sock_fd, args, arg_count, type) == -1) {
+		fprintf(stderr, "Problem sending CUDA cmd!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	switch (type) {
+		case MEMORY_FREE:
+		case MEMCPY_HOST_TO_DEV:
+		case LAUNCH_KERNEL:
+			return defer_cuda_cmd_result(p->sock_fd);
+		case MEMCPY_DEV_TO_HOST:
+			return get_cuda_cmd_result_into(host, ((uint64_t *) args[0]->data)[1], p->sock_fd);
+	}
+
+	res_code = get_cuda_cmd_result(&result, p->sock_fd);
+	if (res_code == CUDA_SUCCESS && result != NULL && returns_handle(type))
+		*value = *(uint64_t *) result;
+	free(result);
+
+	return res_code;
+}
+
+static double mean_us(uint64_t *ns, long n) {
+	double sum = 0;
+	long i;
+
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+
+	return sum / n / 1e3;
+}
+
+static void report(uint64_t recorded_ns, uint64_t replayed_ns, const char *json_path) {
+	double rec_mean, rep_mean;
+	timings *t;
+	FILE *f = NULL;
+	int type, sep = 0;
+
+	if (json_path != NULL && (f = fopen(json_path, "w")) == NULL) {
+		perror("Cannot write the results");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("\nrecorded %.3f s, replayed %.3f s\n", recorded_ns / 1e9, replayed_ns / 1e9);
+	printf("%-20s %8s %8s %12s %12s %12s %12s %12s %12s %8s\n", "command", "count", "errors",
+			"rec_mean_us", "mean_us", "rec_p50_us", "p50_us", "rec_p99_us", "p99_us", "diff");
+	if (f != NULL)
+		fprintf(f, "{\n  \"recorded_s\": %.6f,\n  \"replayed_s\": %.6f,\n  \"commands\": [",
+				recorded_ns / 1e9, replayed_ns / 1e9);
+
+	for (type = 0; type <= STRIPE_ATTACH; type++) {
+		t = &stats[type];
+		if (t->count == 0)
+			continue;
+		rec_mean = mean_us(t->recorded, t->count);
+		rep_mean = mean_us(t->replayed, t->count);
+		qsort(t->recorded, t->count, sizeof(*t->recorded), compare_u64);
+		qsort(t->replayed, t->count, sizeof(*t->replayed), compare_u64);
+		printf("%-20s %8ld %8ld %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f %+7.1f%%\n",
+				command_names[type], t->count, t->mismatches, rec_mean, rep_mean,
+				percentile_us(t->recorded, t->count, 0.50), percentile_us(t->replayed, t->count, 0.50),
+				percentile_us(t->recorded, t->count, 0.99), percentile_us(t->replayed, t->count, 0.99),
+				(rec_mean > 0) ? 100 * (rep_mean - rec_mean) / rec_mean : 0);
+		if (f != NULL)
+			fprintf(f, "%s\n    {\"command\": \"%s\", \"count\": %ld, \"result_mismatches\": %ld, "
+					"\"recorded\": {\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}, "
+					"\"replayed\": {\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}}",
+					sep++ ? "," : "", command_names[type], t->count, t->mismatches,
+					rec_mean, percentile_us(t->recorded, t->count, 0.50),
+					percentile_us(t->recorded, t->count, 0.99), t->recorded[t->count - 1] / 1e3,
+					rep_mean, percentile_us(t->replayed, t->count, 0.50),
+					percentile_us(t->replayed, t->count, 0.99), t->replayed[t->count - 1] / 1e3);
+		free(t->recorded);
+		free(t->replayed);
+	}
+
+	if (f != NULL) {
+		fprintf(f, "\n  ]\n}\n");
+		fclose(f);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *json_path = NULL;
+	int opt, ret, max_speed = 0, verbose = 0, init_id = -1;
+	record_file_hdr file_hdr;
+	record_hdr hdr;
+	record_arg arg_hdr;
+	var vars[MAX_ARGS], *args[MAX_ARGS];
+	char *strs[MAX_ARGS];
+	void *rec_args = NULL, *zeros = NULL, *host = NULL;
+	size_t rec_args_size = 0, zeros_size = 0, host_size = 0, off;
+	uint64_t start, sent, duration, value, end_ns = 0;
+	struct timespec due;
+	int64_t res_code;
+	long index = 0;
+	params p;
+	FILE *f;
+	int i;
+
+	while ((opt = getopt(argc, argv, "mvo:")) != -1) {
+		switch (opt) {
+			case 'm':
+				max_speed = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'o':
+				json_path = optarg;
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (optind != argc - 1) {
+		printf("Usage: replay [-m] [-v] [-o results.json] recording.gsr\n");
+		exit(EXIT_FAILURE);
+	}
+
+	f = fopen(argv[optind], "r");
+	if (f == NULL) {
+		perror("Cannot open the recording");
+		exit(EXIT_FAILURE);
+	}
+	if (read_exactly(f, &file_hdr, sizeof(file_hdr), 0) < 0 ||
+			memcmp(file_hdr.magic, RECORD_MAGIC, sizeof(file_hdr.magic)) != 0 ||
+			file_hdr.version != RECORD_VERSION) {
+		fprintf(stderr, "%s is not a recording of this version\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	init_params(&p);
+	get_server_connection(&p);
+
+	start = now_ns();
+	while ((ret = read_exactly(f, &hdr, sizeof(hdr), 1)) != 0) {
+		if (ret < 0) {
+			fprintf(stderr, "Truncated record %ld\n", index);
+			exit(EXIT_FAILURE);
+		}
+		if (hdr.arg_count > MAX_ARGS || hdr.type > STRIPE_ATTACH || command_names[hdr.type] == NULL) {
+			fprintf(stderr, "Bad record %ld\n", index);
+			exit(EXIT_FAILURE);
+		}
+		rec_args = grow(rec_args, &rec_args_size, hdr.length);
+		if (read_exactly(f, rec_args, hdr.length, 0) < 0) {
+			fprintf(stderr, "Truncated record %ld\n", index);
+			exit(EXIT_FAILURE);
+		}
+
+		// Arguments point into the record, or at zeros for placeholders
+		for (i = 0, off = 0; i < hdr.arg_count; i++) {
+			if (hdr.length - off < sizeof(arg_hdr)) {
+				fprintf(stderr, "Bad record %ld\n", index);
+				exit(EXIT_FAILURE);
+			}
+			memcpy(&arg_hdr, rec_args + off, sizeof(arg_hdr));
+			off += sizeof(arg_hdr);
+			vars[i].type = arg_hdr.type;
+			vars[i].length = arg_hdr.length;
+			vars[i].elements = arg_hdr.elements;
+			args[i] = &vars[i];
+			if (arg_hdr.flags & RECORD_ARG_SIZE_ONLY) {
+				if (arg_hdr.length > zeros_size) {
+					free(zeros);
+					zeros = calloc_safe(1, arg_hdr.length);
+					zeros_size = arg_hdr.length;
+				}
+				vars[i].data = zeros;
+				continue;
+			}
+			if (arg_hdr.length > hdr.length - off ||
+					(arg_hdr.type == STRING && (arg_hdr.length == 0 ||
+					((char *) rec_args)[off + arg_hdr.length - 1] != '\0'))) {
+				fprintf(stderr, "Bad record %ld\n", index);
+				exit(EXIT_FAILURE);
+			}
+			vars[i].data = rec_args + off;
+			if (arg_hdr.type == STRING) {
+				strs[i] = rec_args + off;
+				vars[i].data = &strs[i];
+				vars[i].length = sizeof(char *);
+			}
+			off += arg_hdr.length;
+		}
+
+		// A new client id, and data connections of its own
+		if (hdr.type == INIT && hdr.arg_count == 1)
+			vars[0].data = &init_id;
+		map_handles(hdr.type, args, hdr.arg_count);
+		if (hdr.type == MEMCPY_DEV_TO_HOST && hdr.arg_count == 1 && vars[0].elements == 2)
+			host = grow(host, &host_size, ((uint64_t *) vars[0].data)[1]);
+
+		if (!max_speed) {
+			due.tv_sec = (start + hdr.start_ns) / 1000000000;
+			due.tv_nsec = (start + hdr.start_ns) % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		}
+
+		value = 0;
+		sent = now_ns();
+		res_code = issue(&p, hdr.type, args, hdr.arg_count, host, &value);
+		duration = now_ns() - sent;
+		add_timing(hdr.type, hdr.duration_ns, duration, res_code != hdr.res_code);
+		if (verbose)
+			printf("%8ld %-20s %12.2f %12.2f %+12.2f%s\n", index, command_names[hdr.type],
+					hdr.duration_ns / 1e3, duration / 1e3, (duration - (double) hdr.duration_ns) / 1e3,
+					(res_code != hdr.res_code) ? " result differs" : "");
+
+		if (res_code == CUDA_SUCCESS) {
+			switch (hdr.type) {
+				case INIT:
+					p.id = value;
+					open_stripes(p.sock_fd);
+					break;
+				case MEMORY_ALLOCATE:
+					if (hdr.res_code == CUDA_SUCCESS)
+						add_mapping(hdr.result, *(uint64_t *) vars[0].data, value);
+					break;
+				case DEVICE_GET:
+				case CONTEXT_CREATE:
+				case MODULE_LOAD:
+				case MODULE_GET_FUNCTION:
+					if (hdr.res_code == CUDA_SUCCESS)
+						add_mapping(hdr.result, 0, value);
+					break;
+				case MEMORY_FREE:
+				case CONTEXT_DESTROY:
+					// The arguments hold the replayed handle by now
+					for (i = 0; i < n_mappings; i++) {
+						if (mappings[i].new == *(uint64_t *) vars[0].data) {
+							remove_mapping(&mappings[i]);
+							break;
+						}
+					}
+					break;
+			}
+		}
+		if (hdr.start_ns + hdr.duration_ns > end_ns)
+			end_ns = hdr.start_ns + hdr.duration_ns;
+		index++;
+	}
+	fclose(f);
+	release_client_conn(p.sock_fd);
+	close(p.sock_fd);
+
+	report(end_ns, now_ns() - start, json_path);
+
+	free(rec_args);
+	free(zeros);
+	free(host);
+	free(mappings);
+
+	return 0;
+}
@@ -7,166 +7,1671 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <inttypes.h>
 
 #include "common.h"
 #include "common.pb-c.h"
 #include "protocol.h"
 #include "process.h"
+#include "arena.h"
+#include "executor.h"
+#include "metrics.h"
+#include "shm.h"
+#include "stripe.h"
+#include "trace.h"
+#include "transport.h"
+#include "uring.h"
+#include "zerocopy.h"
+#include "list.h"
 
-int init_server_net(const char *port, struct addrinfo *addr) {
-	int socket_fd, ret;
-	struct addrinfo hints;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;		// Allow IPv4
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;	// For wildcard IP address
-	hints.ai_protocol = 0;			// Any protocol
-	hints.ai_canonname = NULL;
-	hints.ai_addr = NULL;
-	hints.ai_next = NULL;
-
-	ret = getaddrinfo(NULL, port, &hints, &addr);
-	if (ret) {
-		fprintf(stderr, "getaddrinfo failed: [%d] %s\n", ret, gai_strerror(ret));
-		exit(EXIT_FAILURE);
+#define MAX_EPOLL_EVENTS 64
+#define MAX_URING_EVENTS 256
+#define MAX_LISTENERS (TRANSPORT_MAX_ADDRS + 1)
+
+struct session_s;
+
+/*
+ * A request from the moment its header is read until its result is sent.
+ * It owns everything the command needs, so that it can run on an executor
+ * while the network thread keeps reading from the session: the decode
+ * arena (which also holds a copy of fast path frames) and the staging
+ * buffer of an out-of-band payload, pinned if the session's device has
+ * pool memory to spare. Requests are recycled.
+ *
+ * A large host-to-device copy is streamed: it is queued to the executor
+ * as soon as its header is read, and the executor copies the payload to
+ * the device chunk by chunk as the network thread receives it. A striped
+ * payload is received by the data connection threads of the session
+ * instead, and the command waits for them; without an executor, the
+ * last of them hands the request back to the network thread to run.
+ */
+typedef struct request_s {
+	job work;
+	struct session_s *sess;
+	int msg_type;
+	int fast;
+	uint32_t req_id;
+	void *dec_msg;
+	void *payload;
+	msg_arena arena;
+	msg_buffer bulk_rx;
+	void *bulk_data;	// bulk_rx or a pool buffer
+	uint64_t bulk_length;
+	uint64_t bulk_received;
+	// streamed payloads only
+	int streaming;
+	int aborted;
+	pthread_mutex_t progress_lock;
+	pthread_cond_t progress;
+	// payloads over the data connections only
+	int striped;		// of the command, or of its result if it has none
+	int stripe_failed;
+	int stripes_pending;	// runs on the network thread once they are in
+	stripe_transfer stripe_xfer;
+	// filled in when the command runs
+	int resp_type;
+	int cmd_type;
+	int arg_cnt;
+	void *result;
+	void *pinned_result;	// pool buffer the payload of the result is in
+	uintptr_t dev_ptr;
+	int client_done;
+} request;
+
+/*
+ * Per client connection state. Sessions are multiplexed by an epoll loop:
+ * input is read with MSG_DONTWAIT and parsed as it arrives, and a request
+ * is dispatched once its out-of-band payload, if any, is complete. Until
+ * the client creates a context, its commands run on the network thread;
+ * from then on they are queued to the executor of the context's device.
+ * Sockets are non-blocking: responses are queued and written as far as the
+ * socket takes them, the rest once epoll reports room for it. A session
+ * that fails is closed on its own. Clients on a Unix domain socket may
+ * share a memory region for their memcpy payloads, TCP clients may stripe
+ * them over data connections. A data connection starts out as a session
+ * of its own, whose socket is handed over to the session it attaches to.
+ *
+ * With the io_uring engine, received data is appended to the reader
+ * instead, and queued responses are sent one at a time. A session is only
+ * freed once none of its operations is left in the ring.
+ */
+typedef struct session_s {
+	int sock_fd;
+	char peer[NI_MAXHOST + NI_MAXSERV + 2];
+	conn_reader reader;
+	shm_region shm;
+	void *client_handle;
+	executor *exec;
+	request *req;		// request still being received
+	unsigned int inflight;
+	int closing;
+	zc_tracker zc;
+	traffic_counters traffic;
+	// data connections
+	stripe_set stripes;
+	uint64_t stripe_token;
+	int stripes_wanted;
+	// ...or the session a data connection attaches to
+	uint64_t attach_token;
+	int attach_index;
+	uint32_t attach_req_id;
+	// responses waiting to be sent
+	struct list_head tx_queue;
+	// epoll engine only
+	uint32_t events;	// what the epoll set watches the socket for
+	// io_uring engine only
+	io_op recv_op;
+	int recv_armed;
+	int cancel_sent;	// the receive is cancelled only once
+	int tx_busy;
+	struct list_head node;
+} session;
+
+/*
+ * A response waiting to be sent. With io_uring, its frame and out-of-band
+ * payload go out as linked sends; with epoll, they are written as far as
+ * the socket takes them. Either way a short send is resumed where it
+ * stopped. It keeps the result of the command while the payload is being
+ * sent from it, which is also what a payload sent with MSG_ZEROCOPY is
+ * held as.
+ */
+typedef struct response_s {
+	struct list_head node;
+	session *sess;
+	io_op op;
+	void *msg;
+	size_t msg_length;
+	void *bulk;
+	size_t bulk_length;
+	size_t sent;
+	int parts;		// sends in flight
+	int failed;
+	int zerocopy;		// payload goes with MSG_ZEROCOPY (epoll only)
+	var **result;
+	int arg_cnt;
+	void *pinned_result;
+	int cmd_type;		// for the metrics
+	uint64_t send_start;
+	trace_stamp trace_start;
+} response;
+
+static void *free_list = NULL, *busy_list = NULL, *client_list = NULL;
+// Device and client lists are shared between the network thread and the executors
+static pthread_mutex_t lists_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(sessions);
+static LIST_HEAD(idle_requests);
+static LIST_HEAD(executors);
+static completion_queue completions;
+static io_op completions_op = { IO_OP_POLL, &completions };
+
+// I/O engine, chosen with GPUSOCK_IO_ENGINE
+static int use_uring = 0;
+static int epoll_fd = -1;
+
+// Listening sockets; their epoll events point here
+typedef struct listener_s {
+	int sock_fd;
+	transport_addr addr;
+	io_op op;
+} listener;
+
+static listener listeners[MAX_LISTENERS];
+static int n_listeners = 0;
+
+void add_listener(transport_addr *addr) {
+	struct epoll_event ev;
+	listener *l = &listeners[n_listeners++];
+	char name[NI_MAXHOST + NI_MAXSERV + 16];
+
+	l->sock_fd = transport_listen(addr);
+	l->addr = *addr;
+	format_transport_addr(addr, name, sizeof(name));
+	printf("Listening on %s\n", name);
+
+	if (use_uring) {
+		l->op.type = IO_OP_ACCEPT;
+		l->op.owner = l;
+		uring_add_accept(l->sock_fd, &l->op);
+		return;
 	}
 
-	socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-	if (socket_fd < 0) {
-		perror("socket creation failed");
+	ev.events = EPOLLIN;
+	ev.data.ptr = l;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, l->sock_fd, &ev) < 0) {
+		perror("epoll_ctl failed");
 		exit(EXIT_FAILURE);
 	}
+}
 
-	if (bind(socket_fd, (struct sockaddr*)addr->ai_addr, addr->ai_addrlen) < 0) {
-		perror("bind failed");
-		exit(EXIT_FAILURE);
+int is_listener(void *ptr) {
+	return (ptr >= (void *) listeners && ptr < (void *) (listeners + n_listeners));
+}
+
+void init_server(void **free_list, void **busy_list) {
+	printf("Initializing server...\n");
+	discover_cuda_devices(free_list, busy_list);
+}
+
+void execute_request(job *work);
+
+void release_zc_response(void *arg);
+
+// Command type of a request for the metrics
+int metrics_type(request *req) {
+	return (req->msg_type == CUDA_CMD) ? req->cmd_type : req->msg_type;
+}
+
+// Accounts bytes to a session, and to its device once it has one
+void count_traffic(session *sess, uint64_t bytes_in, uint64_t bytes_out) {
+	add_traffic(&sess->traffic, bytes_in, bytes_out);
+	if (sess->exec != NULL)
+		add_traffic(&sess->exec->traffic, bytes_in, bytes_out);
+}
+
+request *get_request(session *sess) {
+	request *req;
+
+	if (!list_empty(&idle_requests)) {
+		req = list_first_entry(&idle_requests, request, work.node);
+		list_del(&req->work.node);
+	} else {
+		req = malloc_safe(sizeof(*req));
+		init_arena(&req->arena);
+		init_msg_buffer(&req->bulk_rx);
+		pthread_mutex_init(&req->progress_lock, NULL);
+		pthread_cond_init(&req->progress, NULL);
+		init_stripe_transfer(&req->stripe_xfer);
+		req->work.run = execute_request;
 	}
+	req->sess = sess;
+	req->msg_type = -1;
+	req->fast = 0;
+	req->req_id = 0;
+	req->dec_msg = NULL;
+	req->payload = NULL;
+	req->bulk_data = NULL;
+	req->bulk_length = 0;
+	req->bulk_received = 0;
+	req->streaming = 0;
+	req->aborted = 0;
+	req->striped = 0;
+	req->stripe_failed = 0;
+	req->stripes_pending = 0;
+	req->resp_type = -1;
+	req->cmd_type = 0;
+	req->arg_cnt = 0;
+	req->result = NULL;
+	req->pinned_result = NULL;
+	req->dev_ptr = 0;
+	req->client_done = 0;
 
-	if (listen(socket_fd, 10) < 0) {
-		perror("listen failed");
-		exit(EXIT_FAILURE);
+	return req;
+}
+
+void put_request(request *req) {
+	if (req->dec_msg != NULL) {
+		free_decoded_message(req->dec_msg, &req->arena);
+		req->dec_msg = NULL;
+		// payload should be invalid now
+		req->payload = NULL;
 	}
+	reset_arena(&req->arena);
+	if (req->bulk_data != NULL && req->bulk_data != req->bulk_rx.data)
+		pool_free(req->bulk_data);
+	else if (req->bulk_length > 0)
+		trim_msg_buffer(&req->bulk_rx);
 
-	return socket_fd;
+	list_add(&req->work.node, &idle_requests);
 }
 
-int init_server(char *port, struct addrinfo *addr, void **free_list, void **busy_list) {
-	int socket_fd;
+// Sets up a session for an accepted connection and starts reading from it
+session *new_session(int client_sock_fd, listener *l) {
+	session *sess;
+	struct sockaddr_storage client_addr;
+	char client_host[NI_MAXHOST], client_serv[NI_MAXSERV];
+	struct epoll_event ev;
+	socklen_t s = sizeof(client_addr);
 
-	printf("Initializing server...\n");
-	socket_fd = init_server_net(port, addr);
-	discover_cuda_devices(free_list, busy_list);
+	tune_socket(client_sock_fd, l->addr.kind);
 
-	return socket_fd;
+	sess = malloc_safe(sizeof(*sess));
+	sess->sock_fd = client_sock_fd;
+	sess->client_handle = NULL;
+	sess->exec = NULL;
+	sess->req = NULL;
+	sess->inflight = 0;
+	sess->closing = 0;
+	sess->events = 0;
+	sess->recv_armed = 0;
+	sess->cancel_sent = 0;
+	sess->tx_busy = 0;
+	INIT_LIST_HEAD(&sess->tx_queue);
+	init_zc_tracker(&sess->zc, release_zc_response);
+	init_shm_region(&sess->shm);
+	init_stripe_set(&sess->stripes);
+	sess->stripe_token = 0;
+	sess->stripes_wanted = 0;
+	sess->attach_token = 0;
+	sess->attach_index = -1;
+	sess->attach_req_id = 0;
+	// The receive buffer is reused for every message of the session; with
+	// io_uring, received data is appended to it
+	init_reader(&sess->reader, use_uring ? -1 : client_sock_fd);
+
+	if (l->addr.kind == TRANSPORT_UNIX)
+		snprintf(sess->peer, sizeof(sess->peer), "local");
+	else if (getpeername(client_sock_fd, (struct sockaddr*)&client_addr, &s) == 0 &&
+			getnameinfo((struct sockaddr*)&client_addr, s,
+				client_host, sizeof(client_host), client_serv,
+				sizeof(client_serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+		snprintf(sess->peer, sizeof(sess->peer), "%s:%s", client_host, client_serv);
+	else
+		snprintf(sess->peer, sizeof(sess->peer), "unidentified");
+	printf("\nConnection accepted from client @%s\n", sess->peer);
+	register_traffic(&sess->traffic, "session", sess->peer);
+
+	if (!use_uring && l->addr.kind != TRANSPORT_UNIX && zc_enable(&sess->zc, client_sock_fd))
+		gdprintf("Large payloads to client @%s are sent with MSG_ZEROCOPY\n", sess->peer);
+
+	if (use_uring) {
+		sess->recv_op.type = IO_OP_RECV;
+		sess->recv_op.owner = sess;
+		sess->recv_armed = 1;
+		uring_add_recv(client_sock_fd, &sess->recv_op);
+	} else {
+		if (fcntl(client_sock_fd, F_SETFL, fcntl(client_sock_fd, F_GETFL) | O_NONBLOCK) < 0)
+			perror("fcntl(O_NONBLOCK) failed");
+		ev.events = EPOLLIN;
+		ev.data.ptr = sess;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock_fd, &ev) < 0) {
+			perror("epoll_ctl failed");
+			exit(EXIT_FAILURE);
+		}
+		sess->events = ev.events;
+	}
+	list_add_tail(&sess->node, &sessions);
+
+	return sess;
 }
 
-int main(int argc, char *argv[]) {
-	int server_sock_fd, client_sock_fd, msg_type, resp_type, arg_cnt;
-	struct sockaddr_in client_addr;
-	struct addrinfo local_addr;
-	char server_ip[16] /* IPv4 */, server_port[6], *local_port,
-		 client_host[NI_MAXHOST], client_serv[NI_MAXSERV];
-	socklen_t s;
-	void *msg=NULL, *payload=NULL, *result=NULL, *dec_msg=NULL,
-		 *free_list=NULL, *busy_list=NULL, *client_list=NULL, *client_handle=NULL;
+session *accept_session(listener *l) {
+	int client_sock_fd;
+
+	client_sock_fd = accept(l->sock_fd, NULL, NULL);
+	if (client_sock_fd < 0) {
+		perror("accept failed");
+		return NULL;
+	}
+
+	return new_session(client_sock_fd, l);
+}
+
+// Frees the result of a command; a payload read back into a pool buffer
+// goes back to its pool
+void free_result(var **result, int arg_cnt, void *pinned) {
+	int i;
+
+	if (pinned != NULL) {
+		for (i = 0; i < arg_cnt; i++) {
+			if (result[i]->data == pinned)
+				result[i]->data = NULL;
+		}
+		pool_free(pinned);
+	}
+	free_cuda_cmd_result(result, arg_cnt);
+}
+
+void free_response(response *resp) {
+	list_del(&resp->node);
+	if (resp->result != NULL)
+		free_result(resp->result, resp->arg_cnt, resp->pinned_result);
+	free(resp->msg);
+	free(resp);
+}
+
+// A result holding nothing but a result code
+int new_result_code(void **result, int res_code) {
+	var **res;
+
+	res = malloc_safe(sizeof(*res));
+	res[0] = malloc_safe(sizeof(**res));
+	res[0]->type = INT;
+	res[0]->elements = 1;
+	res[0]->length = sizeof(int);
+	res[0]->data = malloc_safe(res[0]->length);
+	memcpy(res[0]->data, &res_code, res[0]->length);
+
+	*result = res;
+
+	return 1;
+}
+
+// Changes what the epoll set watches a session for; 0 takes it out
+void set_session_events(session *sess, uint32_t events) {
+	struct epoll_event ev;
+	int op;
+
+	if (events == sess->events)
+		return;
+
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (sess->events == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	ev.events = events;
+	ev.data.ptr = sess;
+	if (epoll_ctl(epoll_fd, op, sess->sock_fd, &ev) < 0)
+		perror("epoll_ctl failed");
+	sess->events = events;
+}
+
+// Input is read until the session is closing, output as long as there is
+// some queued
+void update_session_events(session *sess) {
+	uint32_t events = 0;
+
+	if (use_uring)
+		return;
+
+	if (!sess->closing)
+		events |= EPOLLIN;
+	if (!list_empty(&sess->tx_queue))
+		events |= EPOLLOUT;
+	set_session_events(sess, events);
+}
+
+/*
+ * Answers the STRIPE_ATTACH of a data connection and, if the session it
+ * names takes it, hands its socket over. Returns -1 if the socket is still
+ * the caller's to close.
+ */
+int attach_data_conn(session *sess) {
+	session *owner = NULL, *s;
+	void *result = NULL, *payload = NULL, *msg = NULL;
+	size_t msg_length;
+	ssize_t sent;
+	int arg_cnt, res_code = CUDA_ERROR_INVALID_VALUE;
+
+	list_for_each_entry(s, &sessions, node) {
+		if (s != sess && s->stripe_token == sess->attach_token && !s->closing) {
+			owner = s;
+			break;
+		}
+	}
+	if (owner != NULL && sess->attach_index >= 0 && sess->attach_index < owner->stripes_wanted &&
+			owner->stripes.workers[sess->attach_index] == NULL)
+		res_code = CUDA_SUCCESS;
+
+	// The client sends nothing more until it has the answer, so the socket
+	// has room for it; the send does not block the event loop of either
+	// engine
+	arg_cnt = new_result_code(&result, res_code);
+	pack_cuda_cmd(&payload, result, arg_cnt, CUDA_CMD_RESULT);
+	msg_length = encode_message(&msg, CUDA_CMD_RESULT, sess->attach_req_id, payload);
+	sent = send(sess->sock_fd, msg, msg_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+	free(msg);
+	free(((CudaCmd *) payload)->extra_args);
+	free(payload);
+	free_cuda_cmd_result(result, arg_cnt);
+
+	if (res_code != CUDA_SUCCESS) {
+		fprintf(stderr, "Client @%s asked to attach to an unknown session\n", sess->peer);
+		return -1;
+	}
+	if (sent != (ssize_t) msg_length) {
+		fprintf(stderr, "Cannot answer the data connection of client @%s\n", owner->peer);
+		return -1;
+	}
+
+	// The data connection thread uses blocking I/O
+	fcntl(sess->sock_fd, F_SETFL, fcntl(sess->sock_fd, F_GETFL) & ~O_NONBLOCK);
+	add_stripe(&owner->stripes, sess->attach_index, sess->sock_fd);
+	printf("Client @%s attached data connection %d of %d\n", owner->peer,
+			sess->attach_index + 1, owner->stripes_wanted);
+
+	return 0;
+}
+
+void close_session(session *sess) {
+	response *resp, *tmp;
+
+	if (sess->attach_token != 0) {
+		// Not a client of its own; the socket goes to the session it
+		// attaches to
+		if (!use_uring)
+			set_session_events(sess, 0);
+		if (attach_data_conn(sess) < 0)
+			close(sess->sock_fd);
+	} else {
+		printf("\n--------------\nClosing session of client @%s\n\n", sess->peer);
+		// (closing the socket also removes it from the epoll set)
+		close(sess->sock_fd);
+	}
+	// A client that just disconnects still holds its contexts and devices
+	if (sess->client_handle != NULL) {
+		pthread_mutex_lock(&lists_lock);
+		release_client(sess->client_handle, free_list, busy_list);
+		sess->client_handle = NULL;
+		pthread_mutex_unlock(&lists_lock);
+	}
+	close_stripe_set(&sess->stripes);
+	unregister_traffic(&sess->traffic);
+
+	if (sess->req != NULL)
+		put_request(sess->req);
+	list_for_each_entry_safe(resp, tmp, &sess->tx_queue, node)
+		free_response(resp);
+	free_zc_tracker(&sess->zc);
+	free_reader(&sess->reader);
+	unmap_shm_region(&sess->shm);
+	list_del(&sess->node);
+	free(sess);
+}
+
+// Wakes up the executor of a streamed payload that will not be completed;
+// the request is left to it
+void abort_streaming(session *sess) {
+	request *req = sess->req;
+
+	if (req == NULL || !req->streaming)
+		return;
+
+	pthread_mutex_lock(&req->progress_lock);
+	req->aborted = 1;
+	pthread_cond_broadcast(&req->progress);
+	pthread_mutex_unlock(&req->progress_lock);
+	sess->req = NULL;
+}
+
+/*
+ * Stops reading from a session; it is closed once its requests are done
+ * and its responses sent, and with io_uring once its receive has
+ * completed. This is called again as each of them finishes.
+ */
+void end_session(session *sess) {
+	sess->closing = 1;
+	abort_streaming(sess);
+	shutdown_stripe_set(&sess->stripes);
+	if (use_uring) {
+		if (sess->recv_armed && !sess->cancel_sent) {
+			sess->cancel_sent = 1;
+			uring_cancel(&sess->recv_op);
+		}
+		if (sess->inflight == 0 && !sess->recv_armed && !sess->tx_busy)
+			close_session(sess);
+	} else {
+		// Responses still queued go out first
+		if (sess->inflight == 0 && list_empty(&sess->tx_queue))
+			close_session(sess);
+		else
+			update_session_events(sess);
+	}
+}
+
+// Commands that look up or change the device and client lists
+int touches_lists(int cmd_type) {
+	switch (cmd_type) {
+		case INIT:
+		case DEVICE_GET:
+		case CONTEXT_CREATE:
+		case CONTEXT_DESTROY:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Runs the commands of a CUDA_CMD_BATCH in order. Like the commands it
+ * replaces, each of them runs even if an earlier one failed; the single
+ * result holds the first error, then the number of commands run and the
+ * request id of the one that failed first.
+ */
+int run_batch(void **result, request *req, CudaCmd *batch) {
+	session *sess = req->sess;
+	uint8_t *pos, *end;
 	uint32_t msg_length;
+	uint64_t counts[2] = { 0, 0 }, shm_offset, shm_length;
+	void *dec_msg = NULL, *payload = NULL, *cmd_result = NULL;
+	int msg_type, arg_cnt, res_code, batch_result = CUDA_SUCCESS;
+	var **res;
+	CudaCmd *cmd;
 
-	if (argc > 2) {
-		printf("Usage: server <local_port>\n");
-		exit(EXIT_FAILURE);
+	if (batch->n_extra_args == 0) {
+		pos = end = NULL;
+	} else {
+		pos = batch->extra_args[0].data;
+		end = pos + batch->extra_args[0].len;
 	}
+	gdprintf("Running batch of %" PRIu64 " commands\n", (batch->n_uint_args > 0) ? batch->uint_args[0] : 0);
+
+	while (pos != NULL && pos + sizeof(msg_length) <= end) {
+		memcpy(&msg_length, pos, sizeof(msg_length));
+		msg_length = ntohl(msg_length);
+		pos += sizeof(msg_length);
+		msg_type = -1;
+		if (msg_length <= end - pos)
+			msg_type = decode_message(&dec_msg, &payload, pos, msg_length, &req->arena);
+		if (msg_type != CUDA_CMD || payload == NULL ||
+				get_bulk_length(pos, msg_length) > 0 ||
+				get_shm_range(pos, msg_length, &shm_offset, &shm_length)) {
+			fprintf(stderr, "Malformed command in batch\n");
+			if (batch_result == CUDA_SUCCESS)
+				batch_result = CUDA_ERROR_INVALID_VALUE;
+			break;
+		}
+		pos += msg_length;
+		cmd = payload;
 
-	if (argc == 1) {
-		printf("No port defined, trying env vars\n");
-		if (get_server_ip(server_ip, server_port) < 2) {
-			local_port = server_port;
+		if (touches_lists(cmd->type))
+			pthread_mutex_lock(&lists_lock);
+		arg_cnt = process_cuda_cmd(&cmd_result, cmd, free_list, busy_list, &client_list, &sess->client_handle);
+		if (touches_lists(cmd->type))
+			pthread_mutex_unlock(&lists_lock);
+
+		if (arg_cnt > 0) {
+			res_code = *(int *) ((var **) cmd_result)[0]->data;
+			free_cuda_cmd_result(cmd_result, arg_cnt);
 		} else {
-			printf("Could not get env vars, using default %s\n", DEFAULT_SERVER_PORT);
-			local_port = (char *) DEFAULT_SERVER_PORT;
+			res_code = CUDA_ERROR_INVALID_VALUE;
+		}
+		if (res_code != CUDA_SUCCESS && batch_result == CUDA_SUCCESS) {
+			batch_result = res_code;
+			counts[1] = get_req_id(dec_msg);
 		}
+		counts[0]++;
+	}
+
+	res = malloc_safe(sizeof(*res) * 2);
+	res[0] = malloc_safe(sizeof(**res));
+	res[0]->type = INT;
+	res[0]->elements = 1;
+	res[0]->length = sizeof(int);
+	res[0]->data = malloc_safe(res[0]->length);
+	memcpy(res[0]->data, &batch_result, res[0]->length);
+	res[1] = malloc_safe(sizeof(**res));
+	res[1]->type = UINT;
+	res[1]->elements = 2;
+	res[1]->length = sizeof(counts);
+	res[1]->data = malloc_safe(res[1]->length);
+	memcpy(res[1]->data, counts, res[1]->length);
+
+	*result = res;
+
+	return 2;
+}
+
+// Blocks the executor until the network thread received length bytes of
+// a streamed payload
+size_t wait_bulk_data(void *arg, size_t length) {
+	request *req = arg;
+	size_t ready;
+
+	pthread_mutex_lock(&req->progress_lock);
+	while (req->bulk_received < length && !req->aborted)
+		pthread_cond_wait(&req->progress, &req->progress_lock);
+	ready = req->bulk_received;
+	pthread_mutex_unlock(&req->progress_lock);
+
+	return ready;
+}
+
+// Runs a host-to-device copy whose payload is still arriving
+int run_streamed_memcpy(void **result, request *req, CudaCmd *cmd) {
+	staging_area *stage = get_thread_staging_area();
+	trace_stamp start = trace_begin();
+	int res_code;
+
+	gdprintf("Executing streamed cuMemcpyHtoD...\n");
+	if (stage != NULL) {
+		res_code = staged_memcpy_htod(stage, (CUdeviceptr) cmd->uint_args[0], cmd->extra_args[0].data,
+				req->bulk_length, wait_bulk_data, req);
+	} else if (wait_bulk_data(req, req->bulk_length) < req->bulk_length) {
+		res_code = CUDA_ERROR_INVALID_VALUE;
 	} else {
-		local_port = argv[1];
+		res_code = cuMemcpyHtoD((CUdeviceptr) cmd->uint_args[0], cmd->extra_args[0].data, req->bulk_length);
 	}
+	// Timed with the wait for the payload, which the copy overlaps
+	trace_end(TRACE_CUDA_CALL, cmd->type, start);
+	// A copy that failed early leaves the network thread receiving into the
+	// request; it must be done with it before the request is put back
+	if (res_code != CUDA_SUCCESS)
+		wait_bulk_data(req, req->bulk_length);
 
-	server_sock_fd = init_server(local_port, &local_addr, &free_list, &busy_list);
-	print_cuda_devices(free_list, busy_list);
-	printf("\nServer listening on port %s for incoming connections...\n", local_port);
+	return new_result_code(result, res_code);
+}
 
-	for (;;) {
-		resp_type = -1;
-		s = sizeof(client_addr);
-		client_sock_fd = accept(server_sock_fd, (struct sockaddr*)&client_addr, &s);
-		if (client_sock_fd < 0) {
-			perror("accept failed");
-			exit(EXIT_FAILURE);
-		}
+// Memcpys an executor runs through the pinned pool and staging slots of
+// its device
+int is_staged_memcpy(CudaCmd *cmd) {
+	if (get_thread_staging_area() == NULL)
+		return 0;
+	if (cmd->type == MEMCPY_HOST_TO_DEV)
+		return cmd->n_uint_args >= 1 && cmd->n_extra_args >= 1;
+	if (cmd->type == MEMCPY_DEV_TO_HOST)
+		return cmd->n_uint_args >= 2 || (cmd->n_uint_args >= 1 && cmd->n_extra_args >= 1);
+
+	return 0;
+}
+
+/*
+ * Runs a memcpy on an executor. Large copies go through the staging slots;
+ * a device-to-host result is read back into a pool buffer if the pool has
+ * one, which the request owns until the result is freed.
+ */
+int run_staged_memcpy(void **result, request *req, CudaCmd *cmd) {
+	staging_area *stage = get_thread_staging_area();
+	CUdeviceptr dev_ptr = (CUdeviceptr) cmd->uint_args[0];
+	trace_stamp start = trace_begin();
+	size_t length;
+	void *data;
+	var **res;
+	int res_code;
 
-		printf("\nConnection accepted ");
-		if (getnameinfo((struct sockaddr*)&client_addr, s,
-					client_host, sizeof(client_host), client_serv,
-					sizeof(client_serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
-			printf("from client @%s:%s\n", client_host, client_serv);
+	if (cmd->type == MEMCPY_HOST_TO_DEV) {
+		gdprintf("Executing cuMemcpyHtoD...\n");
+		data = cmd->extra_args[0].data;
+		length = cmd->extra_args[0].len;
+		if (length >= STAGING_MIN_PAYLOAD)
+			res_code = staged_memcpy_htod(stage, dev_ptr, data, length, NULL, NULL);
 		else
-			printf("from unidentified client");
-
-		for(;;) {
-			msg_length = receive_message(&msg, client_sock_fd);
-			if (msg_length > 0)
-				msg_type = decode_message(&dec_msg, &payload, msg, msg_length);
-
-			printf("Processing message\n");
-			switch (msg_type) {
-				case CUDA_CMD:
-					arg_cnt = process_cuda_cmd(&result, payload, free_list, busy_list, &client_list, &client_handle);
-					resp_type = CUDA_CMD_RESULT;
-					break;
-				case CUDA_DEVICE_QUERY:
-					process_cuda_device_query(&result, free_list, busy_list);
-					resp_type = CUDA_DEVICE_LIST;
-					break;
+			res_code = cuda_err_print(cuMemcpyHtoD(dev_ptr, data, length), 0);
+		trace_end(TRACE_CUDA_CALL, cmd->type, start);
+		return new_result_code(result, res_code);
+	}
+
+	gdprintf("Executing cuMemcpyDtoH...\n");
+	if (cmd->n_extra_args > 0) {
+		// The client gave a destination in shared memory
+		data = cmd->extra_args[0].data;
+		length = cmd->extra_args[0].len;
+	} else {
+		length = cmd->uint_args[1];
+		res_code = check_dev_range(dev_ptr, length);
+		if (res_code == CUDA_SUCCESS && length > 0) {
+			req->pinned_result = pool_alloc(stage->pool, length);
+			data = (req->pinned_result != NULL) ? req->pinned_result : malloc(length);
+			if (data == NULL)
+				res_code = CUDA_ERROR_OUT_OF_MEMORY;
+		} else {
+			data = NULL;
+		}
+		if (res_code != CUDA_SUCCESS) {
+			trace_end(TRACE_CUDA_CALL, cmd->type, start);
+			return new_result_code(result, res_code);
+		}
+	}
+	if (length >= STAGING_MIN_PAYLOAD)
+		res_code = staged_memcpy_dtoh(stage, data, dev_ptr, length);
+	else
+		res_code = cuda_err_print(cuMemcpyDtoH(data, dev_ptr, length), 0);
+	trace_end(TRACE_CUDA_CALL, cmd->type, start);
+
+	if (cmd->n_extra_args > 0)
+		return new_result_code(result, res_code);
+	if (length == 0) {
+		free(data);
+		return new_result_code(result, res_code);
+	}
+
+	res = malloc_safe(sizeof(*res) * 2);
+	res[0] = malloc_safe(sizeof(**res));
+	res[0]->type = INT;
+	res[0]->elements = 1;
+	res[0]->length = sizeof(int);
+	res[0]->data = malloc_safe(res[0]->length);
+	memcpy(res[0]->data, &res_code, res[0]->length);
+	res[1] = malloc_safe(sizeof(**res));
+	res[1]->type = BYTES;
+	res[1]->elements = 1;
+	res[1]->length = length;
+	res[1]->data = data;
+
+	*result = res;
+
+	return 2;
+}
+
+/*
+ * Hands out the token the data connections of the session attach with.
+ * The session stripes payloads once all of them are in.
+ */
+int open_data_conns(void **result, request *req, CudaCmd *cmd) {
+	session *sess = req->sess;
+	uint64_t token = 0;
+	int fd, res_code = CUDA_SUCCESS;
+	var **res;
+
+	if (cmd->n_uint_args < 1 || cmd->uint_args[0] < 2 || sess->stripes_wanted > 0)
+		return new_result_code(result, CUDA_ERROR_INVALID_VALUE);
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, &token, sizeof(token)) != sizeof(token)) {
+		perror("Cannot make a stripe token");
+		res_code = CUDA_ERROR_UNKNOWN;
+	}
+	if (fd >= 0)
+		close(fd);
+	if (res_code != CUDA_SUCCESS)
+		return new_result_code(result, res_code);
+
+	// 0 stands for no token
+	if (token == 0)
+		token = 1;
+	sess->stripe_token = token;
+	sess->stripes_wanted = (cmd->uint_args[0] > STRIPE_MAX) ? STRIPE_MAX : cmd->uint_args[0];
+	gdprintf("Client @%s opens %d data connections\n", sess->peer, sess->stripes_wanted);
+
+	res = malloc_safe(sizeof(*res) * 2);
+	res[0] = malloc_safe(sizeof(**res));
+	res[0]->type = INT;
+	res[0]->elements = 1;
+	res[0]->length = sizeof(int);
+	res[0]->data = malloc_safe(res[0]->length);
+	memcpy(res[0]->data, &res_code, res[0]->length);
+	res[1] = malloc_safe(sizeof(**res));
+	res[1]->type = UINT;
+	res[1]->elements = 1;
+	res[1]->length = sizeof(uint64_t);
+	res[1]->data = malloc_safe(res[1]->length);
+	memcpy(res[1]->data, &token, res[1]->length);
+
+	*result = res;
+
+	return 2;
+}
+
+// Runs the command of a complete request, on an executor or inline
+void run_request(request *req) {
+	session *sess = req->sess;
+	CudaCmd *cmd;
+	uint64_t start = metrics_now();
+	trace_stamp trace_start;
+	int locked = 0;
+
+	printf("Processing message\n");
+	switch (req->msg_type) {
+		case CUDA_CMD:
+			cmd = req->payload;
+			req->cmd_type = cmd->type;
+			if (cmd->type == CONTEXT_CREATE)
+				req->dev_ptr = cmd->uint_args[1];
+
+			if (touches_lists(cmd->type)) {
+				pthread_mutex_lock(&lists_lock);
+				locked = 1;
 			}
+			set_client_context(sess->client_handle);
+			// A striped payload comes in over the data connections
+			if (req->striped && req->bulk_length > 0) {
+				trace_start = trace_begin();
+				if (wait_stripe_transfer(&req->stripe_xfer) < 0)
+					req->stripe_failed = 1;
+				trace_end(TRACE_RECEIVE, req->bulk_length, trace_start);
+			}
+
+			if (cmd->type == CUDA_CMD_BATCH)
+				req->arg_cnt = run_batch(&req->result, req, cmd);
+			else if (cmd->type == STRIPE_OPEN)
+				req->arg_cnt = open_data_conns(&req->result, req, cmd);
+			else if (req->stripe_failed)
+				req->arg_cnt = new_result_code(&req->result, CUDA_ERROR_INVALID_VALUE);
+			else if (req->streaming)
+				req->arg_cnt = run_streamed_memcpy(&req->result, req, cmd);
+			else if (is_staged_memcpy(cmd))
+				req->arg_cnt = run_staged_memcpy(&req->result, req, cmd);
+			else
+				req->arg_cnt = process_cuda_cmd(&req->result, cmd, free_list, busy_list, &client_list, &sess->client_handle);
+			req->resp_type = CUDA_CMD_RESULT;
+			req->client_done = (get_client_status(sess->client_handle) == 0);
+			break;
+		case CUDA_DEVICE_QUERY:
+			pthread_mutex_lock(&lists_lock);
+			locked = 1;
+			process_cuda_device_query(&req->result, free_list, busy_list);
+			req->resp_type = CUDA_DEVICE_LIST;
+			break;
+	}
 
+	record_phase(metrics_type(req), PHASE_EXEC, start);
+
+	if (locked) {
+		if (client_list != NULL)
 			print_clients(client_list);
-			print_cuda_devices(free_list, busy_list);
+		print_cuda_devices(free_list, busy_list);
+		pthread_mutex_unlock(&lists_lock);
+	}
+}
+
+void execute_request(job *work) {
+	run_request(container_of(work, request, work));
+}
+
+// Maps the memory region a local client passed along with INIT
+void attach_shm_region(session *sess) {
+	int fd = reader_take_fd(&sess->reader);
+
+	if (fd < 0)
+		return;
+	if (sess->shm.base != NULL) {
+		close(fd);
+		return;
+	}
 
-			if (msg != NULL) {
-				free(msg);
-				msg = NULL;
+	if (map_shm_region(&sess->shm, fd) == 0)
+		printf("Client @%s shares %zu bytes of memory\n", sess->peer, sess->shm.size);
+}
+
+// Acknowledges the region by adding its size to the INIT result
+void ack_shm_region(request *req) {
+	var **res = req->result;
+	uint64_t *uints;
+
+	if (req->arg_cnt < 2 || res[1]->type != UINT)
+		return;
+
+	uints = malloc_safe(2 * sizeof(*uints));
+	memcpy(uints, res[1]->data, sizeof(*uints));
+	uints[1] = req->sess->shm.size;
+	free(res[1]->data);
+	res[1]->data = uints;
+	res[1]->elements = 2;
+	res[1]->length = 2 * sizeof(*uints);
+}
+
+// Queues the sends of the part of a response that is not out yet
+void send_response_parts(session *sess, response *resp) {
+	size_t offset, length;
+
+	resp->parts = 0;
+	if (resp->sent < resp->msg_length) {
+		resp->parts++;
+		uring_add_send(sess->sock_fd, resp->msg + resp->sent, resp->msg_length - resp->sent,
+				&resp->op, resp->bulk_length > 0);
+	}
+	if (resp->bulk_length > 0) {
+		offset = (resp->sent > resp->msg_length) ? resp->sent - resp->msg_length : 0;
+		length = resp->bulk_length - offset;
+		if (length > URING_MAX_SEND)
+			length = URING_MAX_SEND;
+		resp->parts++;
+		uring_add_send(sess->sock_fd, resp->bulk + offset, length, &resp->op, 0);
+	}
+}
+
+void start_response(session *sess) {
+	sess->tx_busy = 1;
+	send_response_parts(sess, list_first_entry(&sess->tx_queue, response, node));
+}
+
+/*
+ * Writes queued responses until the socket is full, with epoll. A payload
+ * sent with MSG_ZEROCOPY is held until the kernel is done with it. Returns
+ * -1 if sending to the session failed.
+ */
+int flush_responses(session *sess) {
+	response *resp;
+	size_t offset;
+	ssize_t ret;
+
+	while (!list_empty(&sess->tx_queue)) {
+		resp = list_first_entry(&sess->tx_queue, response, node);
+		if (resp->sent < resp->msg_length) {
+			ret = send(sess->sock_fd, resp->msg + resp->sent, resp->msg_length - resp->sent,
+					MSG_DONTWAIT | MSG_NOSIGNAL | ((resp->bulk_length > 0) ? MSG_MORE : 0));
+		} else {
+			offset = resp->sent - resp->msg_length;
+			if (resp->zerocopy)
+				ret = zc_send(&sess->zc, sess->sock_fd, resp->bulk + offset, resp->bulk_length - offset);
+			else
+				ret = send(sess->sock_fd, resp->bulk + offset, resp->bulk_length - offset,
+						MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		__atomic_fetch_add(&gs_io_stats.tx_syscalls, 1, __ATOMIC_RELAXED);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			fprintf(stderr, "Sending to client @%s failed: %s\n", sess->peer, strerror(errno));
+			return -1;
+		}
+
+		resp->sent += ret;
+		if (resp->sent < resp->msg_length + resp->bulk_length)
+			continue;
+
+		record_phase(resp->cmd_type, PHASE_SEND, resp->send_start);
+		trace_end(TRACE_SEND, resp->sent, resp->trace_start);
+		if (resp->zerocopy) {
+			list_del_init(&resp->node);
+			zc_hold(&sess->zc, resp);
+		} else {
+			free_response(resp);
+		}
+	}
+
+	return 0;
+}
+
+// Drops the output of a session that cannot be sent to anymore
+void fail_output(session *sess) {
+	response *resp, *tmp;
+
+	list_for_each_entry_safe(resp, tmp, &sess->tx_queue, node)
+		free_response(resp);
+	sess->closing = 1;
+}
+
+// Queues a response and sends what it can of it right away
+void queue_response(session *sess, response *resp) {
+	list_add_tail(&resp->node, &sess->tx_queue);
+	if (use_uring) {
+		if (!sess->tx_busy)
+			start_response(sess);
+		return;
+	}
+
+	if (flush_responses(sess) < 0)
+		fail_output(sess);
+	update_session_events(sess);
+}
+
+// A response that outlives finish_request(); it keeps the result of the
+// request when it has a payload
+response *new_response(request *req, void *msg, size_t msg_length, void *bulk, size_t bulk_length) {
+	response *resp;
+
+	resp = malloc_safe(sizeof(*resp));
+	INIT_LIST_HEAD(&resp->node);
+	resp->sess = req->sess;
+	resp->op.type = IO_OP_SEND;
+	resp->op.owner = resp;
+	resp->msg = msg;
+	resp->msg_length = msg_length;
+	resp->bulk = bulk;
+	resp->bulk_length = (bulk != NULL) ? bulk_length : 0;
+	resp->sent = 0;
+	resp->parts = 0;
+	resp->failed = 0;
+	resp->zerocopy = 0;
+	resp->result = NULL;
+	resp->arg_cnt = 0;
+	resp->pinned_result = NULL;
+	resp->cmd_type = metrics_type(req);
+	resp->send_start = metrics_now();
+	resp->trace_start = trace_begin();
+	if (bulk != NULL) {
+		resp->result = req->result;
+		resp->arg_cnt = req->arg_cnt;
+		resp->pinned_result = req->pinned_result;
+		req->result = NULL;
+		req->pinned_result = NULL;
+	}
+
+	return resp;
+}
+
+// Frees the result of a zerocopy send once the kernel is done with it
+void release_zc_response(void *arg) {
+	free_response(arg);
+}
+
+// The result of a request while its payload goes over the data connections
+typedef struct striped_response_s {
+	stripe_transfer xfer;
+	var **result;
+	int arg_cnt;
+	void *pinned_result;
+} striped_response;
+
+// Called by the data connection thread that sent the last stripe
+void release_striped_response(stripe_transfer *xfer) {
+	striped_response *sresp = container_of(xfer, striped_response, xfer);
+
+	free_result(sresp->result, sresp->arg_cnt, sresp->pinned_result);
+	free_stripe_transfer(xfer);
+	free(sresp);
+}
+
+/*
+ * Sends the frame of a response with FRAME_F_STRIPED in place of
+ * FRAME_F_BULK, and its payload over the data connections. The frame must
+ * go first: the client only reads the stripes of a result it has seen.
+ */
+void send_striped_response(request *req, void *msg, size_t msg_length, void *bulk, uint64_t bulk_length) {
+	session *sess = req->sess;
+	frame_hdr *hdr = msg + sizeof(uint32_t);
+	striped_response *sresp;
+
+	hdr->flags = (hdr->flags & ~FRAME_F_BULK) | FRAME_F_STRIPED;
+	queue_response(sess, new_response(req, msg, msg_length, NULL, 0));
+
+	sresp = malloc_safe(sizeof(*sresp));
+	init_stripe_transfer(&sresp->xfer);
+	sresp->result = req->result;
+	sresp->arg_cnt = req->arg_cnt;
+	sresp->pinned_result = req->pinned_result;
+	req->result = NULL;
+	req->pinned_result = NULL;
+	start_stripe_transfer(&sess->stripes, &sresp->xfer, 1, req->req_id, bulk, bulk_length,
+			release_striped_response);
+}
+
+/*
+ * Sends an encoded response, followed by the out-of-band payload the frame
+ * announces, which is the BYTES argument of the result. Takes msg over.
+ * The response is queued, and keeps the result if it has a payload; a
+ * large payload sent with MSG_ZEROCOPY is kept until the kernel reports
+ * the send complete.
+ */
+void send_response(request *req, void *msg, size_t msg_length) {
+	session *sess = req->sess;
+	var **res = req->result;
+	response *resp;
+	uint64_t bulk_length;
+	void *bulk = NULL;
+	int i;
+
+	bulk_length = get_bulk_length(msg + sizeof(uint32_t), msg_length - sizeof(uint32_t));
+	for (i = 0; bulk_length > 0 && i < req->arg_cnt; i++) {
+		if (res[i]->type == BYTES)
+			bulk = res[i]->data;
+	}
+	count_traffic(sess, 0, msg_length + ((bulk != NULL) ? bulk_length : 0));
+
+	// The send is timed until it completes
+	if (bulk != NULL && req->striped) {
+		send_striped_response(req, msg, msg_length, bulk, bulk_length);
+		return;
+	}
+
+	resp = new_response(req, msg, msg_length, bulk, bulk_length);
+	resp->zerocopy = (!use_uring && bulk != NULL && sess->zc.enabled && bulk_length >= ZC_MIN_PAYLOAD);
+	queue_response(sess, resp);
+}
+
+// Sends the result of a request back from the network thread
+void finish_request(request *req) {
+	session *sess = req->sess;
+	void *msg = NULL, *payload = NULL;
+	var **res = req->result;
+	size_t msg_length = 0;
+	uint64_t start;
+
+	if (req->resp_type == CUDA_CMD_RESULT && req->cmd_type == INIT && sess->shm.base != NULL)
+		ack_shm_region(req);
+
+	// The client works on the device of its context from now on
+	if (req->cmd_type == CONTEXT_CREATE && req->arg_cnt > 0 &&
+			*(int *) res[0]->data == CUDA_SUCCESS) {
+		sess->exec = find_executor(&executors, req->dev_ptr);
+		gdprintf("Client @%s bound to executor %d\n", sess->peer,
+				(sess->exec != NULL) ? sess->exec->id : -1);
+	}
+
+	if (req->resp_type == CUDA_CMD_RESULT)
+		count_command(metrics_type(req), req->arg_cnt <= 0 || *(int *) res[0]->data != CUDA_SUCCESS);
+	else if (req->resp_type != -1)
+		count_command(metrics_type(req), 0);
+
+	if (req->resp_type != -1) {
+		gdprintf("Sending result\n");
+		start = metrics_now();
+		// Answer in the same format the request came in
+		if (req->fast && req->resp_type == CUDA_CMD_RESULT)
+			msg_length = encode_fast_frame(&msg, req->resp_type, req->cmd_type, req->req_id, res, req->arg_cnt);
+		if (msg_length == 0 && req->resp_type == CUDA_DEVICE_LIST) {
+			msg_length = encode_message(&msg, req->resp_type, req->req_id, req->result);
+		} else if (msg_length == 0) {
+			pack_cuda_cmd(&payload, res, req->arg_cnt, CUDA_CMD_RESULT);
+			msg_length = encode_message(&msg, req->resp_type, req->req_id, payload);
+			free(((CudaCmd *) payload)->extra_args);
+			free(payload);
+		}
+		record_phase(metrics_type(req), PHASE_ENCODE, start);
+		send_response(req, msg, msg_length);
+	}
+
+	if (req->result != NULL) {
+		if (req->resp_type == CUDA_DEVICE_LIST)
+			free_cuda_device_list(req->result);
+		else
+			free_result(req->result, req->arg_cnt, req->pinned_result);
+		req->result = NULL;
+		req->pinned_result = NULL;
+	}
+	printf(">>\nMessage processed, cleaning up...\n<<\n");
+
+	if (req->client_done) {
+		// The client was deleted along with its last context
+		printf("\n--------------\nClient finished.\n\n");
+		sess->closing = 1;
+	}
+	if (req->stripe_failed) {
+		fprintf(stderr, "Lost a data connection of client @%s\n", sess->peer);
+		sess->closing = 1;
+	}
+	sess->inflight--;
+	put_request(req);
+}
+
+// Hands a large host-to-device copy to the executor before its payload
+// is in
+void start_streaming(request *req) {
+	session *sess = req->sess;
+
+	gdprintf("Streaming %" PRIu64 " bytes to executor %d\n", req->bulk_length, sess->exec->id);
+	req->streaming = 1;
+	sess->inflight++;
+	submit_job(sess->exec, &req->work);
+}
+
+// Makes received payload bytes available to the executor
+void advance_streaming(request *req, size_t length) {
+	pthread_mutex_lock(&req->progress_lock);
+	req->bulk_received += length;
+	pthread_cond_broadcast(&req->progress);
+	pthread_mutex_unlock(&req->progress_lock);
+}
+
+// Buffer for the payload of a request, pinned if the pool has one
+void *reserve_payload(request *req) {
+	session *sess = req->sess;
+
+	if (sess->exec != NULL)
+		req->bulk_data = pool_alloc(&sess->exec->pool, req->bulk_length);
+	if (req->bulk_data == NULL)
+		req->bulk_data = reserve_msg_buffer(&req->bulk_rx, req->bulk_length);
+
+	return req->bulk_data;
+}
+
+// Called by the data connection thread that received the last stripe of a
+// request that has no executor to wait for them
+void stripes_received(stripe_transfer *xfer) {
+	request *req = container_of(xfer, request, stripe_xfer);
+
+	complete_job(&completions, &req->work);
+}
+
+void dispatch_request(request *req) {
+	session *sess = req->sess;
+	CudaCmd *cmd = (req->msg_type == CUDA_CMD) ? req->payload : NULL;
+
+	sess->req = NULL;
+	sess->inflight++;
+	// STRIPE_OPEN sets up the session state data connections attach by,
+	// which only the network thread touches
+	if (sess->exec != NULL && (cmd == NULL || cmd->type != STRIPE_OPEN)) {
+		submit_job(sess->exec, &req->work);
+	} else {
+		run_request(req);
+		finish_request(req);
+	}
+}
+
+/*
+ * Consumes whatever input the session has without blocking. Returns 0 when
+ * it needs to wait for more data and -1 when the session is over.
+ */
+int handle_session_input(session *sess) {
+	request *req;
+	CudaCmd *cmd;
+	void *msg;
+	uint32_t msg_length;
+	uint64_t shm_offset, shm_length, start;
+	ssize_t ret;
+
+	while (!sess->closing) {
+		req = sess->req;
+		if (req != NULL) {
+			// Read the out-of-band payload straight into its staging buffer
+			ret = reader_read_bulk(&sess->reader, req->bulk_data + req->bulk_received,
+					req->bulk_length - req->bulk_received, MSG_DONTWAIT);
+			if (ret < 0)
+				return -1;
+			if (req->streaming)
+				advance_streaming(req, ret);
+			else
+				req->bulk_received += ret;
+			if (req->bulk_received < req->bulk_length)
+				return 0;
+			if (req->streaming) {
+				// already on its executor
+				sess->req = NULL;
+				continue;
+			}
+		} else {
+			ret = reader_next_message(&sess->reader, &msg, &msg_length, MSG_DONTWAIT);
+			if (ret <= 0)
+				return ret;
+
+			req = get_request(sess);
+			req->fast = is_fast_frame(msg, msg_length);
+			if (req->fast && (sess->exec != NULL ||
+						(use_uring && get_bulk_length(msg, msg_length) > 0))) {
+				// Fast path views point into the frame, which must outlive
+				// the reader buffer (appending to it may move the frame)
+				msg = memcpy(arena_alloc(&req->arena, msg_length), msg, msg_length);
 			}
-			if (dec_msg != NULL) {
-				free_decoded_message(dec_msg);
-				dec_msg = NULL;
-				// payload should be invalid now
-				payload = NULL;
+			start = metrics_now();
+			req->msg_type = decode_message(&req->dec_msg, &req->payload, msg, msg_length, &req->arena);
+			req->req_id = get_req_id(req->dec_msg);
+			cmd = (req->msg_type == CUDA_CMD) ? req->payload : NULL;
+			if (cmd != NULL)
+				req->cmd_type = cmd->type;
+			record_phase(metrics_type(req), PHASE_DECODE, start);
+			count_traffic(sess, sizeof(uint32_t) + msg_length, 0);
+
+			if (cmd != NULL && cmd->type == INIT)
+				attach_shm_region(sess);
+
+			if (cmd != NULL && get_shm_range(msg, msg_length, &shm_offset, &shm_length)) {
+				if (cmd->n_extra_args > 0)
+					cmd->extra_args[0].data = shm_ptr(&sess->shm, shm_offset, shm_length);
+				if (cmd->n_extra_args == 0 || cmd->extra_args[0].data == NULL) {
+					fprintf(stderr, "Invalid shared memory range from client @%s\n", sess->peer);
+					put_request(req);
+					return -1;
+				}
 			}
 
-			if (resp_type != -1) {
-				gdprintf("Sending result\n");
-				pack_cuda_cmd(&payload, result, arg_cnt, CUDA_CMD_RESULT);
-				msg_length = encode_message(&msg, resp_type, payload);
-				send_message(client_sock_fd, msg, msg_length);
+			if (cmd != NULL && cmd->type == STRIPE_ATTACH) {
+				// A data connection; it is handed over once the session ends
+				if (cmd->n_uint_args >= 2) {
+					sess->attach_token = cmd->uint_args[0];
+					sess->attach_index = cmd->uint_args[1];
+					sess->attach_req_id = req->req_id;
+				}
+				put_request(req);
+				return -1;
+			}
 
-				if (result != NULL) {
-					// should be more freeing here...
-					free(result);
-					result = NULL;
+			if (cmd != NULL && is_striped_frame(msg, msg_length)) {
+				if (sess->stripes_wanted == 0 || sess->stripes.count < sess->stripes_wanted ||
+						(get_stripe_length(msg, msg_length) > 0 && cmd->n_extra_args == 0)) {
+					fprintf(stderr, "Unexpected striped payload from client @%s\n", sess->peer);
+					put_request(req);
+					return -1;
 				}
+				// With no payload of its own, the command asks for its
+				// result to be striped
+				req->striped = 1;
+				req->bulk_length = get_stripe_length(msg, msg_length);
+				count_traffic(sess, req->bulk_length, 0);
+				if (req->bulk_length > 0) {
+					cmd->extra_args[0].data = reserve_payload(req);
+					// The network thread must not wait for the stripes
+					req->stripes_pending = (sess->exec == NULL);
+					start_stripe_transfer(&sess->stripes, &req->stripe_xfer, 0, req->req_id,
+							req->bulk_data, req->bulk_length,
+							req->stripes_pending ? stripes_received : NULL);
+				}
+				if (req->stripes_pending) {
+					sess->inflight++;
+					continue;
+				}
+				dispatch_request(req);
+				continue;
 			}
-			printf(">>\nMessage processed, cleaning up...\n<<\n");
-			if (msg != NULL) {
-				free(msg);
-				msg = NULL;
+
+			req->bulk_length = (req->msg_type == CUDA_CMD) ? get_bulk_length(msg, msg_length) : 0;
+			count_traffic(sess, req->bulk_length, 0);
+			if (req->bulk_length > 0) {
+				cmd->extra_args[0].data = reserve_payload(req);
+				sess->req = req;
+				if (sess->exec != NULL && cmd->type == MEMCPY_HOST_TO_DEV &&
+						req->bulk_length >= STAGING_MIN_PAYLOAD)
+					start_streaming(req);
+				continue;
 			}
+		}
+
+		dispatch_request(req);
+	}
+
+	return -1;
+}
+
+void handle_completions(void) {
+	LIST_HEAD(done);
+	request *req, *tmp;
+	session *sess;
+
+	take_completions(&completions, &done);
+	list_for_each_entry_safe(req, tmp, &done, work.node) {
+		list_del(&req->work.node);
+		sess = req->sess;
+		if (req->stripes_pending) {
+			// Its stripes are in; wait_stripe_transfer() returns at once
+			req->stripes_pending = 0;
+			run_request(req);
+		}
+		finish_request(req);
+
+		if (sess->closing)
+			end_session(sess);
+	}
+}
+
+void handle_accept_event(io_event *ev) {
+	listener *l = ev->op->owner;
+
+	if (ev->res >= 0)
+		new_session(ev->res, l);
+	else
+		fprintf(stderr, "accept failed: %s\n", strerror(-ev->res));
+
+	if (!ev->more)
+		uring_add_accept(l->sock_fd, &l->op);
+}
+
+void handle_recv_event(io_event *ev) {
+	session *sess = ev->op->owner;
+
+	if (ev->res > 0 && !sess->closing) {
+		reader_append(&sess->reader, ev->data, ev->res);
+		if (handle_session_input(sess) < 0)
+			end_session(sess);
+	}
+	if (ev->more)
+		return;
+
+	// The receive is over; it stops early when the buffers run out
+	sess->recv_armed = 0;
+	if (!sess->closing && (ev->res > 0 || ev->res == -ENOBUFS)) {
+		sess->recv_armed = 1;
+		uring_add_recv(sess->sock_fd, &sess->recv_op);
+		return;
+	}
+	if (ev->res < 0 && ev->res != -ECANCELED && !sess->closing)
+		fprintf(stderr, "recv failed: %s\n", strerror(-ev->res));
+	end_session(sess);
+}
+
+void handle_send_event(io_event *ev) {
+	response *resp = ev->op->owner;
+	session *sess = resp->sess;
+	int failed;
+
+	if (ev->res > 0)
+		resp->sent += ev->res;
+	else if (ev->res != -ECANCELED)
+		// a link broken by a short send cancels the rest of the chain
+		resp->failed = 1;
+	if (--resp->parts > 0)
+		return;
+
+	if (!resp->failed && resp->sent < resp->msg_length + resp->bulk_length) {
+		send_response_parts(sess, resp);
+		return;
+	}
+
+	failed = resp->failed;
+	if (!failed) {
+		record_phase(resp->cmd_type, PHASE_SEND, resp->send_start);
+		trace_end(TRACE_SEND, resp->sent, resp->trace_start);
+	}
+	free_response(resp);
+	sess->tx_busy = 0;
+	if (failed) {
+		fprintf(stderr, "Sending to client @%s failed\n", sess->peer);
+		fail_output(sess);
+		end_session(sess);
+	} else if (!list_empty(&sess->tx_queue)) {
+		start_response(sess);
+	} else if (sess->closing) {
+		end_session(sess);
+	}
+}
+
+void run_epoll_loop(void) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	session *sess;
+	int i, n_events, completed;
+
+	for (;;) {
+		n_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (n_events < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait failed");
+			break;
+		}
+
+		completed = 0;
+		for (i = 0; i < n_events; i++) {
+			if (is_listener(events[i].data.ptr)) {
+				accept_session(events[i].data.ptr);
+				continue;
+			}
+			if (events[i].data.ptr == &completions) {
+				completed = 1;
+				continue;
+			}
+
+			sess = events[i].data.ptr;
+			// Zerocopy completions are reported on the error queue
+			if (events[i].events & EPOLLERR)
+				zc_reap(&sess->zc, sess->sock_fd);
+			if ((events[i].events & EPOLLOUT) && flush_responses(sess) < 0)
+				fail_output(sess);
+			if (sess->closing || handle_session_input(sess) < 0)
+				end_session(sess);
+			else
+				update_session_events(sess);
+		}
+
+		// Last, as it may close sessions that have events in this batch
+		if (completed)
+			handle_completions();
+	}
+}
+
+void run_uring_loop(void) {
+	io_event events[MAX_URING_EVENTS];
+	int i, n_events, completed;
+
+	for (;;) {
+		n_events = uring_wait(events, MAX_URING_EVENTS);
+		if (n_events < 0)
+			break;
+
+		completed = 0;
+		for (i = 0; i < n_events; i++) {
+			// cancellations complete with no operation
+			if (events[i].op == NULL)
+				continue;
 
-			if (get_client_status(client_handle) == 0) {
-				// TODO: freeing
-				printf("\n--------------\nClient finished.\n\n");
-				break;
+			switch (events[i].op->type) {
+				case IO_OP_ACCEPT:
+					handle_accept_event(&events[i]);
+					break;
+				case IO_OP_RECV:
+					handle_recv_event(&events[i]);
+					break;
+				case IO_OP_SEND:
+					handle_send_event(&events[i]);
+					break;
+				case IO_OP_POLL:
+					completed = 1;
+					if (!events[i].more)
+						uring_add_poll(completions.event_fd, &completions_op);
+					break;
 			}
 		}
+
+		if (completed)
+			handle_completions();
+	}
+}
+
+// GPUSOCK_IO_ENGINE=io_uring selects io_uring, if the server was built with
+// it and the kernel supports it; epoll is the default
+void select_io_engine(void) {
+	const char *engine = getenv("GPUSOCK_IO_ENGINE");
+
+	if (engine != NULL && strcmp(engine, "io_uring") == 0) {
+		if (uring_init() == 0)
+			use_uring = 1;
+		else
+			fprintf(stderr, "io_uring is not available, falling back to epoll\n");
+	} else if (engine != NULL && strcmp(engine, "epoll") != 0) {
+		fprintf(stderr, "Unknown I/O engine %s, using epoll\n", engine);
+	}
+
+	if (!use_uring) {
+		epoll_fd = epoll_create1(0);
+		if (epoll_fd < 0) {
+			perror("epoll_create failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("Using the %s I/O engine\n", use_uring ? "io_uring" : "epoll");
+}
+
+int main(int argc, char *argv[]) {
+	int i, n_addrs;
+	transport_addr addrs[TRANSPORT_MAX_ADDRS];
+	struct epoll_event ev;
+	session *sess, *tmp;
+
+	if (argc > 2) {
+		printf("Usage: server <local_port>\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Listen on the addresses of GPUSOCK_SERVER; a port given on the
+	// command line replaces the port of the TCP ones
+	n_addrs = get_server_addrs(addrs, TRANSPORT_MAX_ADDRS, 1);
+	if (n_addrs == 0) {
+		fprintf(stderr, "No address to listen on\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; argc == 2 && i < n_addrs; i++) {
+		if (addrs[i].kind != TRANSPORT_UNIX)
+			snprintf(addrs[i].port, sizeof(addrs[i].port), "%s", argv[1]);
+	}
+
+	// A client that goes away must only end its own session; sends report
+	// it as EPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	trace_init();
+	init_server(&free_list, &busy_list);
+	print_cuda_devices(free_list, busy_list);
+
+	init_completion_queue(&completions);
+	start_executors(&executors, free_list, &completions);
+	start_metrics();
+
+	select_io_engine();
+	// The listening sockets and the completion queue have no session
+	for (i = 0; i < n_addrs; i++)
+		add_listener(&addrs[i]);
+	if (use_uring) {
+		uring_add_poll(completions.event_fd, &completions_op);
+	} else {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &completions;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, completions.event_fd, &ev) < 0) {
+			perror("epoll_ctl failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("\nServer waiting for incoming connections...\n");
+
+	if (use_uring)
+		run_uring_loop();
+	else
+		run_epoll_loop();
+
+	list_for_each_entry(sess, &sessions, node)
+		abort_streaming(sess);
+	stop_executors(&executors);
+	handle_completions();
+	list_for_each_entry_safe(sess, tmp, &sessions, node)
+		close_session(sess);
+	stop_metrics();
+	free_executors(&executors);
+	if (use_uring)
+		uring_exit();
+	else
+		close(epoll_fd);
+	for (i = 0; i < n_listeners; i++) {
+		close(listeners[i].sock_fd);
+		if (listeners[i].addr.kind == TRANSPORT_UNIX)
+			unlink(listeners[i].addr.host);
 	}
-	close(client_sock_fd);
+	free_completion_queue(&completions);
 
 	if (free_list != NULL)
 		free_cdn_list(free_list);
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm.h"
+#include "common.h"
+
+void init_shm_region(shm_region *shm) {
+	shm->fd = -1;
+	shm->base = NULL;
+	shm->size = 0;
+	shm->head = 0;
+	shm->tail = 0;
+}
+
+// Client side: a new anonymous region that can be passed to the server
+int create_shm_region(shm_region *shm, size_t size) {
+	int fd;
+	void *base;
+
+	fd = memfd_create("gpusock", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		perror("memfd_create failed");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate failed");
+		close(fd);
+		return -1;
+	}
+	// The server maps the whole region, so its size must never change
+	if (fcntl(fd, F_ADD_SEALS, SHM_SEALS) < 0) {
+		perror("fcntl F_ADD_SEALS failed");
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap failed");
+		close(fd);
+		return -1;
+	}
+
+	shm->fd = fd;
+	shm->base = base;
+	shm->size = size;
+	shm->head = 0;
+	shm->tail = 0;
+	gdprintf("Created shared memory region of %zu bytes\n", size);
+
+	return 0;
+}
+
+// Server side: maps a region passed by a client and closes the fd
+int map_shm_region(shm_region *shm, int fd) {
+	struct stat st;
+	void *base;
+	int seals;
+
+	// Without the seals the client could shrink the region under our mapping
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & SHM_SEALS) != SHM_SEALS) {
+		fprintf(stderr, "Shared memory region is not sealed\n");
+		close(fd);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat failed");
+		close(fd);
+		return -1;
+	}
+	if (st.st_size <= 0 || (size_t) st.st_size > (size_t) SHM_MAX_MB * 1024 * 1024) {
+		fprintf(stderr, "Bad shared memory region size %lld\n", (long long) st.st_size);
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("mmap failed");
+		return -1;
+	}
+
+	shm->fd = -1;
+	shm->base = base;
+	shm->size = st.st_size;
+	shm->head = 0;
+	shm->tail = 0;
+
+	return 0;
+}
+
+void unmap_shm_region(shm_region *shm) {
+	if (shm->base != NULL)
+		munmap(shm->base, shm->size);
+	if (shm->fd >= 0)
+		close(shm->fd);
+	init_shm_region(shm);
+}
+
+/*
+ * Takes length contiguous bytes off the ring. Returns their offset and sets
+ * end to the cursor to release them with, or returns -1 if the ring has no
+ * room until older allocations are released.
+ */
+int64_t shm_alloc(shm_region *shm, size_t length, uint64_t *end) {
+	uint64_t start, offset;
+
+	length = (length + SHM_ALIGN - 1) & ~((size_t) SHM_ALIGN - 1);
+	if (length == 0 || length > shm->size)
+		return -1;
+
+	// Nothing in use: start over at the beginning
+	if (shm->head == shm->tail)
+		shm->head = shm->tail = 0;
+
+	start = shm->head;
+	offset = start % shm->size;
+	if (offset + length > shm->size)
+		// Never wrap an allocation around
+		start += shm->size - offset;
+
+	if (start + length - shm->tail > shm->size)
+		return -1;
+
+	shm->head = start + length;
+	*end = shm->head;
+
+	return start % shm->size;
+}
+
+void shm_release(shm_region *shm, uint64_t end) {
+	if (end > shm->tail)
+		shm->tail = end;
+}
+
+// Server side: the address of a range the client sent, or NULL if it does
+// not lie within the region
+void *shm_ptr(shm_region *shm, uint64_t offset, uint64_t length) {
+	if (shm->base == NULL || offset > shm->size || length > shm->size - offset)
+		return NULL;
+
+	return shm->base + offset;
+}
+
+// Size of the region a client offers, set with GPUSOCK_SHM_MB
+size_t get_shm_size(void) {
+	const char *env = getenv("GPUSOCK_SHM_MB");
+	long mb;
+
+	mb = (env != NULL) ? atol(env) : SHM_DEFAULT_MB;
+	if (mb <= 0)
+		mb = SHM_DEFAULT_MB;
+	if (mb > SHM_MAX_MB)
+		mb = SHM_MAX_MB;
+
+	return (size_t) mb * 1024 * 1024;
+}
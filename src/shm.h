@@ -0,0 +1,57 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+/*
+ * Shared memory transport for clients on the same host as the server. The
+ * client creates a memfd, maps it and passes it to the server along with
+ * INIT over a Unix domain socket. From then on, memcpy payloads are not
+ * written to the socket: the client places them in the shared region and
+ * the command frame only carries their offset (FRAME_F_SHM), so the
+ * server hands the region itself to cuMemcpyHtoD/cuMemcpyDtoH.
+ *
+ * The client allocates from the region as a ring. Space is handed out in
+ * command order and released once the result of the command that used it
+ * has been read, which happens in command order as well, so two cursors
+ * are all the bookkeeping the ring needs. The cursors only grow; their
+ * value modulo the size is the offset.
+ */
+#define SHM_DEFAULT_MB 64
+#define SHM_MAX_MB 4096
+#define SHM_ALIGN 64
+
+// Payloads are split into chunks of at most size / SHM_RING_SLOTS bytes,
+// so that several of them can be in flight
+#define SHM_RING_SLOTS 4
+
+// The server only maps regions that carry these seals
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+typedef struct shm_region_s {
+	int fd;
+	void *base;
+	size_t size;
+	uint64_t head;		// allocation cursor
+	uint64_t tail;		// release cursor
+} shm_region;
+
+void init_shm_region(shm_region *shm);
+
+int create_shm_region(shm_region *shm, size_t size);
+
+int map_shm_region(shm_region *shm, int fd);
+
+void unmap_shm_region(shm_region *shm);
+
+int64_t shm_alloc(shm_region *shm, size_t length, uint64_t *end);
+
+void shm_release(shm_region *shm, uint64_t end);
+
+void *shm_ptr(shm_region *shm, uint64_t offset, uint64_t length);
+
+size_t get_shm_size(void);
+
+#endif /* SHM_H */
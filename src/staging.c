@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "staging.h"
+#include "process.h"
+#include "common.h"
+
+// Set on executor threads only
+static __thread staging_area *thread_stage = NULL;
+
+void init_staging_area(staging_area *stage, pinned_pool *pool) {
+	int i;
+
+	stage->pool = pool;
+	for (i = 0; i < STAGING_SLOTS; i++)
+		stage->slots[i] = NULL;
+}
+
+void free_staging_area(staging_area *stage) {
+	int i;
+
+	for (i = 0; i < STAGING_SLOTS; i++) {
+		pool_free(stage->slots[i]);
+		stage->slots[i] = NULL;
+	}
+}
+
+void set_thread_staging_area(staging_area *stage) {
+	thread_stage = stage;
+}
+
+staging_area *get_thread_staging_area(void) {
+	return thread_stage;
+}
+
+// Takes the slots from the pool on first use; returns -1 if it is out of
+// pinned memory for now
+static int get_slots(staging_area *stage) {
+	int i;
+
+	if (stage->slots[STAGING_SLOTS - 1] != NULL)
+		return 0;
+
+	for (i = 0; i < STAGING_SLOTS; i++) {
+		if (stage->slots[i] == NULL)
+			stage->slots[i] = pool_alloc(stage->pool, STAGING_CHUNK);
+		if (stage->slots[i] == NULL) {
+			gdprintf("No pinned memory for staging, copying unstaged\n");
+			return -1;
+		}
+	}
+	gdprintf("Allocated %d staging slots of %d bytes\n", STAGING_SLOTS, STAGING_CHUNK);
+
+	return 0;
+}
+
+static void destroy_events(CUevent *events, int count) {
+	int i;
+
+	for (i = 0; i < count; i++)
+		cuEventDestroy(events[i]);
+}
+
+static int create_events(CUevent *events) {
+	int i;
+
+	for (i = 0; i < STAGING_SLOTS; i++) {
+		if (cuda_err_print(cuEventCreate(&events[i], CU_EVENT_DISABLE_TIMING), 0) != CUDA_SUCCESS) {
+			destroy_events(events, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Copies from a pool buffer, which needs no staging; a streamed payload
+// still goes in chunks, each as soon as it is there
+static CUresult pinned_memcpy_htod(CUdeviceptr dst, const void *src, size_t length, staging_wait_fn wait, void *arg) {
+	CUresult res = CUDA_SUCCESS, sync_res;
+	size_t offset, chunk, ready = 0;
+
+	if (wait == NULL)
+		return cuda_err_print(cuMemcpyHtoD(dst, src, length), 0);
+
+	for (offset = 0; offset < length; offset += chunk) {
+		chunk = (length - offset < STAGING_CHUNK) ? length - offset : STAGING_CHUNK;
+		if (ready < offset + chunk && (ready = wait(arg, offset + chunk)) < offset + chunk) {
+			res = CUDA_ERROR_INVALID_VALUE;
+			break;
+		}
+		res = cuda_err_print(cuMemcpyHtoDAsync(dst + offset, src + offset, chunk, 0), 0);
+		if (res != CUDA_SUCCESS)
+			break;
+	}
+	sync_res = cuda_err_print(cuStreamSynchronize(0), 0);
+
+	return (res != CUDA_SUCCESS) ? res : sync_res;
+}
+
+/*
+ * Copies length bytes from src to the device in chunks. With wait given,
+ * src fills up while the copy runs, and each chunk is copied once wait()
+ * reports it complete.
+ */
+CUresult staged_memcpy_htod(staging_area *stage, CUdeviceptr dst, const void *src, size_t length, staging_wait_fn wait, void *arg) {
+	CUevent done[STAGING_SLOTS];
+	CUresult res = CUDA_SUCCESS, sync_res;
+	size_t offset, chunk, ready = (wait != NULL) ? 0 : length;
+	int i, slot;
+
+	if (is_pinned_buffer(src))
+		return pinned_memcpy_htod(dst, src, length, wait, arg);
+
+	if (get_slots(stage) < 0 || create_events(done) < 0) {
+		if (wait != NULL && wait(arg, length) < length)
+			return CUDA_ERROR_INVALID_VALUE;
+		return cuda_err_print(cuMemcpyHtoD(dst, src, length), 0);
+	}
+
+	for (offset = 0, i = 0; offset < length; offset += chunk, i++) {
+		chunk = (length - offset < STAGING_CHUNK) ? length - offset : STAGING_CHUNK;
+		slot = i % STAGING_SLOTS;
+
+		if (ready < offset + chunk) {
+			ready = wait(arg, offset + chunk);
+			if (ready < offset + chunk) {
+				res = CUDA_ERROR_INVALID_VALUE;
+				break;
+			}
+		}
+		// The slot is free once the copy issued from it last is done
+		if (i >= STAGING_SLOTS && (res = cuda_err_print(cuEventSynchronize(done[slot]), 0)) != CUDA_SUCCESS)
+			break;
+
+		memcpy(stage->slots[slot], src + offset, chunk);
+		res = cuda_err_print(cuMemcpyHtoDAsync(dst + offset, stage->slots[slot], chunk, 0), 0);
+		if (res == CUDA_SUCCESS)
+			res = cuda_err_print(cuEventRecord(done[slot], 0), 0);
+		if (res != CUDA_SUCCESS)
+			break;
+	}
+
+	sync_res = cuda_err_print(cuStreamSynchronize(0), 0);
+	destroy_events(done, STAGING_SLOTS);
+
+	return (res != CUDA_SUCCESS) ? res : sync_res;
+}
+
+// Copies length bytes from the device to dst, chunk by chunk
+CUresult staged_memcpy_dtoh(staging_area *stage, void *dst, CUdeviceptr src, size_t length) {
+	CUevent done[STAGING_SLOTS];
+	CUresult res = CUDA_SUCCESS, sync_res;
+	size_t offset, chunk, issued, next;
+	int i, slot;
+
+	if (is_pinned_buffer(dst) || get_slots(stage) < 0 || create_events(done) < 0)
+		return cuda_err_print(cuMemcpyDtoH(dst, src, length), 0);
+
+	// Keep every slot busy: chunk i + STAGING_SLOTS is read back while
+	// chunk i is copied out of its slot
+	for (issued = 0, i = 0; issued < length && i < STAGING_SLOTS && res == CUDA_SUCCESS; issued += chunk, i++) {
+		chunk = (length - issued < STAGING_CHUNK) ? length - issued : STAGING_CHUNK;
+		res = cuda_err_print(cuMemcpyDtoHAsync(stage->slots[i], src + issued, chunk, 0), 0);
+		if (res == CUDA_SUCCESS)
+			res = cuda_err_print(cuEventRecord(done[i], 0), 0);
+	}
+
+	for (offset = 0, i = 0; offset < length && res == CUDA_SUCCESS; offset += chunk, i++) {
+		chunk = (length - offset < STAGING_CHUNK) ? length - offset : STAGING_CHUNK;
+		slot = i % STAGING_SLOTS;
+
+		res = cuda_err_print(cuEventSynchronize(done[slot]), 0);
+		if (res != CUDA_SUCCESS)
+			break;
+		memcpy(dst + offset, stage->slots[slot], chunk);
+
+		if (issued < length) {
+			next = (length - issued < STAGING_CHUNK) ? length - issued : STAGING_CHUNK;
+			res = cuda_err_print(cuMemcpyDtoHAsync(stage->slots[slot], src + issued, next, 0), 0);
+			if (res == CUDA_SUCCESS)
+				res = cuda_err_print(cuEventRecord(done[slot], 0), 0);
+			issued += next;
+		}
+	}
+
+	sync_res = cuda_err_print(cuStreamSynchronize(0), 0);
+	destroy_events(done, STAGING_SLOTS);
+
+	return (res != CUDA_SUCCESS) ? res : sync_res;
+}
@@ -0,0 +1,46 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <stddef.h>
+#include <cuda.h>
+
+#include "pool.h"
+
+/*
+ * Chunked copies between host memory and a device through pinned staging
+ * slots, used by the executors for large memcpy payloads. A copy from
+ * pageable memory is staged by the driver anyway, one chunk after the
+ * other; here the DMA of a chunk overlaps with filling (or draining) the
+ * other slot, and for host-to-device copies with the network receiving
+ * the rest of the payload, since a chunk is copied as soon as it arrived.
+ *
+ * The slots come from the pinned pool of the device, the first time they
+ * are needed. Payloads that are in a pool buffer already are copied with
+ * DMA directly, chunk by chunk as they arrive.
+ */
+#define STAGING_SLOTS 2
+#define STAGING_CHUNK (1024 * 1024)
+#define STAGING_MIN_PAYLOAD (2 * STAGING_CHUNK)
+
+// Blocks until at least length bytes of the source are there; returns
+// how many are, which is less only if they will never be
+typedef size_t (*staging_wait_fn)(void *arg, size_t length);
+
+typedef struct staging_area_s {
+	pinned_pool *pool;
+	void *slots[STAGING_SLOTS];
+} staging_area;
+
+void init_staging_area(staging_area *stage, pinned_pool *pool);
+
+void free_staging_area(staging_area *stage);
+
+void set_thread_staging_area(staging_area *stage);
+
+staging_area *get_thread_staging_area(void);
+
+CUresult staged_memcpy_htod(staging_area *stage, CUdeviceptr dst, const void *src, size_t length, staging_wait_fn wait, void *arg);
+
+CUresult staged_memcpy_dtoh(staging_area *stage, void *dst, CUdeviceptr src, size_t length);
+
+#endif /* STAGING_H */
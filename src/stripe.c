@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "stripe.h"
+#include "protocol.h"
+#include "common.h"
+
+// Number of data connections asked for with GPUSOCK_STRIPES, 0 for none
+int get_stripe_count(void) {
+	const char *env = getenv("GPUSOCK_STRIPES");
+	int count;
+
+	if (env == NULL)
+		return 0;
+
+	count = atoi(env);
+	if (count < 2)
+		return 0;
+
+	return (count > STRIPE_MAX) ? STRIPE_MAX : count;
+}
+
+// Moves length bytes over a data connection; -1 if it broke
+static int stripe_io(int sock_fd, void *data, size_t length, int send_dir) {
+	size_t offset = 0;
+	ssize_t ret;
+
+	while (offset < length) {
+		if (send_dir)
+			ret = send(sock_fd, data + offset, length - offset, MSG_NOSIGNAL);
+		else
+			ret = recv(sock_fd, data + offset, length - offset, 0);
+		if (send_dir)
+			__atomic_fetch_add(&gs_io_stats.tx_syscalls, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&gs_io_stats.rx_syscalls, 1, __ATOMIC_RELAXED);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int run_stripe_job(int sock_fd, stripe_job *job) {
+	stripe_hdr hdr;
+
+	if (job->send) {
+		if (stripe_io(sock_fd, &job->hdr, sizeof(job->hdr), 1) < 0)
+			return -1;
+		return stripe_io(sock_fd, job->data, job->hdr.length, 1);
+	}
+
+	if (stripe_io(sock_fd, &hdr, sizeof(hdr), 0) < 0)
+		return -1;
+	// Both ends split payloads the same way and queue them in order
+	if (memcmp(&hdr, &job->hdr, sizeof(hdr)) != 0) {
+		fprintf(stderr, "Unexpected stripe %u of request %u, expected %u of request %u\n",
+				hdr.index, hdr.req_id, job->hdr.index, job->hdr.req_id);
+		return -1;
+	}
+
+	return stripe_io(sock_fd, job->data, job->hdr.length, 0);
+}
+
+static void finish_stripe_job(stripe_job *job, int failed) {
+	stripe_transfer *xfer = job->xfer;
+	void (*done)(stripe_transfer *xfer);
+	int last;
+
+	pthread_mutex_lock(&xfer->lock);
+	if (failed)
+		xfer->failed = 1;
+	last = (--xfer->remaining == 0);
+	done = xfer->done;
+	if (last && done == NULL)
+		pthread_cond_broadcast(&xfer->cond);
+	pthread_mutex_unlock(&xfer->lock);
+
+	// Nothing waits for the transfer, so it is ours now
+	if (last && done != NULL)
+		done(xfer);
+}
+
+static void *stripe_worker_loop(void *arg) {
+	stripe_worker *w = arg;
+	stripe_job *job;
+	int failed;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (list_empty(&w->jobs) && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (list_empty(&w->jobs)) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		job = list_first_entry(&w->jobs, stripe_job, node);
+		list_del(&job->node);
+		pthread_mutex_unlock(&w->lock);
+
+		failed = w->broken || run_stripe_job(w->sock_fd, job) < 0;
+		if (failed)
+			w->broken = 1;
+		finish_stripe_job(job, failed);
+	}
+
+	return NULL;
+}
+
+void init_stripe_set(stripe_set *set) {
+	int i;
+
+	set->count = 0;
+	for (i = 0; i < STRIPE_MAX; i++)
+		set->workers[i] = NULL;
+}
+
+// Starts the worker of data connection index; -1 if it has one already
+int add_stripe(stripe_set *set, int index, int sock_fd) {
+	stripe_worker *w;
+	int flags, ret;
+
+	if (index < 0 || index >= STRIPE_MAX || set->workers[index] != NULL)
+		return -1;
+
+	// The worker blocks on its socket
+	flags = fcntl(sock_fd, F_GETFL);
+	if (flags >= 0 && (flags & O_NONBLOCK))
+		fcntl(sock_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+	w = malloc_safe(sizeof(*w));
+	w->sock_fd = sock_fd;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	INIT_LIST_HEAD(&w->jobs);
+	w->stop = 0;
+	w->broken = 0;
+
+	ret = pthread_create(&w->thread, NULL, stripe_worker_loop, w);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	set->workers[index] = w;
+	set->count++;
+
+	return 0;
+}
+
+// Fails the transfers in progress, e.g. when the peer is gone
+void shutdown_stripe_set(stripe_set *set) {
+	int i;
+
+	for (i = 0; i < STRIPE_MAX; i++) {
+		if (set->workers[i] != NULL)
+			shutdown(set->workers[i]->sock_fd, SHUT_RDWR);
+	}
+}
+
+// Stops the workers once their jobs have failed or gone through
+void close_stripe_set(stripe_set *set) {
+	stripe_worker *w;
+	int i;
+
+	shutdown_stripe_set(set);
+	for (i = 0; i < STRIPE_MAX; i++) {
+		if ((w = set->workers[i]) == NULL)
+			continue;
+
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+
+		close(w->sock_fd);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		set->workers[i] = NULL;
+	}
+	set->count = 0;
+}
+
+void init_stripe_transfer(stripe_transfer *xfer) {
+	pthread_mutex_init(&xfer->lock, NULL);
+	pthread_cond_init(&xfer->cond, NULL);
+	xfer->remaining = 0;
+	xfer->failed = 0;
+	xfer->done = NULL;
+}
+
+void free_stripe_transfer(stripe_transfer *xfer) {
+	pthread_cond_destroy(&xfer->cond);
+	pthread_mutex_destroy(&xfer->lock);
+}
+
+/*
+ * Queues the stripes of length bytes at data to the workers of the set,
+ * to be sent or received. The set must have all its workers. Stripes are
+ * whole multiples of STRIPE_ALIGN but the last, and empty ones are left
+ * out on both ends.
+ */
+void start_stripe_transfer(stripe_set *set, stripe_transfer *xfer, int send_dir, uint32_t req_id, void *data, uint64_t length, void (*done)(stripe_transfer *xfer)) {
+	stripe_worker *w;
+	stripe_job *job;
+	uint64_t per_stripe, offset;
+	int i, count = 0;
+
+	per_stripe = (length + set->count - 1) / set->count;
+	per_stripe = (per_stripe + STRIPE_ALIGN - 1) & ~((uint64_t) STRIPE_ALIGN - 1);
+
+	xfer->failed = 0;
+	xfer->done = done;
+	for (i = 0, offset = 0; i < set->count && offset < length; i++, offset += per_stripe) {
+		job = &xfer->jobs[count++];
+		job->xfer = xfer;
+		job->send = send_dir;
+		job->data = data + offset;
+		memset(&job->hdr, 0, sizeof(job->hdr));
+		job->hdr.req_id = req_id;
+		job->hdr.index = i;
+		job->hdr.offset = offset;
+		job->hdr.length = (length - offset < per_stripe) ? length - offset : per_stripe;
+	}
+	// Counted in full before any worker can finish its stripe
+	xfer->remaining = count;
+
+	gdprintf("%s %" PRIu64 " bytes of request %u in %d stripes\n", send_dir ? "Sending" : "Receiving",
+			length, req_id, count);
+	for (i = 0; i < count; i++) {
+		w = set->workers[i];
+		pthread_mutex_lock(&w->lock);
+		list_add_tail(&xfer->jobs[i].node, &w->jobs);
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if (count == 0 && done != NULL)
+		done(xfer);
+}
+
+// Returns 0 once every stripe went through, -1 if any did not
+int wait_stripe_transfer(stripe_transfer *xfer) {
+	int failed;
+
+	pthread_mutex_lock(&xfer->lock);
+	while (xfer->remaining > 0)
+		pthread_cond_wait(&xfer->cond, &xfer->lock);
+	failed = xfer->failed;
+	pthread_mutex_unlock(&xfer->lock);
+
+	return failed ? -1 : 0;
+}
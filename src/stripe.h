@@ -0,0 +1,92 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "list.h"
+
+/*
+ * Striping of large memcpy payloads over data connections, for links a
+ * single TCP stream cannot fill. With GPUSOCK_STRIPES=n (2 to STRIPE_MAX),
+ * a TCP client asks the server for a token right after INIT (STRIPE_OPEN)
+ * and opens n more connections to it, each of which announces itself with
+ * STRIPE_ATTACH, the token and its index. Commands and results stay on the
+ * primary connection. A payload of at least STRIPE_MIN_PAYLOAD bytes is
+ * announced there with FRAME_F_STRIPED and split into n contiguous stripes,
+ * stripe i going over data connection i behind a stripe_hdr.
+ *
+ * Each data connection has a thread of its own on both ends, so stripes
+ * are sent and received in parallel, straight from and into the payload
+ * buffer. The stripes of successive payloads follow each other on every
+ * data connection in command order, which is the order both ends queue
+ * them in.
+ */
+#define STRIPE_MAX 8
+#define STRIPE_MIN_PAYLOAD (4 * 1024 * 1024)
+#define STRIPE_ALIGN (64 * 1024)
+
+typedef struct stripe_hdr_s {
+	uint32_t req_id;
+	uint32_t index;
+	uint64_t offset;
+	uint64_t length;
+} stripe_hdr;
+
+struct stripe_transfer_s;
+
+typedef struct stripe_job_s {
+	struct list_head node;
+	struct stripe_transfer_s *xfer;
+	int send;
+	stripe_hdr hdr;
+	void *data;		// start of the stripe
+} stripe_job;
+
+// A payload on its way over the data connections. Without a done callback
+// wait_stripe_transfer() blocks until every stripe is through; with one,
+// the last worker calls it instead.
+typedef struct stripe_transfer_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int remaining;
+	int failed;
+	void (*done)(struct stripe_transfer_s *xfer);
+	stripe_job jobs[STRIPE_MAX];
+} stripe_transfer;
+
+typedef struct stripe_worker_s {
+	int sock_fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head jobs;
+	int stop;
+	int broken;		// an I/O failed; the jobs left fail at once
+} stripe_worker;
+
+typedef struct stripe_set_s {
+	int count;
+	stripe_worker *workers[STRIPE_MAX];
+} stripe_set;
+
+int get_stripe_count(void);
+
+void init_stripe_set(stripe_set *set);
+
+int add_stripe(stripe_set *set, int index, int sock_fd);
+
+void shutdown_stripe_set(stripe_set *set);
+
+void close_stripe_set(stripe_set *set);
+
+void init_stripe_transfer(stripe_transfer *xfer);
+
+void free_stripe_transfer(stripe_transfer *xfer);
+
+void start_stripe_transfer(stripe_set *set, stripe_transfer *xfer, int send_dir, uint32_t req_id, void *data, uint64_t length, void (*done)(stripe_transfer *xfer));
+
+int wait_stripe_transfer(stripe_transfer *xfer);
+
+#endif /* STRIPE_H */
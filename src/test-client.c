@@ -69,7 +69,7 @@ int main(int argc, char *argv[]) {
 	  cmd1.str_args[0] = a;
 	  cmd1.str_args[1] = b;
 	*/
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd1);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd1);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd1.int_args);
@@ -90,7 +90,7 @@ int main(int argc, char *argv[]) {
 	cmd2.uint_args = malloc_safe(sizeof(*(cmd2.uint_args)) * cmd2.n_uint_args);
 	cmd2.uint_args[0] = 0;
 	cmd2.uint_args[1] = dev_ptr;
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd2);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd2);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd2.uint_args);
@@ -115,7 +115,7 @@ int main(int argc, char *argv[]) {
 	cmd3.extra_args[0].len = file_size;
 	//print_file_as_hex(cmd3.extra_args[0].data, cmd3.extra_args[0].len);
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd3);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd3);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(file);
@@ -140,7 +140,7 @@ int main(int argc, char *argv[]) {
 	cmd4.str_args = malloc_safe(sizeof(char *) * cmd4.n_str_args);
 	cmd4.str_args[0] = "matSum";
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd4);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd4);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd4.uint_args);
@@ -162,7 +162,7 @@ int main(int argc, char *argv[]) {
 	cmd5.uint_args = malloc_safe(sizeof(*(cmd5.uint_args)) * cmd5.n_uint_args);
 	cmd5.uint_args[0] = sizeof(int);
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd5);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd5);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd5.uint_args);
@@ -183,7 +183,7 @@ int main(int argc, char *argv[]) {
 	cmd6.uint_args = malloc_safe(sizeof(*(cmd6.uint_args)) * cmd6.n_uint_args);
 	cmd6.uint_args[0] = sizeof(int);
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd6);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd6);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd6.uint_args);
@@ -204,7 +204,7 @@ int main(int argc, char *argv[]) {
 	cmd7.uint_args = malloc_safe(sizeof(*(cmd7.uint_args)) * cmd7.n_uint_args);
 	cmd7.uint_args[0] = sizeof(int);
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd7);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd7);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd7.uint_args);
@@ -230,7 +230,7 @@ int main(int argc, char *argv[]) {
 	cmd8.uint_args = malloc_safe(sizeof(*(cmd8.uint_args)) * cmd8.n_uint_args);
 	cmd8.uint_args[0] = ptr1;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd8);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd8);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd8.extra_args);
@@ -256,7 +256,7 @@ int main(int argc, char *argv[]) {
 	cmd9.uint_args = malloc_safe(sizeof(*(cmd9.uint_args)) * cmd9.n_uint_args);
 	cmd9.uint_args[0] = ptr2;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd9);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd9);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd9.extra_args);
@@ -294,7 +294,7 @@ int main(int argc, char *argv[]) {
 	cmd10.uint_args[10] = ptr2;
 	cmd10.uint_args[11] = ptr3;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd10);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd10);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd10.uint_args);
@@ -315,7 +315,7 @@ int main(int argc, char *argv[]) {
 	cmd11.uint_args[0] = ptr3;
 	cmd11.uint_args[1] = sizeof(int);
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd11);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd11);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd11.uint_args);
@@ -337,7 +337,7 @@ int main(int argc, char *argv[]) {
 	cmd12.uint_args = malloc_safe(sizeof(*(cmd12.uint_args)) * cmd12.n_uint_args);
 	cmd12.uint_args[0] = ptr1;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd12);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd12);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd12.uint_args);
@@ -357,7 +357,7 @@ int main(int argc, char *argv[]) {
 	cmd13.uint_args = malloc_safe(sizeof(*(cmd13.uint_args)) * cmd13.n_uint_args);
 	cmd13.uint_args[0] = ptr2;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd13);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd13);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd13.uint_args);
@@ -377,7 +377,7 @@ int main(int argc, char *argv[]) {
 	cmd14.uint_args = malloc_safe(sizeof(*(cmd14.uint_args)) * cmd14.n_uint_args);
 	cmd14.uint_args[0] = ptr3;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd14);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd14);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd14.uint_args);
@@ -397,7 +397,7 @@ int main(int argc, char *argv[]) {
 	cmd15.uint_args = malloc_safe(sizeof(*(cmd15.uint_args)) * cmd15.n_uint_args);
 	cmd15.uint_args[0] = ctx_ptr;
 
-	buf_size = encode_message(&buffer, CUDA_CMD, &cmd15);
+	buf_size = encode_message(&buffer, CUDA_CMD, 0, &cmd15);
 	send_message(client_sock_fd, buffer, buf_size);
 
 	free(cmd15.uint_args);
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "common.h"
+#include "utils.h"
+
+#ifdef GPUSOCK_TRACE
+
+// The TSC is calibrated against the monotonic clock over this long
+#define TRACE_CALIBRATION_NS 20000000
+
+typedef struct trace_event_s {
+	uint64_t start;
+	uint64_t end;
+	uint64_t arg;
+	uint32_t type;
+} trace_event;
+
+typedef struct trace_ring_s {
+	struct trace_ring_s *next;
+	int tid;
+	uint64_t head;		// events recorded so far
+	trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+int gs_trace_enabled = 0;
+
+static __thread trace_ring *thread_ring = NULL;
+static trace_ring *rings = NULL;
+static int next_tid = 1;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static uint64_t base_stamp;
+static double cycles_per_us;
+static char dump_path[4096];
+
+static const char *event_names[TRACE_EVENT_TYPES] = {
+	[TRACE_RECEIVE] = "receive_message",
+	[TRACE_DECODE] = "decode_message",
+	[TRACE_ENCODE] = "encode_message",
+	[TRACE_SEND] = "send_message",
+	[TRACE_CUDA_CALL] = "cuda_call",
+};
+
+static const char *arg_names[TRACE_EVENT_TYPES] = {
+	[TRACE_RECEIVE] = "bytes",
+	[TRACE_DECODE] = "bytes",
+	[TRACE_ENCODE] = "bytes",
+	[TRACE_SEND] = "bytes",
+	[TRACE_CUDA_CALL] = "command",
+};
+
+#if !defined(__x86_64__) && !defined(__i386__)
+// No TSC to read; nanoseconds stand in for cycles
+uint64_t trace_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+static double get_cycles_per_us(void) {
+	struct timespec pause = { 0, TRACE_CALIBRATION_NS };
+	uint64_t ns, stamp, cycles;
+
+#if !defined(__x86_64__) && !defined(__i386__)
+	return 1000.0;
+#endif
+	ns = now_ns();
+	stamp = trace_clock();
+	nanosleep(&pause, NULL);
+	cycles = trace_clock() - stamp;
+	ns = now_ns() - ns;
+	if (ns >= TRACE_CALIBRATION_NS / 2 && cycles > 0)
+		return cycles / (ns / 1e3);
+
+	// The build reads it from /proc/cpuinfo, which gives the current clock
+	// of the build host rather than the TSC rate of this one
+	fprintf(stderr, "Cannot calibrate the TSC, trace timings may be off\n");
+#if defined(CYCLES_PER_SEC) && CYCLES_PER_SEC + 0 > 0
+	return CYCLES_PER_SEC / 1e6;
+#else
+	return 1000.0;
+#endif
+}
+
+static void dump_at_exit(void) {
+	FILE *f;
+
+	f = fopen(dump_path, "w");
+	if (f == NULL) {
+		perror("Cannot write the trace");
+		return;
+	}
+	trace_dump(f);
+	fclose(f);
+	fprintf(stderr, "Trace written to %s\n", dump_path);
+}
+
+static void init_tracing(void) {
+	const char *prefix = getenv("GPUSOCK_TRACE");
+
+	if (prefix == NULL || *prefix == '\0')
+		return;
+
+	cycles_per_us = get_cycles_per_us();
+	base_stamp = trace_clock();
+	snprintf(dump_path, sizeof(dump_path), "%s.%d.json", prefix, (int) getpid());
+	atexit(dump_at_exit);
+	gs_trace_enabled = 1;
+	gdprintf("Tracing at %.0f cycles/us into %s\n", cycles_per_us, dump_path);
+}
+
+// Turns tracing on if GPUSOCK_TRACE is set; only the first call counts
+void trace_init(void) {
+	pthread_once(&init_once, init_tracing);
+}
+
+static trace_ring *new_ring(void) {
+	trace_ring *ring;
+
+	ring = calloc_safe(1, sizeof(*ring));
+	// Rings outlive their threads, so that their events can be dumped
+	pthread_mutex_lock(&rings_lock);
+	ring->tid = next_tid++;
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	return ring;
+}
+
+// Records an event of the calling thread that started at start and ends now
+void trace_record(int type, uint64_t arg, trace_stamp start) {
+	trace_ring *ring = thread_ring;
+	trace_event *ev;
+	uint64_t head;
+
+	if (ring == NULL)
+		ring = thread_ring = new_ring();
+
+	head = ring->head;
+	ev = &ring->events[head % TRACE_RING_EVENTS];
+	ev->start = start;
+	ev->end = trace_clock();
+	ev->arg = arg;
+	ev->type = type;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static double stamp_to_us(uint64_t stamp) {
+	return (double) (int64_t) (stamp - base_stamp) / cycles_per_us;
+}
+
+// Writes the events of every ring as Chrome trace JSON
+int trace_dump(FILE *f) {
+	trace_ring *ring;
+	trace_event ev;
+	uint64_t head, i, first;
+	int pid = getpid(), sep = 0;
+
+	if (!gs_trace_enabled)
+		return -1;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+		for (i = first; i < head; i++) {
+			ev = ring->events[i % TRACE_RING_EVENTS];
+			if (ev.type >= TRACE_EVENT_TYPES || ev.end < ev.start)
+				continue;
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+					"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%" PRIu64 "}}",
+					sep ? "," : "", event_names[ev.type], pid, ring->tid,
+					stamp_to_us(ev.start), (ev.end - ev.start) / cycles_per_us,
+					arg_names[ev.type], ev.arg);
+			sep = 1;
+		}
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fprintf(f, "\n]}\n");
+
+	return 0;
+}
+
+#endif /* GPUSOCK_TRACE */
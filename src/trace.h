@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Hot path tracing, compiled in with --enable-trace (-DGPUSOCK_TRACE) and
+ * off until GPUSOCK_TRACE=prefix is set at run time, so that builds with
+ * tracing can run in production. Receiving, decoding, running, encoding
+ * and sending a message are stamped with the TSC (rdtsc), calibrated
+ * against the monotonic clock at start up; CYCLES_PER_SEC, if the build
+ * defines it, is only used when that fails.
+ *
+ * Every thread records into a ring of its own, without locks; the ring
+ * keeps the last TRACE_RING_EVENTS events. trace_dump() writes all the
+ * rings as Chrome trace JSON (chrome://tracing, Perfetto): at exit, to
+ * prefix.<pid>.json, and from the server's metrics endpoint at /trace.
+ * A dump taken while threads record may show a few events of a ring
+ * being overwritten.
+ *
+ * Without GPUSOCK_TRACE the macros below compile to nothing.
+ */
+#define TRACE_RING_EVENTS 16384
+
+enum {
+	TRACE_RECEIVE,
+	TRACE_DECODE,
+	TRACE_ENCODE,
+	TRACE_SEND,
+	// the CUDA call of a command, memcpys included however they are run
+	TRACE_CUDA_CALL,
+	TRACE_EVENT_TYPES
+};
+
+#ifdef GPUSOCK_TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define trace_clock() __rdtsc()
+#else
+uint64_t trace_clock(void);
+#endif
+
+typedef uint64_t trace_stamp;
+
+extern int gs_trace_enabled;
+
+void trace_init(void);
+
+void trace_record(int type, uint64_t arg, trace_stamp start);
+
+int trace_dump(FILE *f);
+
+// A stamp of 0 means tracing was off when the event started
+#define trace_begin() (gs_trace_enabled ? trace_clock() : 0)
+#define trace_end(type, arg, start) do { \
+		if ((start) != 0) \
+			trace_record(type, arg, start); \
+	} while (0)
+
+#else
+
+typedef int trace_stamp;
+
+#define trace_init() do { } while (0)
+#define trace_begin() 0
+#define trace_end(type, arg, start) do { (void) (start); } while (0)
+
+#endif /* GPUSOCK_TRACE */
+
+#endif /* TRACE_H */
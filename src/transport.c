@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "transport.h"
+#include "common.h"
+
+// Sizes end up in int arguments of setsockopt() and listen()
+static int get_env_size(const char *name, int def) {
+	const char *env = getenv(name);
+	char *end;
+	long val, unit = 1;
+
+	if (env == NULL)
+		return def;
+
+	val = strtol(env, &end, 10);
+	if (*end == 'k' || *end == 'K')
+		unit = 1024;
+	else if (*end == 'm' || *end == 'M')
+		unit = 1024 * 1024;
+
+	if (val < 0)
+		return def;
+	if (val > INT_MAX / unit) {
+		fprintf(stderr, "%s is too large, using %d\n", name, INT_MAX);
+		return INT_MAX;
+	}
+
+	return val * unit;
+}
+
+static int use_nodelay(void) {
+	static int enabled = -1;
+	const char *env;
+
+	if (enabled < 0) {
+		env = getenv("GPUSOCK_NODELAY");
+		enabled = (env == NULL || atoi(env) != 0);
+	}
+
+	return enabled;
+}
+
+static int copy_field(char *dst, size_t size, const char *src, size_t len) {
+	if (len >= size)
+		return -1;
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+
+	return 0;
+}
+
+/*
+ * Fills addr in from a URI of the forms above. A missing port is taken
+ * from default_port; "*" or an empty host mean any address. Returns 0 on
+ * success and -1 if the URI is malformed.
+ */
+int parse_transport_uri(transport_addr *addr, const char *uri, const char *default_port) {
+	const char *rest, *port, *end;
+
+	memset(addr, 0, sizeof(*addr));
+	if (strncmp(uri, "unix://", 7) == 0) {
+		addr->kind = TRANSPORT_UNIX;
+		rest = uri + 7;
+		if (*rest == '\0' || strlen(rest) >= sizeof(((struct sockaddr_un *) 0)->sun_path))
+			return -1;
+		return copy_field(addr->host, sizeof(addr->host), rest, strlen(rest));
+	}
+
+	if (strncmp(uri, "tcp6://", 7) == 0) {
+		addr->kind = TRANSPORT_TCP6;
+		rest = uri + 7;
+	} else if (strncmp(uri, "tcp://", 6) == 0) {
+		addr->kind = TRANSPORT_TCP;
+		rest = uri + 6;
+	} else if (strstr(uri, "://") != NULL) {
+		return -1;
+	} else {
+		// A bare host name
+		addr->kind = TRANSPORT_TCP;
+		if (copy_field(addr->host, sizeof(addr->host), uri, strlen(uri)) < 0)
+			return -1;
+		return copy_field(addr->port, sizeof(addr->port), default_port, strlen(default_port));
+	}
+
+	if (*rest == '[') {
+		// [v6 address]:port
+		end = strchr(rest, ']');
+		if (end == NULL || copy_field(addr->host, sizeof(addr->host), rest + 1, end - rest - 1) < 0)
+			return -1;
+		port = (end[1] == ':') ? end + 2 : NULL;
+		if (end[1] != '\0' && port == NULL)
+			return -1;
+	} else {
+		port = strrchr(rest, ':');
+		end = (port != NULL) ? port : rest + strlen(rest);
+		if (port != NULL)
+			port++;
+		if (copy_field(addr->host, sizeof(addr->host), rest, end - rest) < 0)
+			return -1;
+	}
+
+	if (strcmp(addr->host, "*") == 0)
+		addr->host[0] = '\0';
+	if (port == NULL || *port == '\0')
+		port = default_port;
+
+	return copy_field(addr->port, sizeof(addr->port), port, strlen(port));
+}
+
+/*
+ * Reads the server addresses from the environment. With passive set
+ * (for the server), bare host names are ignored and it listens on any
+ * address, as it always did. Returns the number of addresses.
+ */
+int get_server_addrs(transport_addr *addrs, int max_addrs, int passive) {
+	const char *servers = getenv("GPUSOCK_SERVER"),
+		  *port = getenv("GPUSOCK_PORT"),
+		  *unix_path = getenv("GPUSOCK_UNIX_PATH");
+	char *list, *uri, *saveptr = NULL;
+	int count = 0;
+
+	if (servers == NULL) {
+		servers = DEFAULT_SERVER_IP;
+		gdprintf("GPUSOCK_SERVER not defined, using default server: %s\n", servers);
+	}
+	if (port == NULL) {
+		port = DEFAULT_SERVER_PORT;
+		gdprintf("GPUSOCK_PORT not defined, using default server port: %s\n", port);
+	}
+
+	if (unix_path != NULL && count < max_addrs) {
+		addrs[count].kind = TRANSPORT_UNIX;
+		if (copy_field(addrs[count].host, sizeof(addrs[count].host), unix_path, strlen(unix_path)) == 0)
+			count++;
+		else
+			fprintf(stderr, "Ignoring GPUSOCK_UNIX_PATH: path too long\n");
+	}
+
+	list = strdup(servers);
+	if (list == NULL) {
+		perror("strdup failed");
+		exit(EXIT_FAILURE);
+	}
+	for (uri = strtok_r(list, ",", &saveptr); uri != NULL && count < max_addrs;
+			uri = strtok_r(NULL, ",", &saveptr)) {
+		while (*uri == ' ')
+			uri++;
+		if (parse_transport_uri(&addrs[count], uri, port) < 0) {
+			fprintf(stderr, "Ignoring malformed server address: %s\n", uri);
+			continue;
+		}
+		if (passive && strstr(uri, "://") == NULL)
+			addrs[count].host[0] = '\0';
+		count++;
+	}
+	free(list);
+
+	return count;
+}
+
+void format_transport_addr(const transport_addr *addr, char *buf, size_t size) {
+	const char *host = (addr->host[0] != '\0') ? addr->host : "*";
+
+	switch (addr->kind) {
+		case TRANSPORT_UNIX:
+			snprintf(buf, size, "unix://%s", addr->host);
+			break;
+		case TRANSPORT_TCP6:
+			snprintf(buf, size, "tcp6://[%s]:%s", host, addr->port);
+			break;
+		default:
+			snprintf(buf, size, "tcp://%s:%s", host, addr->port);
+			break;
+	}
+}
+
+// Applies the options of the transport; failures only cost performance
+void tune_socket(int sock_fd, transport_kind kind) {
+	int one = 1, size;
+
+	if (kind != TRANSPORT_UNIX && use_nodelay()) {
+		if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+			perror("setsockopt(TCP_NODELAY) failed");
+	}
+
+	size = get_env_size("GPUSOCK_SOCKBUF", TRANSPORT_DEFAULT_SOCKBUF);
+	if (size > 0) {
+		if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+			perror("setsockopt(SO_SNDBUF) failed");
+		if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+			perror("setsockopt(SO_RCVBUF) failed");
+	}
+}
+
+static int fill_unix_addr(struct sockaddr_un *un_addr, const char *path) {
+	memset(un_addr, 0, sizeof(*un_addr));
+	un_addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(un_addr->sun_path)) {
+		fprintf(stderr, "Unix socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(un_addr->sun_path, path);
+
+	return 0;
+}
+
+/*
+ * Removes a socket left behind by an earlier run. Anything that is not a
+ * socket, or a socket a server still answers on, is left alone and the
+ * server exits.
+ */
+static void remove_stale_socket(const struct sockaddr_un *un_addr) {
+	struct stat st;
+	int sock_fd;
+
+	if (lstat(un_addr->sun_path, &st) < 0) {
+		if (errno == ENOENT)
+			return;
+		perror("lstat failed");
+		exit(EXIT_FAILURE);
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s exists and is not a socket\n", un_addr->sun_path);
+		exit(EXIT_FAILURE);
+	}
+
+	sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock_fd < 0) {
+		perror("socket creation failed");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sock_fd, (const struct sockaddr *) un_addr, sizeof(*un_addr)) == 0) {
+		fprintf(stderr, "A server is already listening on %s\n", un_addr->sun_path);
+		exit(EXIT_FAILURE);
+	}
+	close(sock_fd);
+
+	unlink(un_addr->sun_path);
+}
+
+static struct addrinfo *resolve_addr(const transport_addr *addr, int passive) {
+	struct addrinfo hints, *res = NULL;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = (addr->kind == TRANSPORT_TCP6) ? AF_INET6 : AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	ret = getaddrinfo((addr->host[0] != '\0') ? addr->host : NULL, addr->port, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "getaddrinfo failed: [%d] %s\n", ret, gai_strerror(ret));
+		return NULL;
+	}
+
+	return res;
+}
+
+/*
+ * Connects to a server address. Returns the socket, or -1 so that the
+ * caller can try its next address.
+ */
+int transport_connect(const transport_addr *addr) {
+	struct addrinfo *res, *ai;
+	struct sockaddr_un un_addr;
+	int sock_fd = -1;
+
+	if (addr->kind == TRANSPORT_UNIX) {
+		sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock_fd < 0) {
+			perror("socket creation failed");
+			return -1;
+		}
+		tune_socket(sock_fd, addr->kind);
+		if (fill_unix_addr(&un_addr, addr->host) < 0) {
+			close(sock_fd);
+			return -1;
+		}
+		if (connect(sock_fd, (struct sockaddr *) &un_addr, sizeof(un_addr)) < 0) {
+			perror("connect failed");
+			close(sock_fd);
+			return -1;
+		}
+		return sock_fd;
+	}
+
+	res = resolve_addr(addr, 0);
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sock_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (sock_fd < 0) {
+			perror("socket creation failed");
+			continue;
+		}
+		// Before connect(), so that the window scale is negotiated for them
+		tune_socket(sock_fd, addr->kind);
+		if (connect(sock_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		perror("connect failed");
+		close(sock_fd);
+		sock_fd = -1;
+	}
+	if (res != NULL)
+		freeaddrinfo(res);
+
+	return sock_fd;
+}
+
+// Creates a listening socket for a server address; exits on failure
+int transport_listen(const transport_addr *addr) {
+	struct addrinfo *res = NULL;
+	struct sockaddr_un un_addr;
+	int sock_fd, one = 1, backlog;
+
+	if (addr->kind == TRANSPORT_UNIX) {
+		sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock_fd < 0) {
+			perror("socket creation failed");
+			exit(EXIT_FAILURE);
+		}
+		if (fill_unix_addr(&un_addr, addr->host) < 0)
+			exit(EXIT_FAILURE);
+		remove_stale_socket(&un_addr);
+		if (bind(sock_fd, (struct sockaddr *) &un_addr, sizeof(un_addr)) < 0) {
+			perror("bind failed");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		res = resolve_addr(addr, 1);
+		if (res == NULL)
+			exit(EXIT_FAILURE);
+
+		sock_fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+		if (sock_fd < 0) {
+			perror("socket creation failed");
+			exit(EXIT_FAILURE);
+		}
+		if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+			perror("setsockopt(SO_REUSEADDR) failed");
+		// Accepted sockets inherit the buffer sizes
+		tune_socket(sock_fd, addr->kind);
+
+		if (bind(sock_fd, res->ai_addr, res->ai_addrlen) < 0) {
+			perror("bind failed");
+			exit(EXIT_FAILURE);
+		}
+		freeaddrinfo(res);
+	}
+
+	backlog = get_env_size("GPUSOCK_BACKLOG", TRANSPORT_DEFAULT_BACKLOG);
+	if (listen(sock_fd, backlog) < 0) {
+		perror("listen failed");
+		exit(EXIT_FAILURE);
+	}
+
+	return sock_fd;
+}
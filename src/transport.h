@@ -0,0 +1,55 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/*
+ * Transports the client and server talk over, selected by URI in
+ * GPUSOCK_SERVER:
+ *   tcp://host:port       TCP over IPv4
+ *   tcp6://[host]:port    TCP over IPv6
+ *   unix:///path          Unix domain socket, which also enables the
+ *                         shared memory transport
+ * A bare host name means tcp://host with the port from GPUSOCK_PORT, as
+ * before. Several URIs can be given separated by commas: the server
+ * listens on all of them and the client connects to the first one that
+ * accepts. GPUSOCK_UNIX_PATH=path is short for a leading unix://path.
+ *
+ * TCP sockets get TCP_NODELAY (unless GPUSOCK_NODELAY=0), so that small
+ * commands and their results are not held back by Nagle's algorithm.
+ * TCP_QUICKACK is not used: the kernel clears it again, so it would have
+ * to be set after every receive. GPUSOCK_SOCKBUF sets SO_SNDBUF/SO_RCVBUF
+ * (with a K or M suffix; 0 leaves them to the kernel's autotuning) and
+ * GPUSOCK_BACKLOG the listen backlog.
+ */
+#define TRANSPORT_MAX_ADDRS 8
+#define TRANSPORT_DEFAULT_SOCKBUF (4 * 1024 * 1024)
+#define TRANSPORT_DEFAULT_BACKLOG SOMAXCONN
+
+typedef enum transport_kind_e {
+	TRANSPORT_TCP,
+	TRANSPORT_TCP6,
+	TRANSPORT_UNIX
+} transport_kind;
+
+typedef struct transport_addr_s {
+	transport_kind kind;
+	char host[NI_MAXHOST];	// path for Unix domain sockets, empty for any address
+	char port[NI_MAXSERV];
+} transport_addr;
+
+int parse_transport_uri(transport_addr *addr, const char *uri, const char *default_port);
+
+int get_server_addrs(transport_addr *addrs, int max_addrs, int passive);
+
+void format_transport_addr(const transport_addr *addr, char *buf, size_t size);
+
+void tune_socket(int sock_fd, transport_kind kind);
+
+int transport_connect(const transport_addr *addr);
+
+int transport_listen(const transport_addr *addr);
+
+#endif /* TRANSPORT_H */
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+#include "common.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+#define URING_BGID 0
+
+static struct io_uring ring;
+static struct io_uring_buf_ring *buf_ring = NULL;
+static void *bufs = NULL;
+// Buffers handed out by the last uring_wait(), given back by the next one
+static int used_bufs[URING_BUF_COUNT];
+static int n_used_bufs = 0;
+
+int uring_init(void) {
+	int ret, i;
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	buf_ring = io_uring_setup_buf_ring(&ring, URING_BUF_COUNT, URING_BGID, 0, &ret);
+	if (buf_ring == NULL) {
+		fprintf(stderr, "io_uring_setup_buf_ring failed: %s\n", strerror(-ret));
+		io_uring_queue_exit(&ring);
+		return -1;
+	}
+
+	bufs = malloc_safe((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+	for (i = 0; i < URING_BUF_COUNT; i++)
+		io_uring_buf_ring_add(buf_ring, bufs + (size_t) i * URING_BUF_SIZE, URING_BUF_SIZE, i,
+				io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+	io_uring_buf_ring_advance(buf_ring, URING_BUF_COUNT);
+
+	return 0;
+}
+
+void uring_exit(void) {
+	io_uring_free_buf_ring(&ring, buf_ring, URING_BUF_COUNT, URING_BGID);
+	io_uring_queue_exit(&ring);
+	free(bufs);
+	buf_ring = NULL;
+	bufs = NULL;
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ring);
+	if (sqe == NULL) {
+		// The submission queue is full: hand it over and retry
+		io_uring_submit(&ring);
+		sqe = io_uring_get_sqe(&ring);
+	}
+	if (sqe == NULL) {
+		fprintf(stderr, "io_uring submission queue full\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return sqe;
+}
+
+void uring_add_accept(int fd, io_op *op) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, SOCK_CLOEXEC);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+void uring_add_recv(int fd, io_op *op) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data(sqe, op);
+}
+
+void uring_add_poll(int fd, io_op *op) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+/*
+ * Queues a send of the whole buffer. With link set, the next send only
+ * starts once this one is complete, which keeps the parts of a response
+ * in order.
+ */
+void uring_add_send(int fd, const void *buf, size_t len, io_op *op, int link) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_send(sqe, fd, buf, len, MSG_WAITALL | MSG_NOSIGNAL);
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+	io_uring_sqe_set_data(sqe, op);
+}
+
+// Cancels an armed operation; the cancellation itself has no completion
+// for the caller, the operation ends with -ECANCELED
+void uring_cancel(io_op *op) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_cancel(sqe, op, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+// Submits what has been queued and waits for at least one completion
+int uring_wait(io_event *events, int max_events) {
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int i, count = 0, ret, bid;
+
+	for (i = 0; i < n_used_bufs; i++)
+		io_uring_buf_ring_add(buf_ring, bufs + (size_t) used_bufs[i] * URING_BUF_SIZE, URING_BUF_SIZE,
+				used_bufs[i], io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+	io_uring_buf_ring_advance(buf_ring, n_used_bufs);
+	n_used_bufs = 0;
+
+	ret = io_uring_submit_and_wait(&ring, 1);
+	if (ret < 0 && ret != -EINTR) {
+		fprintf(stderr, "io_uring_submit_and_wait failed: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	io_uring_for_each_cqe(&ring, head, cqe) {
+		if (count == max_events)
+			break;
+		events[count].op = io_uring_cqe_get_data(cqe);
+		events[count].res = cqe->res;
+		events[count].more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+		events[count].data = NULL;
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			events[count].data = bufs + (size_t) bid * URING_BUF_SIZE;
+			used_bufs[n_used_bufs++] = bid;
+		}
+		count++;
+	}
+	io_uring_cq_advance(&ring, count);
+
+	return count;
+}
+
+#else /* !HAVE_LIBURING */
+
+int uring_init(void) {
+	fprintf(stderr, "Built without io_uring support\n");
+	return -1;
+}
+
+void uring_exit(void) {
+}
+
+void uring_add_accept(int fd, io_op *op) {
+}
+
+void uring_add_recv(int fd, io_op *op) {
+}
+
+void uring_add_poll(int fd, io_op *op) {
+}
+
+void uring_add_send(int fd, const void *buf, size_t len, io_op *op, int link) {
+}
+
+void uring_cancel(io_op *op) {
+}
+
+int uring_wait(io_event *events, int max_events) {
+	return -1;
+}
+
+#endif /* HAVE_LIBURING */
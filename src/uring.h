@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+/*
+ * io_uring I/O engine of the server, selected with GPUSOCK_IO_ENGINE=io_uring
+ * when built with liburing. Listening sockets use multishot accept and
+ * sessions multishot receive into a provided buffer ring, so reading from
+ * a session costs no syscall of its own; each response goes out as a chain
+ * of linked sends (frame, then out-of-band payload). Everything queued
+ * while handling a batch of completions is submitted by the single
+ * io_uring_enter() that waits for the next batch.
+ *
+ * No fixed buffers are registered (io_uring_register_buffers): received
+ * chunks are copied out of the provided buffers into the session's reader,
+ * and payloads are sent from wherever the result keeps them, with plain
+ * sends.
+ */
+#define URING_ENTRIES 512
+#define URING_BUF_COUNT 256		// a power of 2
+#define URING_BUF_SIZE (32 * 1024)
+#define URING_MAX_SEND (1 << 30)	// completions report int byte counts
+
+typedef enum io_op_type_e {
+	IO_OP_ACCEPT,
+	IO_OP_RECV,
+	IO_OP_SEND,
+	IO_OP_POLL
+} io_op_type;
+
+// Ties completions to whatever the operation was queued for
+typedef struct io_op_s {
+	io_op_type type;
+	void *owner;
+} io_op;
+
+typedef struct io_event_s {
+	io_op *op;
+	int res;
+	int more;		// the operation stays armed
+	void *data;		// received data, valid until the next uring_wait()
+} io_event;
+
+int uring_init(void);
+
+void uring_exit(void);
+
+void uring_add_accept(int fd, io_op *op);
+
+void uring_add_recv(int fd, io_op *op);
+
+void uring_add_poll(int fd, io_op *op);
+
+void uring_add_send(int fd, const void *buf, size_t len, io_op *op, int link);
+
+void uring_cancel(io_op *op);
+
+int uring_wait(io_event *events, int max_events);
+
+#endif /* URING_H */
@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "utils.h"
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t parse_bytes(const char *arg, char **end) {
+	char *suffix;
+	uint64_t bytes = strtoull(arg, &suffix, 0);
+
+	switch (*suffix) {
+		case 'G':
+			bytes <<= 10;
+			/* fall through */
+		case 'M':
+			bytes <<= 10;
+			/* fall through */
+		case 'K':
+			bytes <<= 10;
+			suffix++;
+			break;
+	}
+	if (end != NULL)
+		*end = suffix;
+
+	return bytes;
+}
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+double percentile_us(uint64_t *sorted, long n, double p) {
+	long rank = (long) (p * n + 0.999999);
+
+	if (n == 0)
+		return 0;
+	if (rank < 1)
+		rank = 1;
+
+	return sorted[(rank > n) ? n - 1 : rank - 1] / 1e3;
+}
@@ -0,0 +1,21 @@
+#ifndef UTILS_H
+#define UTILS_H
+
+#include <stdint.h>
+
+// Helpers shared by the server, the wrapper and the tools
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t now_ns(void);
+
+// Parses a byte count with an optional K, M or G suffix; end, if given, is
+// left past the suffix
+uint64_t parse_bytes(const char *arg, char **end);
+
+// qsort() comparator for uint64_t
+int compare_u64(const void *a, const void *b);
+
+// Nearest-rank percentile of n sorted nanosecond samples, in microseconds
+double percentile_us(uint64_t *sorted, long n, double p);
+
+#endif /* UTILS_H */
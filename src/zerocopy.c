@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "zerocopy.h"
+#include "protocol.h"
+#include "common.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+typedef struct zc_held_s {
+	struct list_head node;
+	uint32_t end;		// released once the sends before it completed
+	void *arg;
+} zc_held;
+
+static int seq_before(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) < 0;
+}
+
+void init_zc_tracker(zc_tracker *zc, zc_release_fn release) {
+	zc->enabled = 0;
+	zc->next_seq = 0;
+	zc->done_seq = 0;
+	INIT_LIST_HEAD(&zc->held);
+	zc->release = release;
+}
+
+// Returns 1 if payloads can be sent with MSG_ZEROCOPY on the socket
+int zc_enable(zc_tracker *zc, int sock_fd) {
+	const char *env = getenv("GPUSOCK_ZEROCOPY");
+	int one = 1;
+
+	if (env != NULL && atoi(env) == 0)
+		return 0;
+
+	// Fails on Unix domain sockets and kernels before 4.14
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+		return 0;
+
+	zc->enabled = 1;
+	return 1;
+}
+
+/*
+ * Sends as much of the payload as the socket takes, with MSG_ZEROCOPY as
+ * long as the kernel accepts it, and returns how much that was; on a
+ * blocking socket that is all of it. Returns -1 with errno set if nothing
+ * could be sent. The caller must zc_hold() the buffer right after.
+ */
+ssize_t zc_send(zc_tracker *zc, int sock_fd, const void *data, size_t length) {
+	size_t offset = 0;
+	ssize_t b_written;
+	int zerocopy = zc->enabled;
+
+	gdprintf("Going to send %zu bytes of bulk data with MSG_ZEROCOPY...\n", length);
+	while (offset < length) {
+		b_written = send(sock_fd, data + offset, length - offset,
+				zerocopy ? MSG_ZEROCOPY | MSG_NOSIGNAL : MSG_NOSIGNAL);
+		if (b_written < 0) {
+			if (errno == EINTR)
+				continue;
+			// Out of option memory for pinned pages: copy the rest
+			if (errno == ENOBUFS && zerocopy) {
+				zerocopy = 0;
+				continue;
+			}
+			return (offset > 0) ? (ssize_t) offset : -1;
+		}
+		if (zerocopy)
+			zc->next_seq++;
+		offset += b_written;
+	}
+
+	return offset;
+}
+
+// Keeps arg until the zerocopy sends made so far have completed
+void zc_hold(zc_tracker *zc, void *arg) {
+	zc_held *held;
+
+	if (!seq_before(zc->done_seq, zc->next_seq)) {
+		zc->release(arg);
+		return;
+	}
+
+	held = malloc_safe(sizeof(*held));
+	held->end = zc->next_seq;
+	held->arg = arg;
+	list_add_tail(&held->node, &zc->held);
+}
+
+static void release_done(zc_tracker *zc) {
+	zc_held *held, *tmp;
+
+	list_for_each_entry_safe(held, tmp, &zc->held, node) {
+		if (seq_before(zc->done_seq, held->end))
+			break;
+		list_del(&held->node);
+		zc->release(held->arg);
+		free(held);
+	}
+}
+
+/*
+ * Reads the completions queued on the socket's error queue without
+ * blocking and releases the buffers they free. Returns the number of
+ * notifications read.
+ */
+int zc_reap(zc_tracker *zc, int sock_fd) {
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	} control;
+	int count = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+					!(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+				continue;
+
+			// ee_info..ee_data is the range of sends that completed
+			if (!seq_before(serr->ee_data, zc->done_seq))
+				zc->done_seq = serr->ee_data + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				// The kernel had to copy anyway (e.g. over loopback):
+				// zerocopy only adds overhead on this socket
+				gdprintf("Zerocopy sends were copied, disabling them\n");
+				zc->enabled = 0;
+			}
+			count++;
+		}
+	}
+
+	release_done(zc);
+
+	return count;
+}
+
+// Releases everything still held, when the socket is gone
+void free_zc_tracker(zc_tracker *zc) {
+	zc_held *held, *tmp;
+
+	list_for_each_entry_safe(held, tmp, &zc->held, node) {
+		list_del(&held->node);
+		zc->release(held->arg);
+		free(held);
+	}
+	zc->enabled = 0;
+}
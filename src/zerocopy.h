@@ -0,0 +1,48 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "list.h"
+
+/*
+ * MSG_ZEROCOPY sends of large out-of-band payloads. The kernel transmits
+ * straight from the pages of the buffer instead of copying it into socket
+ * buffers, so the buffer must stay untouched until the kernel reports on
+ * the socket's error queue that it is done with it. Every send() with
+ * MSG_ZEROCOPY that succeeds takes the next number of a per-socket
+ * counter, and completions report ranges of those numbers; over TCP they
+ * arrive in order, so the highest number reported is all the tracker
+ * needs to release the buffers held up to it.
+ *
+ * Only TCP sockets support it; GPUSOCK_ZEROCOPY=0 turns it off. Payloads
+ * below ZC_MIN_PAYLOAD are sent normally, as pinning their pages and
+ * handling the notification costs more than the copy.
+ */
+#define ZC_MIN_PAYLOAD (256 * 1024)
+
+typedef void (*zc_release_fn)(void *arg);
+
+typedef struct zc_tracker_s {
+	int enabled;
+	uint32_t next_seq;	// number of the next zerocopy send
+	uint32_t done_seq;	// sends before this one have completed
+	struct list_head held;	// buffers waiting for their sends, in order
+	zc_release_fn release;
+} zc_tracker;
+
+void init_zc_tracker(zc_tracker *zc, zc_release_fn release);
+
+int zc_enable(zc_tracker *zc, int sock_fd);
+
+ssize_t zc_send(zc_tracker *zc, int sock_fd, const void *data, size_t length);
+
+void zc_hold(zc_tracker *zc, void *arg);
+
+int zc_reap(zc_tracker *zc, int sock_fd);
+
+void free_zc_tracker(zc_tracker *zc);
+
+#endif /* ZEROCOPY_H */